@@ -0,0 +1,101 @@
+/*
+ * Sustained rate logger using PFsStreamWriter.
+ *
+ * Records are collected in RAM and written straight to a preallocated
+ * contiguous file. The worst case time spent in write(), in poll() and in
+ * the two together for one record is printed so the latency can be
+ * compared with the byte oriented DataloggerUSB example. poll() is where
+ * segments go to the drive, so it holds the long stalls.
+ */
+#include "mscFS.h"
+
+// Setup USBHost_t36 and as many HUB ports as needed.
+USBHost myusb;
+USBHub hub1(myusb);
+USBHub hub2(myusb);
+
+msController msDrive1(myusb);
+UsbFs msc1;
+
+PFsVolume vol;
+PFsStreamWriter writer;
+
+// Preallocated file size in bytes.
+const uint64_t LOG_SIZE = 64ULL*1024*1024;
+
+// Number of records to log.
+const uint32_t RECORD_COUNT = 500000;
+
+// Four 16 KB segments. Insure 4-byte alignment.
+const size_t BUF_SIZE = 65536;
+uint32_t buf32[BUF_SIZE/4];
+
+struct record_t {
+  uint32_t micros;
+  uint16_t adc[6];
+};
+//------------------------------------------------------------------------------
+void setup() {
+  Serial.begin(9600);
+  while (!Serial) {
+    ; // wait for serial port to connect.
+  }
+  myusb.begin();
+
+  Serial.print("\nInitializing USB MSC drive...");
+  if (!msc1.usbDriveBegin(&msDrive1) ||
+      !vol.begin((USBMSCDevice*)msc1.usbDrive())) {
+    Serial.println("initialization failed!");
+    while (1) {}
+  }
+  Serial.println("USB drive initialized.");
+
+  if (!writer.begin(&vol, "/stream.bin", LOG_SIZE,
+                    (uint8_t*)buf32, BUF_SIZE, 4)) {
+    Serial.println("writer.begin failed");
+    while (1) {}
+  }
+  Serial.printf("Segment size: %u bytes\n", writer.segmentSize());
+
+  record_t rec;
+  uint32_t maxLatency = 0;
+  uint32_t maxWrite = 0;
+  uint32_t maxPoll = 0;
+  uint32_t t0 = millis();
+  for (uint32_t i = 0; i < RECORD_COUNT; i++) {
+    rec.micros = micros();
+    for (uint8_t n = 0; n < 6; n++) {
+      rec.adc[n] = i + n;
+    }
+    uint32_t m = micros();
+    if (writer.write(&rec, sizeof(rec)) != sizeof(rec)) {
+      Serial.println("write failed");
+      break;
+    }
+    uint32_t w = micros() - m;
+    // Move queued segments to the drive while there is time to spare.
+    writer.poll();
+    m = micros() - m;
+    if (w > maxWrite) {
+      maxWrite = w;
+    }
+    if (m - w > maxPoll) {
+      maxPoll = m - w;
+    }
+    if (m > maxLatency) {
+      maxLatency = m;
+    }
+  }
+  uint64_t bytes = writer.curPosition();
+  if (!writer.close()) {
+    Serial.println("close failed");
+  }
+  t0 = millis() - t0;
+  Serial.printf("%llu bytes in %u ms, %.2f MB/s\n", bytes, t0,
+                (float)bytes/(1000.0f*t0));
+  Serial.printf("Max write() latency: %u us\n", maxWrite);
+  Serial.printf("Max poll() latency: %u us\n", maxPoll);
+  Serial.printf("Max write() + poll() per record: %u us\n", maxLatency);
+}
+//------------------------------------------------------------------------------
+void loop() {}
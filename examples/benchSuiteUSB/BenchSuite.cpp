@@ -0,0 +1,255 @@
+#include "BenchSuite.h"
+
+static const char SEQ_PATH[] = "/bench/seq.bin";
+static const char RANDOM_PATH[] = "/bench/random.bin";
+static const char SMALL_DIR[] = "/bench/small";
+//------------------------------------------------------------------------------
+static int compareU32(const void* a, const void* b) {
+  uint32_t x = *reinterpret_cast<const uint32_t*>(a);
+  uint32_t y = *reinterpret_cast<const uint32_t*>(b);
+  return x < y ? -1 : x > y;
+}
+//------------------------------------------------------------------------------
+bool BenchSuite::begin(PFsVolume* vol, print_t* pr, uint8_t* buf,
+                       size_t bufSize, uint32_t* samples,
+                       uint32_t maxSamples) {
+  if (!vol || !pr || !buf || bufSize < 4096 || !samples || !maxSamples) {
+    return false;
+  }
+  m_vol = vol;
+  m_pr = pr;
+  m_buf = buf;
+  m_bufSize = bufSize;
+  m_samples = samples;
+  m_max = maxSamples;
+  for (size_t i = 0; i < bufSize; i++) {
+    buf[i] = 'A' + (i % 26);
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+// Percentiles use the first maxSamples operations of a test.
+bool BenchSuite::startSamples(uint32_t n) {
+  m_count = 0;
+  return n != 0;
+}
+//------------------------------------------------------------------------------
+// Nearest rank percentile of the sorted samples.
+uint32_t BenchSuite::percentile(uint32_t perMille) {
+  uint32_t rank = ((uint64_t)perMille*m_count + 999)/1000;
+  return m_count ? m_samples[rank ? rank - 1 : 0] : 0;
+}
+//------------------------------------------------------------------------------
+void BenchSuite::printHeader() {
+  m_pr->println(F("test,param,ops,KB/s,p50_us,p99_us,p99.9_us,max_us"));
+}
+//------------------------------------------------------------------------------
+void BenchSuite::report(const char* test, const char* param, uint64_t bytes,
+                        uint32_t us) {
+  qsort(m_samples, m_count, sizeof(uint32_t), compareU32);
+  m_pr->print(test);
+  m_pr->write(',');
+  m_pr->print(param);
+  m_pr->write(',');
+  m_pr->print(m_count);
+  m_pr->write(',');
+  m_pr->print(us ? (uint32_t)(bytes*1000/us) : 0);
+  m_pr->write(',');
+  m_pr->print(percentile(500));
+  m_pr->write(',');
+  m_pr->print(percentile(990));
+  m_pr->write(',');
+  m_pr->print(percentile(999));
+  m_pr->write(',');
+  m_pr->println(m_count ? m_samples[m_count - 1] : 0);
+}
+//------------------------------------------------------------------------------
+bool BenchSuite::sequential(uint32_t fileSize, size_t bufSize,
+                            bool preAllocate) {
+  PFsFile file;
+  char param[24];
+  uint32_t n = fileSize/bufSize;
+  uint32_t t;
+
+  if (bufSize > m_bufSize || !startSamples(n) ||
+      !file.open(m_vol, SEQ_PATH, O_RDWR | O_CREAT | O_TRUNC)) {
+    return false;
+  }
+  snprintf(param, sizeof(param), "%u%s", (unsigned)bufSize,
+           preAllocate ? " prealloc" : "");
+  t = micros();
+  if (preAllocate && !file.preAllocate((uint64_t)n*bufSize)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t m = micros();
+    if (file.write(m_buf, bufSize) != bufSize) {
+      return false;
+    }
+    sample(micros() - m);
+  }
+  if (!file.sync()) {
+    return false;
+  }
+  report("write", param, (uint64_t)n*bufSize, micros() - t);
+
+  startSamples(n);
+  file.rewind();
+  t = micros();
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t m = micros();
+    if (file.read(m_buf, bufSize) != (int)bufSize) {
+      return false;
+    }
+    sample(micros() - m);
+    if (m_buf[bufSize - 1] != 'A' + ((bufSize - 1) % 26)) {
+      return false;
+    }
+  }
+  report("read", param, (uint64_t)n*bufSize, micros() - t);
+  return file.close();
+}
+//------------------------------------------------------------------------------
+bool BenchSuite::random4K(uint32_t fileSize, uint32_t ops) {
+  PFsFile file;
+  uint32_t blocks = fileSize/4096;
+  uint32_t t;
+
+  if (!blocks || !startSamples(ops) ||
+      !file.open(m_vol, RANDOM_PATH, O_RDWR | O_CREAT | O_TRUNC)) {
+    return false;
+  }
+  // Fill the file first, untimed, so every read has data.
+  for (uint32_t i = 0; i < blocks; i++) {
+    if (file.write(m_buf, 4096) != 4096) {
+      return false;
+    }
+  }
+  if (!file.sync()) {
+    return false;
+  }
+  m_seed = 1;
+  t = micros();
+  for (uint32_t i = 0; i < ops; i++) {
+    uint32_t m = micros();
+    if (!file.seekSet((uint64_t)(random() % blocks)*4096) ||
+        file.write(m_buf, 4096) != 4096) {
+      return false;
+    }
+    sample(micros() - m);
+  }
+  if (!file.sync()) {
+    return false;
+  }
+  report("random_write", "4096", (uint64_t)ops*4096, micros() - t);
+
+  startSamples(ops);
+  t = micros();
+  for (uint32_t i = 0; i < ops; i++) {
+    uint32_t m = micros();
+    if (!file.seekSet((uint64_t)(random() % blocks)*4096) ||
+        file.read(m_buf, 4096) != 4096) {
+      return false;
+    }
+    sample(micros() - m);
+  }
+  report("random_read", "4096", (uint64_t)ops*4096, micros() - t);
+  return file.close();
+}
+//------------------------------------------------------------------------------
+bool BenchSuite::smallFiles(uint32_t count) {
+  PFsBaseFile dir;
+  PFsBaseFile file;
+  char path[40];
+  char param[12];
+  uint32_t found = 0;
+  uint32_t t;
+
+  snprintf(param, sizeof(param), "%u", (unsigned)count);
+  if (!startSamples(count) || !m_vol->mkdir(SMALL_DIR)) {
+    return false;
+  }
+  t = micros();
+  for (uint32_t i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "%s/f%05u.txt", SMALL_DIR, (unsigned)i);
+    uint32_t m = micros();
+    if (!file.open(m_vol, path, O_RDWR | O_CREAT | O_TRUNC) ||
+        file.write(m_buf, 512) != 512 || !file.close()) {
+      return false;
+    }
+    sample(micros() - m);
+  }
+  report("create", param, (uint64_t)count*512, micros() - t);
+
+  startSamples(count);
+  if (!dir.open(m_vol, SMALL_DIR, O_RDONLY)) {
+    return false;
+  }
+  t = micros();
+  while (true) {
+    uint32_t m = micros();
+    if (!file.openNext(&dir, O_RDONLY)) {
+      break;
+    }
+    file.close();
+    sample(micros() - m);
+    found++;
+  }
+  report("list", param, 0, micros() - t);
+  dir.close();
+  if (found != count) {
+    return false;
+  }
+
+  startSamples(count);
+  t = micros();
+  for (uint32_t i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "%s/f%05u.txt", SMALL_DIR, (unsigned)i);
+    uint32_t m = micros();
+    if (!m_vol->remove(path)) {
+      return false;
+    }
+    sample(micros() - m);
+  }
+  report("delete", param, 0, micros() - t);
+  return m_vol->rmdir(SMALL_DIR);
+}
+//------------------------------------------------------------------------------
+bool BenchSuite::freeCount(uint32_t calls) {
+  char param[12];
+  uint32_t t;
+
+  snprintf(param, sizeof(param), "%u", (unsigned)calls);
+  startSamples(calls);
+  t = micros();
+  for (uint32_t i = 0; i < calls; i++) {
+    uint32_t m = micros();
+    if (m_vol->freeClusterCount() == (uint32_t)-1) {
+      return false;
+    }
+    sample(micros() - m);
+  }
+  report("freeClusterCount", param, 0, micros() - t);
+  return true;
+}
+//------------------------------------------------------------------------------
+bool BenchSuite::runAll(uint32_t fileSize, uint32_t randomOps,
+                        uint32_t fileCount) {
+  bool rtn = true;
+
+  if (!m_vol || (!m_vol->exists("/bench") && !m_vol->mkdir("/bench"))) {
+    return false;
+  }
+  printHeader();
+  for (size_t size = 512; size <= m_bufSize; size *= 8) {
+    rtn = sequential(fileSize, size, false) && rtn;
+    rtn = sequential(fileSize, size, true) && rtn;
+  }
+  rtn = random4K(fileSize, randomOps) && rtn;
+  rtn = smallFiles(fileCount) && rtn;
+  rtn = freeCount(100) && rtn;
+  m_vol->remove(SEQ_PATH);
+  m_vol->remove(RANDOM_PATH);
+  m_vol->rmdir("/bench");
+  return rtn;
+}
@@ -0,0 +1,73 @@
+/*
+ * Benchmark suite for PFsLib volumes, shared by benchSuiteUSB.ino and
+ * the host build in extras/host.
+ */
+#ifndef BenchSuite_h
+#define BenchSuite_h
+#include "USBFat.h"
+
+/**
+ * \class BenchSuite
+ * \brief Timed file system operations with CSV output.
+ *
+ * Each test times single operations with micros() and prints one CSV
+ * row: test, parameter, operation count, KB/s over the whole test and
+ * the p50/p99/p99.9/max operation latency in microseconds.
+ */
+class BenchSuite {
+ public:
+  /** Prepare a run.
+   * \param[in] vol Mounted volume to test, files go in /bench.
+   * \param[in] pr CSV output.
+   * \param[in] buf Data buffer, its size caps the buffer size sweep.
+   * \param[in] bufSize Size of buf, at least 4096.
+   * \param[in] samples Latency samples, at least one per operation.
+   * \param[in] maxSamples Entries in samples.
+   * \return true for success or false for failure.
+   */
+  bool begin(PFsVolume* vol, print_t* pr, uint8_t* buf, size_t bufSize,
+             uint32_t* samples, uint32_t maxSamples);
+  /** Run every test.
+   * \param[in] fileSize Bytes per sequential file.
+   * \param[in] randomOps 4 KiB random reads and writes.
+   * \param[in] fileCount Small files to create, list and delete.
+   * \return true if every test ran.
+   */
+  bool runAll(uint32_t fileSize, uint32_t randomOps, uint32_t fileCount);
+  /** Sequential write then read in bufSize pieces. */
+  bool sequential(uint32_t fileSize, size_t bufSize, bool preAllocate);
+  /** Random aligned 4 KiB writes then reads within a fileSize file. */
+  bool random4K(uint32_t fileSize, uint32_t ops);
+  /** Create, enumerate and delete count 512 byte files. */
+  bool smallFiles(uint32_t count);
+  /** Repeated freeClusterCount() calls. */
+  bool freeCount(uint32_t calls);
+  /** Print the CSV header. */
+  void printHeader();
+
+ private:
+  bool startSamples(uint32_t n);
+  void sample(uint32_t us) {
+    if (m_count < m_max) m_samples[m_count++] = us;
+  }
+  void report(const char* test, const char* param, uint64_t bytes,
+              uint32_t us);
+  uint32_t percentile(uint32_t perMille);
+  uint32_t random() {
+    // xorshift32
+    m_seed ^= m_seed << 13;
+    m_seed ^= m_seed >> 17;
+    m_seed ^= m_seed << 5;
+    return m_seed;
+  }
+
+  PFsVolume* m_vol = nullptr;
+  print_t*   m_pr = nullptr;
+  uint8_t*   m_buf = nullptr;
+  size_t     m_bufSize = 0;
+  uint32_t*  m_samples = nullptr;
+  uint32_t   m_max = 0;
+  uint32_t   m_count = 0;
+  uint32_t   m_seed = 1;
+};
+#endif  // BenchSuite_h
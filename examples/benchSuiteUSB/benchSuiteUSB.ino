@@ -0,0 +1,76 @@
+/*
+ * Benchmark suite for USB drives. Sweeps sequential buffer sizes with
+ * and without preallocation, then random 4 KiB I/O, small file
+ * create/list/delete and freeClusterCount(). Results are CSV with
+ * p50/p99/p99.9/max latency per operation.
+ *
+ * The same suite runs on a PC against a simulated drive, see extras/host.
+ */
+#include "mscFS.h"
+#include "BenchSuite.h"
+
+// Setup USBHost_t36 and as many HUB ports as needed.
+USBHost myusb;
+USBHub hub1(myusb);
+USBHub hub2(myusb);
+
+msController msDrive1(myusb);
+
+// Largest buffer in the sequential sweep.
+const size_t BUF_SIZE = 32768;
+
+// Size of the sequential and random test files in bytes.
+const uint32_t FILE_SIZE = 8UL << 20;
+
+// Number of random 4 KiB reads and writes.
+const uint32_t RANDOM_OPS = 1000;
+
+// Number of small files to create, list and delete.
+const uint32_t FILE_COUNT = 200;
+
+// Latency samples kept per test. Later operations are timed but not
+// included in the percentiles.
+const uint32_t MAX_SAMPLES = 16384;
+//==============================================================================
+// End of configuration constants.
+//------------------------------------------------------------------------------
+// Insure 4-byte alignment.
+uint32_t buf32[(BUF_SIZE + 3)/4];
+uint8_t* buf = (uint8_t*)buf32;
+uint32_t samples[MAX_SAMPLES];
+
+UsbFs msc1;
+BenchSuite bench;
+//------------------------------------------------------------------------------
+void setup() {
+  Serial.begin(9600);
+
+  // Wait for USB Serial
+  while (!Serial) {
+    SysCall::yield();
+  }
+
+  myusb.begin();
+
+  Serial.println(F("\nUse a freshly formatted Mass Storage drive for best performance."));
+}
+//------------------------------------------------------------------------------
+void loop() {
+  // Discard any input.
+  do {
+    delay(10);
+  } while (Serial.available() && Serial.read() >= 0);
+
+  Serial.println(F("Type any character to start"));
+  while (!Serial.available()) {
+    SysCall::yield();
+  }
+  if (!msc1.begin(&msDrive1)) {
+    msc1.initErrorHalt(&Serial);
+  }
+  if (!bench.begin(&msc1, &Serial, buf, BUF_SIZE, samples, MAX_SAMPLES) ||
+      !bench.runAll(FILE_SIZE, RANDOM_OPS, FILE_COUNT)) {
+    Serial.println(F("Benchmark failed"));
+  }
+  Serial.println(F("Done"));
+}
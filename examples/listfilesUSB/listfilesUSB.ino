@@ -8,6 +8,9 @@
  modified 17 Nov 2020
  by Warren Watson
  
+ Directories are read a few entries at a time with readDir(), which
+ fills an array of records without opening each file.
+ 
  This example code is in the public domain.
  	 
  */
@@ -47,7 +50,7 @@ void setup()
   }
   Serial.println("initialization done.");
 
-  File root = MSC.open("/");
+  PFsFile root = MSC.mscfs.open("/");
   
   printDirectory(root, 0);
   
@@ -59,25 +62,31 @@ void loop()
   // nothing happens after setup finishes.
 }
 
-void printDirectory(File dir, int numSpaces) {
-   while(true) {
-     File entry = dir.openNextFile();
-     if (! entry) {
-       //Serial.println("** no more files **");
-       break;
-     }
-     printSpaces(numSpaces);
-     Serial.print(entry.name());
-     if (entry.isDirectory()) {
-       Serial.println("/");
-       printDirectory(entry, numSpaces+2);
-     } else {
-       // files have sizes, directories do not
-       printSpaces(48 - numSpaces - strlen(entry.name()));
-       Serial.print("  ");
-       Serial.println(entry.size(), DEC);
+void printDirectory(PFsFile &dir, int numSpaces) {
+   PFsDirEnt_t entries[4];
+   int n;
+   while ((n = dir.readDir(entries, 4)) > 0) {
+     // Opening a subdirectory moves dir, so come back here after.
+     uint64_t pos = dir.curPosition();
+     for (int i = 0; i < n; i++) {
+       PFsDirEnt_t &entry = entries[i];
+       printSpaces(numSpaces);
+       Serial.print(entry.name);
+       if (entry.attributes & PFS_ATTRIB_DIRECTORY) {
+         Serial.println("/");
+         PFsFile sub;
+         if (sub.open(&dir, entry.index, O_RDONLY)) {
+           printDirectory(sub, numSpaces+2);
+           sub.close();
+         }
+       } else {
+         // files have sizes, directories do not
+         printSpaces(48 - numSpaces - strlen(entry.name));
+         Serial.print("  ");
+         Serial.println(entry.size, DEC);
+       }
      }
-     entry.close();
+     dir.seekSet(pos);
    }
 }
 
@@ -0,0 +1,100 @@
+// Reader for USBMSCDevice::traceDump() output, shared by the trace tools.
+//
+// The dump may be buried in a serial log, lines that are not part of it
+// are skipped. Timestamps are made relative to the first command so the
+// 32-bit micros() wrap does not matter for dumps shorter than 71 minutes.
+#ifndef MscTrace_h
+#define MscTrace_h
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+struct TraceCmd {
+  uint64_t start;     // microseconds after the first command started
+  uint32_t micros;    // duration
+  uint32_t lba;
+  uint32_t blocks;
+  uint8_t  opcode;
+  uint8_t  status;
+  uint8_t  senseKey;
+  uint8_t  asc;
+  uint8_t  ascq;
+};
+
+struct Trace {
+  uint32_t blockSize = 0;
+  uint32_t lost = 0;
+  std::vector<TraceCmd> cmds;
+};
+//------------------------------------------------------------------------------
+inline const char* traceOpName(uint8_t opcode) {
+  switch (opcode) {
+    case 0X28: return "READ10";
+    case 0X2A: return "WRITE10";
+    case 0X42: return "UNMAP";
+    case 0X12: return "INQUIRY";
+    case 0X15: return "MSELECT";
+    case 0X1A: return "MSENSE";
+    case 0X35: return "SYNC10";
+    default: return "OP??";
+  }
+}
+//------------------------------------------------------------------------------
+inline const char* traceSenseName(uint8_t key) {
+  static const char* names[16] = {
+    "NO_SENSE", "RECOVERED_ERROR", "NOT_READY", "MEDIUM_ERROR",
+    "HARDWARE_ERROR", "ILLEGAL_REQUEST", "UNIT_ATTENTION", "DATA_PROTECT",
+    "BLANK_CHECK", "VENDOR_SPECIFIC", "COPY_ABORTED", "ABORTED_COMMAND",
+    "RESERVED_C", "VOLUME_OVERFLOW", "MISCOMPARE", "RESERVED_F"};
+  return names[key & 0XF];
+}
+//------------------------------------------------------------------------------
+// Read the last dump in the file. Returns false if there is none.
+inline bool traceRead(FILE* file, Trace* trace) {
+  char line[256];
+  bool inDump = false;
+  bool found = false;
+  uint32_t prev = 0;
+  uint64_t base = 0;
+
+  while (fgets(line, sizeof(line), file)) {
+    unsigned long blockSize, count, lost;
+    unsigned long start, end, lba;
+    unsigned op, blocks, status, key, asc, ascq;
+    if (sscanf(line, "MSCTRACE 1 %lu %lu %lu",
+               &blockSize, &count, &lost) == 3) {
+      // A later dump replaces an earlier one.
+      trace->blockSize = blockSize;
+      trace->lost = lost;
+      trace->cmds.clear();
+      inDump = true;
+      found = true;
+    } else if (strncmp(line, "MSCTRACE END", 12) == 0) {
+      inDump = false;
+    } else if (inDump &&
+               sscanf(line, "T %lx %lx %x %lx %x %x %x %x %x", &start, &end,
+                      &op, &lba, &blocks, &status, &key, &asc, &ascq) == 9) {
+      TraceCmd c;
+      if (trace->cmds.empty()) {
+        prev = start;
+        base = 0;
+      }
+      // Keep a 64-bit clock across micros() wraps.
+      base += (uint32_t)(start - prev);
+      prev = start;
+      c.start = base;
+      c.micros = (uint32_t)(end - start);
+      c.lba = lba;
+      c.blocks = blocks;
+      c.opcode = op;
+      c.status = status;
+      c.senseKey = key;
+      c.asc = asc;
+      c.ascq = ascq;
+      trace->cmds.push_back(c);
+    }
+  }
+  return found;
+}
+#endif  // MscTrace_h
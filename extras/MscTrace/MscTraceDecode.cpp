@@ -0,0 +1,99 @@
+// Decode a USBMSCDevice::traceDump() capture into a command table.
+//
+// Build and run from this directory:
+//   g++ -O2 -o MscTraceDecode MscTraceDecode.cpp
+//   ./MscTraceDecode [-s stallMicros] serial.log
+//
+// Commands slower than stallMicros, 50000 by default, are marked and
+// listed at the end with the commands that led up to them.
+#include <stdlib.h>
+#include <algorithm>
+#include "MscTrace.h"
+
+const size_t CONTEXT = 4;
+//------------------------------------------------------------------------------
+static void printCmd(const Trace& t, size_t i, uint32_t stall) {
+  const TraceCmd& c = t.cmds[i];
+  printf("%6zu %12llu %9lu %-7s %10lu %6lu", i, (unsigned long long)c.start,
+         (unsigned long)c.micros, traceOpName(c.opcode), (unsigned long)c.lba,
+         (unsigned long)c.blocks);
+  if (c.status) {
+    printf("  ERR %02X %s %02X/%02X", c.status, traceSenseName(c.senseKey),
+           c.asc, c.ascq);
+  }
+  if (c.micros >= stall) {
+    printf("  STALL");
+  }
+  printf("\n");
+}
+//------------------------------------------------------------------------------
+static void summary(const Trace& t, uint8_t opcode) {
+  std::vector<uint32_t> us;
+  uint64_t blocks = 0;
+  for (const TraceCmd& c : t.cmds) {
+    if (c.opcode == opcode) {
+      us.push_back(c.micros);
+      blocks += c.blocks;
+    }
+  }
+  if (us.empty()) {
+    return;
+  }
+  std::sort(us.begin(), us.end());
+  // Nearest rank percentiles, as in the bench suite.
+  auto pct = [&](double p) {
+    size_t k = (size_t)(p*us.size() + 0.999999);
+    return us[k ? k - 1 : 0];
+  };
+  printf("%-7s %6zu cmds %10llu KB  p50 %lu  p99 %lu  max %lu us\n",
+         traceOpName(opcode), us.size(),
+         (unsigned long long)(blocks*t.blockSize/1024),
+         (unsigned long)pct(0.50), (unsigned long)pct(0.99),
+         (unsigned long)us.back());
+}
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  uint32_t stall = 50000;
+  const char* path = nullptr;
+  Trace t;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      stall = strtoul(argv[++i], nullptr, 0);
+    } else {
+      path = argv[i];
+    }
+  }
+  FILE* file = path ? fopen(path, "r") : stdin;
+  if (!file) {
+    fprintf(stderr, "Can't open %s\n", path);
+    return 1;
+  }
+  if (!traceRead(file, &t)) {
+    fprintf(stderr, "No MSCTRACE dump found\n");
+    return 1;
+  }
+  printf("block size %lu, %zu commands, %lu lost before the first\n",
+         (unsigned long)t.blockSize, t.cmds.size(), (unsigned long)t.lost);
+  printf("%6s %12s %9s %-7s %10s %6s\n",
+         "#", "start_us", "dur_us", "op", "lba", "blocks");
+  for (size_t i = 0; i < t.cmds.size(); i++) {
+    printCmd(t, i, stall);
+  }
+  printf("\n");
+  summary(t, 0X28);
+  summary(t, 0X2A);
+  summary(t, 0X42);
+  for (size_t i = 0; i < t.cmds.size(); i++) {
+    if (t.cmds[i].micros < stall) {
+      continue;
+    }
+    printf("\nstall at #%zu, gap after previous command %lld us:\n", i,
+           i ? (long long)(t.cmds[i].start -
+                           (t.cmds[i - 1].start + t.cmds[i - 1].micros)) : 0LL);
+    for (size_t k = i > CONTEXT ? i - CONTEXT : 0; k <= i; k++) {
+      printCmd(t, k, stall);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,110 @@
+// Render a USBMSCDevice::traceDump() capture as an SVG latency timeline.
+//
+// Build and run from this directory:
+//   g++ -O2 -o MscTraceTimeline MscTraceTimeline.cpp
+//   ./MscTraceTimeline [-s stallMicros] [-w width] serial.log > trace.svg
+//
+// The top lanes show when each READ and WRITE command was on the bus,
+// other commands share the WRITE lane.
+// The plot below gives each command's latency on a log scale against its
+// start time, so stalls stand out and line up with the commands around
+// them. Hover over a command for its details. Errors are red.
+#include <stdlib.h>
+#include <math.h>
+#include "MscTrace.h"
+
+const int LANE_HEIGHT = 24;
+const int PLOT_TOP = 80;
+const int PLOT_HEIGHT = 300;
+const int MARGIN = 60;
+//------------------------------------------------------------------------------
+static const char* color(const TraceCmd& c) {
+  return c.status ? "#d62728" : c.opcode == 0X2A ? "#2ca02c" :
+         c.opcode == 0X42 ? "#9467bd" : "#1f77b4";
+}
+//------------------------------------------------------------------------------
+static void title(const TraceCmd& c) {
+  printf("<title>%s lba %lu x%lu, %lu us at %llu us",
+         traceOpName(c.opcode), (unsigned long)c.lba, (unsigned long)c.blocks,
+         (unsigned long)c.micros, (unsigned long long)c.start);
+  if (c.status) {
+    printf(", error %02X %s %02X/%02X", c.status, traceSenseName(c.senseKey),
+           c.asc, c.ascq);
+  }
+  printf("</title>");
+}
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  uint32_t stall = 50000;
+  int width = 1600;
+  const char* path = nullptr;
+  Trace t;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      stall = strtoul(argv[++i], nullptr, 0);
+    } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+      width = atoi(argv[++i]);
+    } else {
+      path = argv[i];
+    }
+  }
+  FILE* file = path ? fopen(path, "r") : stdin;
+  if (!file) {
+    fprintf(stderr, "Can't open %s\n", path);
+    return 1;
+  }
+  if (!traceRead(file, &t) || t.cmds.empty()) {
+    fprintf(stderr, "No MSCTRACE commands found\n");
+    return 1;
+  }
+  uint64_t span = 1;
+  uint32_t maxUs = 1;
+  for (const TraceCmd& c : t.cmds) {
+    if (c.start + c.micros > span) span = c.start + c.micros;
+    if (c.micros > maxUs) maxUs = c.micros;
+  }
+  double plotW = width - 2*MARGIN;
+  double decades = ceil(log10((double)maxUs + 1));
+  if (decades < 1) decades = 1;
+  auto x = [&](uint64_t us) {return MARGIN + plotW*us/span;};
+  auto y = [&](uint32_t us) {
+    return PLOT_TOP + PLOT_HEIGHT - PLOT_HEIGHT*log10((double)us + 1)/decades;
+  };
+
+  printf("<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" "
+         "font-family=\"monospace\" font-size=\"11\">\n",
+         width, PLOT_TOP + PLOT_HEIGHT + 40);
+  printf("<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+  printf("<text x=\"4\" y=\"%d\">READ</text>\n", 8 + LANE_HEIGHT/2);
+  printf("<text x=\"4\" y=\"%d\">WRITE</text>\n", 8 + 3*LANE_HEIGHT/2);
+  // Latency grid, one line per decade.
+  for (int d = 0; d <= decades; d++) {
+    uint32_t us = (uint32_t)pow(10, d);
+    double gy = y(us);
+    printf("<line x1=\"%d\" y1=\"%.1f\" x2=\"%d\" y2=\"%.1f\" stroke=\"#ddd\"/>"
+           "<text x=\"4\" y=\"%.1f\">%lu us</text>\n", MARGIN, gy, width - MARGIN,
+           gy, gy + 4, (unsigned long)us);
+  }
+  printf("<line x1=\"%d\" y1=\"%.1f\" x2=\"%d\" y2=\"%.1f\" stroke=\"#d62728\" "
+         "stroke-dasharray=\"4 3\"/>\n", MARGIN, y(stall), width - MARGIN,
+         y(stall));
+  for (const TraceCmd& c : t.cmds) {
+    int lane = c.opcode == 0X28 ? 0 : 1;
+    double w = plotW*c.micros/span;
+    printf("<g fill=\"%s\">", color(c));
+    title(c);
+    printf("<rect x=\"%.2f\" y=\"%d\" width=\"%.2f\" height=\"%d\"/>",
+           x(c.start), 8 + lane*LANE_HEIGHT, w < 0.5 ? 0.5 : w,
+           LANE_HEIGHT - 4);
+    printf("<circle cx=\"%.2f\" cy=\"%.1f\" r=\"%d\"/></g>\n", x(c.start),
+           y(c.micros), c.micros >= stall ? 4 : 2);
+  }
+  printf("<text x=\"%d\" y=\"%d\">0</text><text x=\"%d\" y=\"%d\" "
+         "text-anchor=\"end\">%llu us, %zu commands, %lu lost</text>\n",
+         MARGIN, PLOT_TOP + PLOT_HEIGHT + 20, width - MARGIN,
+         PLOT_TOP + PLOT_HEIGHT + 20, (unsigned long long)span, t.cmds.size(),
+         (unsigned long)t.lost);
+  printf("</svg>\n");
+  return 0;
+}
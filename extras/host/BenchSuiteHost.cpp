@@ -0,0 +1,36 @@
+// Host runner for examples/benchSuiteUSB on a simulated USB drive.
+//
+// Usage: BenchSuiteHost [image [sizeMB [commandMicros [bytesPerSecond]]]]
+//
+// CSV goes to stdout. Latencies are simulated drive time plus host CPU time.
+#include "mscFS.h"
+#include "BenchSuite.h"
+
+static uint8_t buf[32768];
+static uint32_t samples[65536];
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : "BenchSuite.img";
+  uint32_t sizeMB = argc > 2 ? strtoul(argv[2], nullptr, 0) : 256;
+  uint32_t cmdUs = argc > 3 ? strtoul(argv[3], nullptr, 0) : 125;
+  uint32_t bps = argc > 4 ? strtoul(argv[4], nullptr, 0) : 40000000;
+  msController drive;
+  UsbFs fs;
+  BenchSuite bench;
+
+  if (!drive.attachImage(path, 512, sizeMB*2048)) {
+    fprintf(stderr, "Can't open %s\n", path);
+    return 1;
+  }
+  drive.setTiming(cmdUs, bps);
+  if (!fs.begin(&drive) && (!fs.format() || !fs.begin(&drive))) {
+    fprintf(stderr, "Format failed\n");
+    return 1;
+  }
+  if (!bench.begin(&fs, &Serial, buf, sizeof(buf), samples, 65536) ||
+      !bench.runAll(8UL << 20, 1000, 200)) {
+    fprintf(stderr, "Benchmark failed\n");
+    return 1;
+  }
+  return 0;
+}
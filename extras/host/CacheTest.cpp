@@ -0,0 +1,169 @@
+// USBmscSectorCache against a FileBlockDevice image.
+//
+// Usage: CacheTest [image]
+//
+// A random mix of single and multi-sector reads and writes goes through
+// the cache and to a RAM reference. Every read must match the reference
+// and, after flush(), so must the image. A second pass checks that a run
+// of consecutive dirty sectors spread over several ways is written back
+// with one device command. Last, cached sectors must be dropped, not read
+// or written, once the drive's media changes.
+#include "CountingDevice.h"
+#include "USBmscCache.h"
+
+const uint32_t IMAGE_SECTORS = 256;
+static uint8_t ref[IMAGE_SECTORS*512];
+//------------------------------------------------------------------------------
+static void fill(uint8_t* buf, uint32_t sector, uint32_t seed) {
+  for (int i = 0; i < 512; i++) {
+    buf[i] = sector*7 + seed*13 + i;
+  }
+}
+//------------------------------------------------------------------------------
+static bool checkImage(CountingDevice* dev) {
+  uint8_t buf[512];
+  for (uint32_t s = 0; s < IMAGE_SECTORS; s++) {
+    if (!dev->readSector(s, buf) || memcmp(buf, &ref[s*512], 512)) {
+      printf("image differs at sector %u\n", (unsigned)s);
+      return false;
+    }
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+static bool randomMix(CountingDevice* dev, USBmscSectorCache* cache) {
+  uint8_t buf[8*512];
+  srand(1);
+  for (uint32_t op = 0; op < 20000; op++) {
+    uint32_t sector = rand() % IMAGE_SECTORS;
+    uint32_t ns = rand() % 4 ? 1 : 1 + rand() % 8;
+    if (sector + ns > IMAGE_SECTORS) {
+      ns = IMAGE_SECTORS - sector;
+    }
+    if (rand() % 2) {
+      for (uint32_t i = 0; i < ns; i++) {
+        fill(&buf[512*i], sector + i, op);
+      }
+      if (!cache->writeSectors(sector, buf, ns)) {
+        printf("write failed, op %u\n", (unsigned)op);
+        return false;
+      }
+      memcpy(&ref[sector*512], buf, ns*512);
+    } else {
+      if (!cache->readSectors(sector, buf, ns)) {
+        printf("read failed, op %u\n", (unsigned)op);
+        return false;
+      }
+      if (memcmp(buf, &ref[sector*512], ns*512)) {
+        printf("stale read at sector %u, op %u\n", (unsigned)sector,
+               (unsigned)op);
+        return false;
+      }
+    }
+    if (op % 5000 == 4999 && !cache->syncDevice()) {
+      printf("sync failed\n");
+      return false;
+    }
+  }
+  return cache->flush() && checkImage(dev);
+}
+//------------------------------------------------------------------------------
+static bool coalesce(CountingDevice* dev, USBmscSectorCache* cache) {
+  uint8_t buf[512];
+  // Sector 9 takes way 0 of set 1, so 1 and 2 land in way 1 while 0 is
+  // in way 0. The run 0..2 must still be written with one command.
+  const uint32_t order[] = {0, 9, 1, 2};
+  cache->invalidate();
+  for (uint32_t s : order) {
+    fill(buf, s, 99);
+    memcpy(&ref[s*512], buf, 512);
+    if (!cache->writeSector(s, buf)) {
+      return false;
+    }
+  }
+  dev->clearCommands();
+  if (!cache->flush()) {
+    return false;
+  }
+  if (dev->commands() != 2) {
+    printf("flush used %u commands, expected 2\n", (unsigned)dev->commands());
+    return false;
+  }
+  return checkImage(dev);
+}
+//------------------------------------------------------------------------------
+// Cached sectors must not reach or stand for the media that replaced theirs.
+static bool fence(const char* path) {
+  msController drive;
+  USBMSCDevice usb;
+  USBmscCache<8, 4> cache;
+  uint8_t buf[512];
+  uint8_t zero[512];
+
+  memset(zero, 0, sizeof(zero));
+  if (!drive.attachImage(path, 512, 64) || !usb.begin(&drive) ||
+      !cache.begin(&usb)) {
+    printf("Can't open %s\n", path);
+    return false;
+  }
+  for (uint32_t s = 0; s < 4; s++) {
+    fill(buf, s, 1);
+    if (!cache.writeSector(s, buf)) {
+      return false;
+    }
+  }
+  // Swap the media, the image is recreated empty.
+  drive.detach();
+  remove(path);
+  if (!drive.attachImage(path, 512, 64)) {
+    return false;
+  }
+  // The first write back finds the change, the cache is fenced after it.
+  if (cache.flush() || cache.readSector(0, buf) || cache.flush()) {
+    printf("cache used after a media change\n");
+    return false;
+  }
+  for (uint32_t s = 0; s < 4; s++) {
+    if (!usb.readSector(s, buf) || memcmp(buf, zero, 512)) {
+      printf("cached sector %u reached the new media\n", (unsigned)s);
+      return false;
+    }
+  }
+  // Started again, it reads the new media and writes to it.
+  fill(buf, 0, 2);
+  if (!cache.begin(&usb) || !cache.readSector(1, zero) ||
+      !cache.writeSector(0, buf) || !cache.flush() ||
+      !usb.readSector(0, zero) || memcmp(buf, zero, 512)) {
+    printf("restarted cache failed\n");
+    return false;
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : "CacheTest.img";
+  CountingDevice dev;
+  USBmscCache<8, 4> cache;
+
+  remove(path);
+  if (!dev.begin(path, IMAGE_SECTORS) || !cache.begin(&dev)) {
+    printf("Can't open %s\n", path);
+    return 1;
+  }
+  bool ok = randomMix(&dev, &cache);
+  printf("random mix: %s, %u hits, %u misses, %u write backs\n",
+         ok ? "ok" : "FAILED", (unsigned)cache.hitCount(),
+         (unsigned)cache.missCount(), (unsigned)cache.writeBackCount());
+  if (ok) {
+    ok = coalesce(&dev, &cache);
+    printf("coalesce across ways: %s\n", ok ? "ok" : "FAILED");
+  }
+  dev.end();
+  remove(path);
+  if (ok) {
+    ok = fence(path);
+    printf("media change: %s\n", ok ? "ok" : "FAILED");
+  }
+  remove(path);
+  return ok ? 0 : 1;
+}
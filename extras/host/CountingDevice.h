@@ -0,0 +1,29 @@
+/*
+ * FileBlockDevice that counts write commands, for the host tests.
+ */
+#ifndef CountingDevice_h
+#define CountingDevice_h
+#include "FileBlockDevice.h"
+
+/**
+ * \class CountingDevice
+ * \brief FileBlockDevice that counts write commands.
+ */
+class CountingDevice : public FileBlockDevice {
+ public:
+  bool writeSectors(uint32_t sector, const uint8_t* src, size_t ns) {
+    m_commands++;
+    return FileBlockDevice::writeSectors(sector, src, ns);
+  }
+  bool writeSector(uint32_t sector, const uint8_t* src) {
+    return writeSectors(sector, src, 1);
+  }
+  /** \return Write commands since clearCommands(). */
+  uint32_t commands() const {return m_commands;}
+  /** Restart the write command count. */
+  void clearCommands() {m_commands = 0;}
+
+ private:
+  uint32_t m_commands = 0;
+};
+#endif  // CountingDevice_h
@@ -0,0 +1,416 @@
+// USBMSCDevice against the simulated msController.
+//
+// Usage: DeviceTest [image]
+//
+// Two drives are polled from yield(), as msController waits there for a
+// transfer, and every queued transfer must complete with the right data
+// while an error on one drive leaves the other's errorCode() clear. The
+// generation must change once per media change, not on the reconnect,
+// and a transfer queued before the change must fail. A queued write that
+// fails must be reported by syncDevice() and wait(). A 4Kn drive must
+// match a RAM reference through a random mix of unaligned transfers.
+// A unit attention is retried once. profileDrive() must find the page
+// and allocation unit of the simulator's flash model, for 512 byte and
+// 4Kn drives, and leave the data as it was. With MSC_LBA64, sectors past
+// 2^32 are read and written with the 16 byte commands.
+#include "USBMSCDevice.h"
+
+static char path2[256];
+//------------------------------------------------------------------------------
+static void fill(uint8_t* buf, uint32_t sector, uint32_t seed) {
+  for (int i = 0; i < 512; i++) {
+    buf[i] = sector*7 + seed*13 + i;
+  }
+}
+//------------------------------------------------------------------------------
+static bool writePattern(USBMSCDevice* dev, uint32_t ns, uint32_t seed) {
+  uint8_t buf[512];
+  for (uint32_t s = 0; s < ns; s++) {
+    fill(buf, s, seed);
+    if (!dev->writeSector(s, buf)) {
+      return false;
+    }
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+static void pollAllHook() {
+  USBMSCDevice::pollAll();
+}
+//------------------------------------------------------------------------------
+// Queue a read from inside a command, as an interrupt handler may.
+static USBMSCDevice* lateDev;
+static uint8_t* lateBuf;
+static void queueHook() {
+  if (lateDev) {
+    lateDev->readSectorsAsync(5, lateBuf, 1);
+    lateDev = nullptr;
+  }
+  USBMSCDevice::pollAll();
+}
+//------------------------------------------------------------------------------
+static uint32_t done;
+static uint32_t failed;
+static uint8_t lastStatus;
+static void asyncDone(uintptr_t token, uint8_t status) {
+  (void)token;
+  done++;
+  lastStatus = status;
+  if (status != MS_CBW_PASS) {
+    failed++;
+  }
+}
+//------------------------------------------------------------------------------
+static bool twoDrives(const char* path) {
+  const uint32_t N = MSC_ASYNC_QUEUE_SIZE;
+  msController driveA;
+  msController driveB;
+  USBMSCDevice a;
+  USBMSCDevice b;
+  uint8_t bufA[N][512];
+  uint8_t bufB[N][512];
+  uint8_t expect[512];
+  bool ok = true;
+
+  if (!driveA.attachImage(path, 512, 256) ||
+      !driveB.attachImage(path2, 512, 256) || !a.begin(&driveA) ||
+      !b.begin(&driveB) || !writePattern(&a, 8, 1) ||
+      !writePattern(&b, 8, 2)) {
+    printf("Can't open drives\n");
+    return false;
+  }
+  // Each drive's transfer runs nested in the other's wait. A drive's own
+  // poll() from there must not start a transfer inside its command.
+  hostYieldHook = pollAllHook;
+  done = 0;
+  failed = 0;
+  for (uint32_t s = 0; s < N; s++) {
+    if (!a.readSectorsAsync(s, bufA[s], 1, asyncDone) ||
+        !b.readSectorsAsync(s, bufB[s], 1, asyncDone)) {
+      printf("queue full\n");
+      return false;
+    }
+  }
+  if (!USBMSCDevice::waitAll() || done != 2*N || failed) {
+    printf("waitAll: %u done, %u failed\n", (unsigned)done,
+           (unsigned)failed);
+    ok = false;
+  }
+  for (uint32_t s = 0; ok && s < N; s++) {
+    fill(expect, s, 1);
+    ok = !memcmp(bufA[s], expect, 512);
+    fill(expect, s, 2);
+    ok = ok && !memcmp(bufB[s], expect, 512);
+    if (!ok) {
+      printf("wrong data for sector %u\n", (unsigned)s);
+    }
+  }
+  // A read queued during a command waits for the command to end.
+  lateDev = &a;
+  lateBuf = bufA[1];
+  hostYieldHook = queueHook;
+  if (ok && (!a.readSector(0, bufA[0]) || !a.wait())) {
+    printf("read with a queued read failed\n");
+    ok = false;
+  }
+  fill(expect, 0, 1);
+  ok = ok && !memcmp(bufA[0], expect, 512);
+  fill(expect, 5, 1);
+  if (ok && memcmp(bufA[1], expect, 512)) {
+    printf("transfer started inside a command\n");
+    ok = false;
+  }
+  hostYieldHook = nullptr;
+  // Errors belong to the drive that had them.
+  driveB.injectError(MS_MEDIUM_ERROR, 0X11, 0);
+  if (ok && (b.readSector(0, bufB[0]) || !b.errorCode() ||
+             !a.readSector(0, bufA[0]) || a.errorCode())) {
+    printf("error codes: a %u, b %u\n", a.errorCode(), b.errorCode());
+    ok = false;
+  }
+  remove(path2);
+  return ok;
+}
+//------------------------------------------------------------------------------
+static bool generation(const char* path) {
+  msController drive;
+  USBMSCDevice dev;
+  uint8_t buf[512];
+  uint32_t gen;
+  bool ok = true;
+
+  if (!drive.attachImage(path, 512, 256) || !dev.begin(&drive)) {
+    return false;
+  }
+  gen = dev.generation();
+  // A media change fails the command that sees it and changes the
+  // generation once, the reconnect that follows does not.
+  drive.injectError(MS_UNIT_ATTENTION, MS_MEDIA_CHANGED, 0);
+  if (dev.readSector(0, buf) || dev.generation() != gen + 1 ||
+      !dev.readSector(0, buf) || dev.generation() != gen + 1) {
+    printf("unit attention: generation %u, was %u\n",
+           (unsigned)dev.generation(), (unsigned)gen);
+    ok = false;
+  }
+  // A replug, seen by connect().
+  drive.detach();
+  if (ok && (!drive.attachImage(path, 512, 0) || !dev.connect() ||
+             dev.generation() != gen + 2)) {
+    printf("replug: generation %u, was %u\n", (unsigned)dev.generation(),
+           (unsigned)gen);
+    ok = false;
+  }
+  // A transfer queued before a replug is not sent to the new media.
+  done = 0;
+  failed = 0;
+  if (ok && dev.readSectorsAsync(0, buf, 1, asyncDone)) {
+    drive.detach();
+    if (!drive.attachImage(path, 512, 0) || !dev.connect()) {
+      return false;
+    }
+    uint32_t commands = drive.commandCount();
+    if (dev.wait() || failed != 1 || lastStatus != MS_NO_MEDIA_ERR ||
+        drive.commandCount() != commands) {
+      printf("queued transfer crossed a media change\n");
+      ok = false;
+    }
+  }
+  return ok;
+}
+//------------------------------------------------------------------------------
+static uint32_t cbSectors;
+static bool cbOk;
+static void sectorDone(uintptr_t token, uint8_t* data) {
+  uint8_t expect[512];
+  fill(expect, token + cbSectors, 0);
+  cbOk = cbOk && !memcmp(data, expect, 512);
+  cbSectors++;
+}
+//------------------------------------------------------------------------------
+static bool blocks4k(const char* path) {
+  const uint32_t SECTORS = 1024;
+  static uint8_t ref[SECTORS*512];
+  uint8_t buf[24*512];
+  msController drive;
+  USBMSCDevice dev;
+
+  remove(path);
+  if (!drive.attachImage(path, 4096, SECTORS/8) || !dev.begin(&drive) ||
+      dev.sectorsPerBlock() != 8 || dev.sectorCount() != SECTORS) {
+    printf("4Kn drive not recognized\n");
+    return false;
+  }
+  for (uint32_t s = 0; s < SECTORS; s += 8) {
+    for (uint32_t i = 0; i < 8; i++) {
+      fill(&ref[512*(s + i)], s + i, 0);
+    }
+    if (!dev.writeSectors(s, &ref[512*s], 8)) {
+      return false;
+    }
+  }
+  // Sector callbacks for a run that starts and ends inside a block.
+  cbSectors = 0;
+  cbOk = true;
+  if (!dev.readSectorsWithCallback(3, 21, sectorDone, 3) || !cbOk ||
+      cbSectors != 21) {
+    printf("4Kn callback read: %u sectors\n", (unsigned)cbSectors);
+    return false;
+  }
+  srand(2);
+  for (uint32_t op = 0; op < 20000; op++) {
+    uint32_t sector = rand() % SECTORS;
+    uint32_t ns = 1 + rand() % 24;
+    if (sector + ns > SECTORS) {
+      ns = SECTORS - sector;
+    }
+    if (rand() % 2) {
+      for (uint32_t i = 0; i < ns; i++) {
+        fill(&buf[512*i], sector + i, op);
+      }
+      if (!dev.writeSectors(sector, buf, ns)) {
+        printf("4Kn write failed, op %u\n", (unsigned)op);
+        return false;
+      }
+      memcpy(&ref[sector*512], buf, ns*512);
+    } else if (!dev.readSectors(sector, buf, ns) ||
+               memcmp(buf, &ref[sector*512], ns*512)) {
+      printf("4Kn read differs at sector %u, op %u\n", (unsigned)sector,
+             (unsigned)op);
+      return false;
+    }
+  }
+  // The image itself, read as 512 byte blocks.
+  if (!drive.attachImage(path, 512, 0) || !dev.connect()) {
+    return false;
+  }
+  for (uint32_t s = 0; s < SECTORS; s++) {
+    if (!dev.readSector(s, buf) || memcmp(buf, &ref[s*512], 512)) {
+      printf("4Kn image differs at sector %u\n", (unsigned)s);
+      return false;
+    }
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+// A queued write that fails while a direct transfer drains the queue is
+// still reported by syncDevice() and wait().
+static bool queuedError(const char* path) {
+  msController drive;
+  USBMSCDevice dev;
+  uint8_t buf[512];
+
+  if (!drive.attachImage(path, 512, 256) || !dev.begin(&drive)) {
+    return false;
+  }
+  memset(buf, 0X55, sizeof(buf));
+  drive.injectError(MS_MEDIUM_ERROR, 0X0C, 0);
+  if (!dev.writeSectorsAsync(1, buf, 1) || !dev.readSector(0, buf)) {
+    return false;
+  }
+  if (dev.syncDevice() || dev.wait()) {
+    printf("failed queued write not reported\n");
+    return false;
+  }
+  return dev.wait() && dev.syncDevice();
+}
+//------------------------------------------------------------------------------
+static bool retry(const char* path) {
+  msController drive;
+  USBMSCDevice dev;
+  uint8_t buf[512];
+
+  if (!drive.attachImage(path, 512, 256) || !dev.begin(&drive)) {
+    return false;
+  }
+  // POWER ON OR RESET is retried once, a second one fails the command.
+  drive.injectError(MS_UNIT_ATTENTION, 0X29, 0, 0, 1);
+  if (!dev.readSector(0, buf)) {
+    printf("unit attention not retried\n");
+    return false;
+  }
+  drive.injectError(MS_UNIT_ATTENTION, 0X29, 0, 0, 2);
+  if (dev.writeSector(0, buf)) {
+    printf("unit attention retried more than once\n");
+    return false;
+  }
+  drive.injectError(0, 0, 0);
+#if MSC_STATS
+  msStats_t st;
+  if (!dev.stats(&st) || st.retries != 2) {
+    printf("%u retries counted, expected 2\n", (unsigned)st.retries);
+    return false;
+  }
+#endif  // MSC_STATS
+  return true;
+}
+//------------------------------------------------------------------------------
+static bool profile(const char* path, uint32_t blockSize) {
+  const uint32_t SECTORS = 16384;
+  const uint32_t PAGE = 16;
+  const uint32_t AU = 2048;
+  static uint8_t buf[64*1024];
+  uint8_t data[512];
+  uint8_t expect[512];
+  msController drive;
+  USBMSCDevice dev;
+  uint32_t spb = blockSize/512;
+
+  remove(path);
+  if (!drive.attachImage(path, blockSize, SECTORS/spb) ||
+      !dev.begin(&drive) || !writePattern(&dev, SECTORS, 3)) {
+    return false;
+  }
+  drive.setTiming(100, 40000000);
+  drive.setFlashGeometry(PAGE/spb, AU/spb, 400, 20000);
+  if (!dev.profileDrive(buf, sizeof(buf), 0, SECTORS)) {
+    printf("profileDrive failed, error %u\n", dev.errorCode());
+    return false;
+  }
+  const msDriveProfile_t& p = dev.profile();
+  if (p.pageSectors != PAGE || p.auSectors != AU) {
+    printf("%u byte blocks: page %u, AU %u sectors, expected %u, %u\n",
+           (unsigned)blockSize, (unsigned)p.pageSectors,
+           (unsigned)p.auSectors, (unsigned)PAGE, (unsigned)AU);
+    return false;
+  }
+  for (uint32_t s = 0; s < SECTORS; s++) {
+    fill(expect, s, 3);
+    if (!dev.readSector(s, data) || memcmp(data, expect, 512)) {
+      printf("profileDrive changed sector %u\n", (unsigned)s);
+      return false;
+    }
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+#if MSC_LBA64
+static bool lba64(const char* path) {
+  const uint64_t SECTORS = 0X100000000ULL + 1000;
+  const uint64_t at[] = {0XFFFFFFFCULL, 0XFFFFFFFEULL, 0X100000005ULL};
+  uint8_t buf[4*512];
+  uint8_t expect[4*512];
+  msController drive;
+  USBMSCDevice dev;
+
+  // A sparse image, only the blocks written take space.
+  remove(path);
+  if (!drive.attachImage(path, 512, SECTORS) || !dev.begin(&drive) ||
+      dev.sectorCount64() != SECTORS) {
+    printf("drive over 2 TB not recognized\n");
+    return false;
+  }
+  for (uint64_t s : at) {
+    for (uint32_t i = 0; i < 4; i++) {
+      fill(&expect[512*i], (uint32_t)s + i, 4);
+    }
+    memset(buf, 0, sizeof(buf));
+    if (!dev.writeSectors64(s, expect, 4) || !dev.readSectors64(s, buf, 4) ||
+        memcmp(buf, expect, sizeof(buf))) {
+      printf("transfer at sector %llX failed\n", (unsigned long long)s);
+      return false;
+    }
+  }
+  if (dev.readSectors64(SECTORS, buf, 1)) {
+    printf("read past the end did not fail\n");
+    return false;
+  }
+  return true;
+}
+#endif  // MSC_LBA64
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : "DeviceTest.img";
+  snprintf(path2, sizeof(path2), "%s2", path);
+
+  remove(path);
+  bool ok = twoDrives(path);
+  printf("two drives: %s\n", ok ? "ok" : "FAILED");
+  if (ok) {
+    ok = generation(path);
+    printf("generation: %s\n", ok ? "ok" : "FAILED");
+  }
+  if (ok) {
+    ok = blocks4k(path);
+    printf("4Kn blocks: %s\n", ok ? "ok" : "FAILED");
+  }
+  if (ok) {
+    ok = queuedError(path);
+    printf("queued write error: %s\n", ok ? "ok" : "FAILED");
+  }
+  if (ok) {
+    ok = retry(path);
+    printf("unit attention retry: %s\n", ok ? "ok" : "FAILED");
+  }
+  if (ok) {
+    ok = profile(path, 512) && profile(path, 4096);
+    printf("profileDrive: %s\n", ok ? "ok" : "FAILED");
+  }
+#if MSC_LBA64
+  if (ok) {
+    ok = lba64(path);
+    printf("sectors past 2^32: %s\n", ok ? "ok" : "FAILED");
+  }
+#endif  // MSC_LBA64
+  remove(path);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+#include "FileBlockDevice.h"
+//------------------------------------------------------------------------------
+bool FileBlockDevice::begin(const char* path, uint32_t sectors) {
+  end();
+  m_file = fopen(path, "r+b");
+  if (!m_file && sectors) {
+    m_file = fopen(path, "w+b");
+  }
+  if (!m_file) {
+    return false;
+  }
+  if (sectors) {
+    uint8_t zero = 0;
+    if (fseeko(m_file, (off_t)sectors*512 - 1, SEEK_SET) ||
+        fwrite(&zero, 1, 1, m_file) != 1) {
+      end();
+      return false;
+    }
+  }
+  if (fseeko(m_file, 0, SEEK_END)) {
+    end();
+    return false;
+  }
+  m_sectorCount = (uint32_t)(ftello(m_file)/512);
+  m_reads = 0;
+  m_writes = 0;
+  return true;
+}
+//------------------------------------------------------------------------------
+void FileBlockDevice::end() {
+  if (m_file) {
+    fclose(m_file);
+    m_file = nullptr;
+  }
+  m_sectorCount = 0;
+}
+//------------------------------------------------------------------------------
+bool FileBlockDevice::seek(uint32_t sector, size_t ns) {
+  return m_file && sector < m_sectorCount && ns <= m_sectorCount - sector &&
+         fseeko(m_file, (off_t)sector*512, SEEK_SET) == 0;
+}
+//------------------------------------------------------------------------------
+bool FileBlockDevice::readSectors(uint32_t sector, uint8_t* dst, size_t ns) {
+  if (!seek(sector, ns) || fread(dst, 512, ns, m_file) != ns) {
+    return false;
+  }
+  m_reads += ns;
+  return true;
+}
+//------------------------------------------------------------------------------
+bool FileBlockDevice::writeSectors(uint32_t sector, const uint8_t* src,
+                                   size_t ns) {
+  if (!seek(sector, ns) || fwrite(src, 512, ns, m_file) != ns) {
+    return false;
+  }
+  m_writes += ns;
+  return true;
+}
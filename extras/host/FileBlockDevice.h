@@ -0,0 +1,54 @@
+/*
+ * BlockDeviceInterface over a disk image file, for host builds.
+ */
+#ifndef FileBlockDevice_h
+#define FileBlockDevice_h
+#include <stdio.h>
+#include "SdFat.h"
+
+/**
+ * \class FileBlockDevice
+ * \brief 512 byte sector device stored in a host file.
+ *
+ * Use it to mount PFsVolume on an image without the USB layer, or to
+ * put USBmscSectorCache in front of an image.
+ */
+class FileBlockDevice : public BlockDeviceInterface {
+ public:
+  FileBlockDevice() {}
+  ~FileBlockDevice() {end();}
+  /** Open an image.
+   * \param[in] path Image file.
+   * \param[in] sectors If not zero, create or extend the image to this
+   *            many sectors.
+   * \return true for success or false for failure.
+   */
+  bool begin(const char* path, uint32_t sectors = 0);
+  /** Close the image. */
+  void end();
+  /** \return Sector reads since begin(). */
+  uint32_t readCount() const {return m_reads;}
+  /** \return Sector writes since begin(). */
+  uint32_t writeCount() const {return m_writes;}
+
+  bool isBusy() {return false;}
+  bool readSector(uint32_t sector, uint8_t* dst) {
+    return readSectors(sector, dst, 1);
+  }
+  bool readSectors(uint32_t sector, uint8_t* dst, size_t ns);
+  uint32_t sectorCount() {return m_sectorCount;}
+  bool syncDevice() {return m_file && fflush(m_file) == 0;}
+  bool writeSector(uint32_t sector, const uint8_t* src) {
+    return writeSectors(sector, src, 1);
+  }
+  bool writeSectors(uint32_t sector, const uint8_t* src, size_t ns);
+
+ private:
+  bool seek(uint32_t sector, size_t ns);
+
+  FILE*    m_file = nullptr;
+  uint32_t m_sectorCount = 0;
+  uint32_t m_reads = 0;
+  uint32_t m_writes = 0;
+};
+#endif  // FileBlockDevice_h
@@ -0,0 +1,91 @@
+// Off-target write/read benchmark on a simulated USB drive.
+//
+// Usage: HostBench [image [sizeMB [commandMicros [bytesPerSecond]]]]
+//
+// The image is created if needed and formatted if it does not mount.
+// Rates are in simulated time, CPU time on the host is included.
+#include "mscFS.h"
+
+static uint8_t buf[32*1024];
+//------------------------------------------------------------------------------
+static float rate(uint64_t bytes, uint32_t us) {
+  return us ? (float)bytes/us : 0;
+}
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : "HostBench.img";
+  uint32_t sizeMB = argc > 2 ? strtoul(argv[2], nullptr, 0) : 256;
+  uint32_t cmdUs = argc > 3 ? strtoul(argv[3], nullptr, 0) : 125;
+  uint32_t bps = argc > 4 ? strtoul(argv[4], nullptr, 0) : 40000000;
+  const uint32_t FILE_SIZE = 16UL << 20;
+  msController drive;
+  UsbFs fs;
+  PFsFile file;
+  uint32_t t;
+
+  if (!drive.attachImage(path, 512, sizeMB*2048)) {
+    Serial.printf("Can't open %s\n", path);
+    return 1;
+  }
+  drive.setTiming(cmdUs, bps);
+  if (!fs.begin(&drive)) {
+    Serial.println("Formatting");
+    if (!fs.format(&Serial) || !fs.begin(&drive)) {
+      Serial.println("Format failed");
+      return 1;
+    }
+  }
+  Serial.printf("FAT type %u, %u clusters of %u bytes\n", fs.fatType(),
+                (unsigned)fs.clusterCount(), (unsigned)fs.bytesPerCluster());
+  t = micros();
+  uint32_t free = fs.freeClusterCount();
+  Serial.printf("freeClusterCount %u: %u us\n", (unsigned)free,
+                (unsigned)(micros() - t));
+  t = micros();
+  fs.freeClusterCount();
+  Serial.printf("freeClusterCount again: %u us\n", (unsigned)(micros() - t));
+
+  for (size_t i = 0; i < sizeof(buf); i++) {
+    buf[i] = i;
+  }
+  if (!file.open("HostBench.bin", O_RDWR | O_CREAT | O_TRUNC) ||
+      !file.preAllocate(FILE_SIZE)) {
+    Serial.println("Create failed");
+    return 1;
+  }
+  t = micros();
+  for (uint32_t n = 0; n < FILE_SIZE; n += sizeof(buf)) {
+    if (file.write(buf, sizeof(buf)) != sizeof(buf)) {
+      Serial.println("Write failed");
+      return 1;
+    }
+  }
+  file.sync();
+  t = micros() - t;
+  Serial.printf("write %.2f MB/s\n", rate(FILE_SIZE, t));
+  file.rewind();
+  t = micros();
+  for (uint32_t n = 0; n < FILE_SIZE; n += sizeof(buf)) {
+    if (file.read(buf, sizeof(buf)) != (int)sizeof(buf) || buf[1] != 1) {
+      Serial.println("Read failed");
+      return 1;
+    }
+  }
+  t = micros() - t;
+  Serial.printf("read %.2f MB/s\n", rate(FILE_SIZE, t));
+  file.close();
+  Serial.printf("%u commands, %llu bytes\n", (unsigned)drive.commandCount(),
+                (unsigned long long)drive.byteCount());
+
+  // A drive that reports no media on the next command.
+  fs.cacheClear();
+  drive.injectError(MS_NOT_READY, MS_MEDIUM_NOT_PRESENT, 0);
+  if (!file.open("HostBench.bin", O_RDONLY) || file.read(buf, 512) != 512) {
+    Serial.printf("Injected error: %s, %s\n",
+                  decodeSenseKey(drive.msSense.SenseKey),
+                  decodeAscAscq(drive.msSense.AdditionalSenseCode,
+                                drive.msSense.AdditionalSenseQualifier));
+  }
+  file.close();
+  return 0;
+}
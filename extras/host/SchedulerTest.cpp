@@ -0,0 +1,180 @@
+// USBmscScheduler against a FileBlockDevice image and a simulated drive.
+//
+// Usage: SchedulerTest [image]
+//
+// A random mix of reads and writes, some large enough to bypass staging,
+// goes through the scheduler and to a RAM reference. Every read must
+// match the reference and, after flush(), so must the image. A logging
+// pattern of three files, each record a data, FAT and directory sector
+// write, must take far fewer write commands than requests. Last, staged
+// sectors must be dropped, not written, once the drive's media changes.
+#include "CountingDevice.h"
+#include "USBmscScheduler.h"
+
+const uint32_t IMAGE_SECTORS = 1024;
+static uint8_t ref[IMAGE_SECTORS*512];
+//------------------------------------------------------------------------------
+static void fill(uint8_t* buf, uint32_t sector, uint32_t seed) {
+  for (int i = 0; i < 512; i++) {
+    buf[i] = sector*7 + seed*13 + i;
+  }
+}
+//------------------------------------------------------------------------------
+static bool checkImage(FileBlockDevice* dev) {
+  uint8_t buf[512];
+  for (uint32_t s = 0; s < IMAGE_SECTORS; s++) {
+    if (!dev->readSector(s, buf) || memcmp(buf, &ref[s*512], 512)) {
+      printf("image differs at sector %u\n", (unsigned)s);
+      return false;
+    }
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+static bool randomMix(CountingDevice* dev, USBmscIoScheduler* sched) {
+  uint8_t buf[24*512];
+  srand(1);
+  for (uint32_t op = 0; op < 50000; op++) {
+    // Mostly small writes, with some over half of the 32 sector buffer.
+    uint32_t sector = rand() % IMAGE_SECTORS;
+    uint32_t ns = rand() % 8 ? 1 + rand() % 4 : 1 + rand() % 24;
+    if (sector + ns > IMAGE_SECTORS) {
+      ns = IMAGE_SECTORS - sector;
+    }
+    if (rand() % 2) {
+      for (uint32_t i = 0; i < ns; i++) {
+        fill(&buf[512*i], sector + i, op);
+      }
+      if (!sched->writeSectors(sector, buf, ns)) {
+        printf("write failed, op %u\n", (unsigned)op);
+        return false;
+      }
+      memcpy(&ref[sector*512], buf, ns*512);
+    } else {
+      if (!sched->readSectors(sector, buf, ns)) {
+        printf("read failed, op %u\n", (unsigned)op);
+        return false;
+      }
+      if (memcmp(buf, &ref[sector*512], ns*512)) {
+        printf("stale read at sector %u, op %u\n", (unsigned)sector,
+               (unsigned)op);
+        return false;
+      }
+    }
+    if (op % 10000 == 9999 && !sched->syncDevice()) {
+      printf("sync failed\n");
+      return false;
+    }
+  }
+  return sched->flush() && checkImage(dev);
+}
+//------------------------------------------------------------------------------
+// Three files append a sector per record. Each record also rewrites the
+// file's FAT sector and the directory sector holding all three entries.
+static bool logging(CountingDevice* dev, USBmscIoScheduler* sched,
+                    uint32_t* commands) {
+  const uint32_t DIR_SECTOR = 40;
+  const uint32_t FAT_SECTOR = 8;
+  const uint32_t DATA_SECTOR[3] = {64, 384, 704};
+  const uint32_t RECORDS = 300;
+  uint8_t buf[512];
+
+  dev->clearCommands();
+  for (uint32_t r = 0; r < RECORDS; r++) {
+    for (uint32_t f = 0; f < 3; f++) {
+      const uint32_t order[3] = {DATA_SECTOR[f] + r, FAT_SECTOR + f,
+                                 DIR_SECTOR};
+      for (uint32_t s : order) {
+        fill(buf, s, r);
+        memcpy(&ref[s*512], buf, 512);
+        if (!sched->writeSector(s, buf)) {
+          printf("write failed, record %u\n", (unsigned)r);
+          return false;
+        }
+      }
+    }
+  }
+  if (!sched->syncDevice()) {
+    return false;
+  }
+  *commands = dev->commands();
+  return checkImage(dev);
+}
+//------------------------------------------------------------------------------
+// Staged sectors must not reach the media that replaced theirs.
+static bool fence(const char* path) {
+  msController drive;
+  USBMSCDevice usb;
+  USBmscScheduler<32> sched;
+  uint8_t buf[512];
+  uint8_t zero[512];
+
+  memset(zero, 0, sizeof(zero));
+  if (!drive.attachImage(path, 512, 64) || !usb.begin(&drive) ||
+      !sched.begin(&usb)) {
+    printf("Can't open %s\n", path);
+    return false;
+  }
+  for (uint32_t s = 0; s < 4; s++) {
+    fill(buf, s, 1);
+    if (!sched.writeSector(s, buf)) {
+      return false;
+    }
+  }
+  // Swap the media, the image is recreated empty.
+  drive.detach();
+  remove(path);
+  if (!drive.attachImage(path, 512, 64)) {
+    return false;
+  }
+  if (sched.flush() || sched.flush() || sched.staged()) {
+    printf("flush after a media change did not fail\n");
+    return false;
+  }
+  for (uint32_t s = 0; s < 4; s++) {
+    if (!usb.readSector(s, buf) || memcmp(buf, zero, 512)) {
+      printf("staged sector %u reached the new media\n", (unsigned)s);
+      return false;
+    }
+  }
+  // Started again, it writes to the new media.
+  fill(buf, 0, 2);
+  if (!sched.begin(&usb) || !sched.writeSector(0, buf) || !sched.flush() ||
+      !usb.readSector(0, zero) || memcmp(buf, zero, 512)) {
+    printf("restarted scheduler failed\n");
+    return false;
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : "SchedulerTest.img";
+  CountingDevice dev;
+  USBmscScheduler<32> sched;
+  uint32_t commands = 0;
+
+  remove(path);
+  if (!dev.begin(path, IMAGE_SECTORS) || !sched.begin(&dev)) {
+    printf("Can't open %s\n", path);
+    return 1;
+  }
+  bool ok = randomMix(&dev, &sched);
+  printf("random mix: %s, %u requests, %u write backs\n",
+         ok ? "ok" : "FAILED", (unsigned)sched.requestCount(),
+         (unsigned)sched.writeBackCount());
+  if (ok) {
+    ok = logging(&dev, &sched, &commands);
+    // 2700 requests, well under a tenth of them must reach the device.
+    ok = ok && commands < 270;
+    printf("logging: %s, %u write commands for 2700 writes\n",
+           ok ? "ok" : "FAILED", (unsigned)commands);
+  }
+  dev.end();
+  remove(path);
+  if (ok) {
+    ok = fence(path);
+    printf("media change: %s\n", ok ? "ok" : "FAILED");
+  }
+  remove(path);
+  return ok ? 0 : 1;
+}
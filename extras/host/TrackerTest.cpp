@@ -0,0 +1,129 @@
+// PFsAllocTracker free cluster counting against a FileBlockDevice image.
+//
+// Usage: TrackerTest [image]
+//
+// Random FAT32 entry and exFAT bitmap changes are written through the
+// tracker, one sector at a time as SdFat writes them. After every write
+// the tracked free count must match a count of the RAM reference, both
+// with a free space index and without one.
+#include "FileBlockDevice.h"
+#include "PFsAllocTracker.h"
+#include "PFsFreeCount.h"
+
+const uint32_t REGION_START = 8;
+const uint32_t REGION_SECTORS = 4;
+static uint8_t ref[REGION_SECTORS*512];
+//------------------------------------------------------------------------------
+static uint32_t refFree(uint8_t fatType, uint32_t clusters) {
+  uint32_t free = 0;
+  if (fatType == FAT_TYPE_EXFAT) {
+    for (uint32_t k = 0; k < clusters; k++) {
+      free += !(ref[k >> 3] & (1 << (k & 7)));
+    }
+  } else {
+    const uint32_t* fat = reinterpret_cast<const uint32_t*>(ref);
+    for (uint32_t k = 2; k < clusters + 2; k++) {
+      free += (fat[k] & 0X0FFFFFFF) == 0;
+    }
+  }
+  return free;
+}
+//------------------------------------------------------------------------------
+static bool trackerTest(FileBlockDevice* dev, uint8_t fatType,
+                        uint16_t* index) {
+  // The last sector is partly used, as on a real volume.
+  const uint32_t clusters = fatType == FAT_TYPE_EXFAT ?
+                            REGION_SECTORS*4096 - 100 : REGION_SECTORS*128 - 7;
+  PFsAllocTracker tracker;
+  uint8_t buf[512];
+
+  memset(ref, 0, sizeof(ref));
+  if (fatType == FAT_TYPE_FAT32) {
+    reinterpret_cast<uint32_t*>(ref)[0] = 0X0FFFFFF8;
+    reinterpret_cast<uint32_t*>(ref)[1] = 0X0FFFFFFF;
+  }
+  if (!dev->writeSectors(REGION_START, ref, REGION_SECTORS)) {
+    return false;
+  }
+  tracker.begin(dev);
+  if (fatType == FAT_TYPE_EXFAT) {
+    tracker.trackBitmap(REGION_START, clusters);
+  } else {
+    tracker.trackFat(fatType, REGION_START, clusters);
+  }
+  if (index) {
+    // Filled as the volume scan fills it.
+    uint32_t perSector = fatType == FAT_TYPE_EXFAT ? 4096 : 128;
+    uint32_t limit = fatType == FAT_TYPE_EXFAT ? clusters : clusters + 2;
+    tracker.setIndex(index, tracker.indexSize());
+    for (uint32_t i = 0; i < REGION_SECTORS; i++) {
+      uint32_t n = limit - i*perSector < perSector ?
+                   limit - i*perSector : perSector;
+      index[i] = fatType == FAT_TYPE_EXFAT ?
+        pfsFreeBitmap(&ref[i*512], n) :
+        pfsFreeFat32(reinterpret_cast<const uint32_t*>(&ref[i*512]), n);
+    }
+  }
+  tracker.setFreeCount(refFree(fatType, clusters));
+  if (!tracker.valid()) {
+    printf("count not tracked\n");
+    return false;
+  }
+  srand(fatType);
+  for (uint32_t op = 0; op < 5000; op++) {
+    uint32_t s = rand() % REGION_SECTORS;
+    memcpy(buf, &ref[s*512], 512);
+    for (int k = 0; k < 8; k++) {
+      if (fatType == FAT_TYPE_EXFAT) {
+        uint32_t bit = s*4096 + rand() % 4096;
+        if (bit < clusters) {
+          buf[(bit >> 3) & 511] ^= 1 << (bit & 7);
+        }
+      } else {
+        uint32_t e = s*128 + rand() % 128;
+        if (e >= 2 && e < clusters + 2) {
+          reinterpret_cast<uint32_t*>(buf)[e & 127] =
+            rand() % 2 ? 0 : 0X0FFFFFFF;
+        }
+      }
+    }
+    if (!tracker.writeSector(REGION_START + s, buf)) {
+      printf("write failed, op %u\n", (unsigned)op);
+      return false;
+    }
+    memcpy(&ref[s*512], buf, 512);
+    if (!tracker.valid() ||
+        tracker.freeCount() != refFree(fatType, clusters)) {
+      printf("free count %u, expected %u, op %u\n",
+             (unsigned)tracker.freeCount(),
+             (unsigned)refFree(fatType, clusters), (unsigned)op);
+      return false;
+    }
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : "TrackerTest.img";
+  FileBlockDevice dev;
+  uint16_t index[REGION_SECTORS];
+  bool ok = true;
+
+  remove(path);
+  if (!dev.begin(path, 64)) {
+    printf("Can't open %s\n", path);
+    return 1;
+  }
+  for (uint8_t fatType : {FAT_TYPE_FAT32, FAT_TYPE_EXFAT}) {
+    for (uint16_t* ix : {(uint16_t*)nullptr, index}) {
+      if (ok) {
+        ok = trackerTest(&dev, fatType, ix);
+        printf("FAT type %u, %s: %s\n", fatType, ix ? "index" : "no index",
+               ok ? "ok" : "FAILED");
+      }
+    }
+  }
+  dev.end();
+  remove(path);
+  return ok ? 0 : 1;
+}
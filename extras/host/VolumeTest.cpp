@@ -0,0 +1,226 @@
+// PFsVolume path lookups and directory listing on a simulated drive.
+//
+// Usage: VolumeTest [image]
+//
+// Runs on a FAT32 image and on a sparse image large enough that format()
+// picks exFAT. Files are created, removed and renamed in a directory
+// with a lookup index, and every path must then exist or not exist as
+// expected, whether it is found through the index, a search or, with
+// PFS_DENTRY_CACHE defined, the dentry cache. A file created relative to chdir() must be found by path.
+// readDir() must list exactly the files that are left, with their sizes,
+// and findName() must give an index that opens the same file. Last, the
+// volume must fail after a replug until it is mounted again.
+#include "mscFS.h"
+
+const uint32_t FILES = 200;
+static bool present[FILES];
+static PFsDirSlot_t slots[512];
+//------------------------------------------------------------------------------
+static void fileName(char* name, size_t size, uint32_t i) {
+  snprintf(name, size, "/logs/file%03u.txt", (unsigned)i);
+}
+//------------------------------------------------------------------------------
+// Each file holds its number as text.
+static bool checkFile(PFsVolume* vol, const char* path, uint32_t i) {
+  char expect[16];
+  char buf[16];
+  PFsFile file;
+  int n = snprintf(expect, sizeof(expect), "%u\n", (unsigned)i);
+
+  if (!file.open(vol, path, O_RDONLY)) {
+    printf("can't open %s\n", path);
+    return false;
+  }
+  memset(buf, 0, sizeof(buf));
+  if (file.read(buf, sizeof(buf)) != n || memcmp(buf, expect, n)) {
+    printf("%s holds the wrong data\n", path);
+    return false;
+  }
+  return file.close();
+}
+//------------------------------------------------------------------------------
+static bool lookups(PFsVolume* vol) {
+  char name[32];
+  char text[16];
+  PFsFile file;
+
+  if (!vol->mkdir("/logs")) {
+    printf("mkdir failed\n");
+    return false;
+  }
+  for (uint32_t i = 0; i < FILES; i++) {
+    fileName(name, sizeof(name), i);
+    int n = snprintf(text, sizeof(text), "%u\n", (unsigned)i);
+    if (!file.open(vol, name, O_WRONLY | O_CREAT | O_EXCL) ||
+        file.write(text, n) != (size_t)n || !file.close()) {
+      printf("can't create %s\n", name);
+      return false;
+    }
+    present[i] = true;
+  }
+  for (uint32_t i = 0; i < FILES; i += 3) {
+    fileName(name, sizeof(name), i);
+    if (!vol->remove(name)) {
+      printf("can't remove %s\n", name);
+      return false;
+    }
+    present[i] = false;
+  }
+  fileName(name, sizeof(name), 1);
+  if (!vol->rename(name, "/logs/renamed.txt")) {
+    printf("rename failed\n");
+    return false;
+  }
+  present[1] = false;
+  // Twice, the second time through the cache and the index.
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t i = 0; i < FILES; i++) {
+      fileName(name, sizeof(name), i);
+      if (vol->exists(name) != present[i]) {
+        printf("exists(%s) is wrong, pass %d\n", name, pass);
+        return false;
+      }
+      if (present[i] && !checkFile(vol, name, i)) {
+        return false;
+      }
+    }
+    if (!checkFile(vol, "/logs/renamed.txt", 1)) {
+      return false;
+    }
+  }
+  // A file created relative to the working directory.
+  if (!vol->chdir("/logs") ||
+      !file.open(vol, "new.txt", O_WRONLY | O_CREAT) ||
+      file.write("new\n", 4) != 4 || !file.close() || !vol->chdir() ||
+      !vol->exists("/logs/new.txt")) {
+    printf("file created after chdir() not found\n");
+    return false;
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+static bool listing(PFsVolume* vol) {
+  static PFsDirEnt_t ents[16];
+  bool listed[FILES];
+  uint32_t count = 0;
+  uint32_t others = 0;
+  PFsFile dir;
+  PFsFile file;
+  uint32_t index;
+  char name[32];
+  int n;
+
+  memset(listed, 0, sizeof(listed));
+  if (!dir.open(vol, "/logs", O_RDONLY)) {
+    return false;
+  }
+  while ((n = dir.readDir(ents, 16)) > 0) {
+    for (int i = 0; i < n; i++) {
+      unsigned k;
+      char c;
+      if (sscanf(ents[i].name, "file%3u.tx%c", &k, &c) == 2 && k < FILES &&
+          present[k] && !listed[k]) {
+        char text[16];
+        int size = snprintf(text, sizeof(text), "%u\n", k);
+        listed[k] = true;
+        if (ents[i].size != (uint64_t)size) {
+          printf("%s listed with size %u\n", ents[i].name,
+                 (unsigned)ents[i].size);
+          return false;
+        }
+        count++;
+      } else if (!strcmp(ents[i].name, "renamed.txt") ||
+                 !strcmp(ents[i].name, "new.txt")) {
+        others++;
+      } else {
+        printf("unexpected entry %s\n", ents[i].name);
+        return false;
+      }
+    }
+  }
+  uint32_t expect = 0;
+  for (uint32_t i = 0; i < FILES; i++) {
+    expect += present[i];
+  }
+  if (n < 0 || count != expect || others != 2) {
+    printf("readDir listed %u files, expected %u\n",
+           (unsigned)(count + others), (unsigned)(expect + 2));
+    return false;
+  }
+  // findName() gives the entry index open() takes.
+  if (!dir.findName("file002.txt", &index) ||
+      !file.open(&dir, index, O_RDONLY) || !file.getName(name, sizeof(name)) ||
+      strcmp(name, "file002.txt") || !file.close() ||
+      dir.findName("file003.txt", &index)) {
+    printf("findName failed\n");
+    return false;
+  }
+  return dir.close();
+}
+//------------------------------------------------------------------------------
+static bool replug(msController* drive, UsbFs* fs, const char* path) {
+  USBMSCDevice* usb = (USBMSCDevice*)fs->usbDrive();
+  char name[32];
+
+  fileName(name, sizeof(name), 2);
+  drive->detach();
+  if (!drive->attachImage(path, 512, 0)) {
+    return false;
+  }
+  fs->cacheClear();
+  if (fs->exists(name) || !fs->mediaChanged()) {
+    printf("volume used after a replug\n");
+    return false;
+  }
+  if (!fs->PFsVolume::begin(usb) || fs->mediaChanged() ||
+      !fs->setDirIndex(slots, sizeof(slots)/sizeof(slots[0])) ||
+      !checkFile(fs, name, 2)) {
+    printf("remount failed\n");
+    return false;
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+static bool volumeTest(const char* path, uint64_t sectors, uint8_t fatType) {
+  msController drive;
+  UsbFs fs;
+
+  remove(path);
+  if (!drive.attachImage(path, 512, sectors)) {
+    printf("Can't open %s\n", path);
+    return false;
+  }
+  if (!fs.begin(&drive) && (!fs.format() || !fs.begin(&drive))) {
+    printf("format failed\n");
+    return false;
+  }
+  if (fs.fatType() != fatType ||
+      !fs.setDirIndex(slots, sizeof(slots)/sizeof(slots[0]))) {
+    printf("FAT type %u\n", fs.fatType());
+    return false;
+  }
+  bool ok = lookups(&fs);
+  printf("FAT type %u lookups: %s\n", fatType, ok ? "ok" : "FAILED");
+  if (ok) {
+    ok = listing(&fs);
+    printf("FAT type %u readDir: %s\n", fatType, ok ? "ok" : "FAILED");
+  }
+  if (ok) {
+    ok = replug(&drive, &fs, path);
+    printf("FAT type %u replug: %s\n", fatType, ok ? "ok" : "FAILED");
+  }
+  fs.end();
+  drive.detach();
+  remove(path);
+  return ok;
+}
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : "VolumeTest.img";
+
+  // 256 MB formats as FAT32. Over 32 GB formats as exFAT, the image is
+  // sparse so only what format() and the test write takes space.
+  bool ok = volumeTest(path, 256*2048, FAT_TYPE_FAT32) &&
+            volumeTest(path, 64ULL << 21, FAT_TYPE_EXFAT);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,422 @@
+// Simulated msController, see shim/USBHost_t36.h.
+#include <string.h>
+#include "USBHost_t36.h"
+//------------------------------------------------------------------------------
+bool msController::attachImage(const char* path, uint32_t blockSize,
+                               uint64_t blocks) {
+  detach();
+  if (blockSize < 512 || blockSize > 4096 ||
+      (blockSize & (blockSize - 1))) {
+    return false;
+  }
+  m_file = fopen(path, "r+b");
+  if (!m_file && blocks) {
+    m_file = fopen(path, "w+b");
+  }
+  if (!m_file) {
+    return false;
+  }
+  if (blocks) {
+    // Extend to the requested size, the gap reads back as zeros.
+    uint8_t zero = 0;
+    if (fseeko(m_file, (off_t)blocks*blockSize - 1, SEEK_SET) ||
+        fwrite(&zero, 1, 1, m_file) != 1) {
+      detach();
+      return false;
+    }
+  }
+  if (fseeko(m_file, 0, SEEK_END)) {
+    detach();
+    return false;
+  }
+  memset(&msDriveInfo, 0, sizeof(msDriveInfo));
+  // Like a real drive, it is initialized by the first
+  // checkConnectedInitialized() after the attach.
+  msDriveInfo.connected = true;
+  msDriveInfo.initialized = false;
+  msDriveInfo.idVendor = 0X1D6B;
+  msDriveInfo.idProduct = 0X0104;
+  msDriveInfo.capacity.BlockSize = blockSize;
+  m_blocks = ftello(m_file)/blockSize;
+  // Like USBHost_t36, the last block from READ CAPACITY(10), 0XFFFFFFFF
+  // if it does not fit.
+  msDriveInfo.capacity.Blocks = !m_blocks ? 0 :
+    m_blocks > 0XFFFFFFFF ? 0XFFFFFFFF : (uint32_t)(m_blocks - 1);
+  memcpy(msDriveInfo.inquiry.VendorID, "HostSim ", 8);
+  memcpy(msDriveInfo.inquiry.ProductID, "Disk Image      ", 16);
+  memcpy(msDriveInfo.inquiry.RevisionID, "1.00", 4);
+  msDriveInfo.inquiry.Removable = 1;
+  // SPC-4 if it has VPD pages, like a USB to SATA bridge, else SCSI-2
+  // like most USB sticks.
+  msDriveInfo.inquiry.Version = m_blockLimits ? 6 : 2;
+  m_commands = 0;
+  m_bytes = 0;
+  m_unmapped = 0;
+  m_syncs = 0;
+  m_unsynced = 0;
+  m_errKey = 0;
+  return true;
+}
+//------------------------------------------------------------------------------
+void msController::detach() {
+  if (m_file) {
+    fclose(m_file);
+    m_file = nullptr;
+  }
+  msDriveInfo.connected = false;
+  msDriveInfo.initialized = false;
+}
+//------------------------------------------------------------------------------
+void msController::injectError(uint8_t senseKey, uint8_t asc, uint8_t ascq,
+                               uint32_t after, uint32_t count) {
+  m_errKey = senseKey;
+  m_errAsc = asc;
+  m_errAscq = ascq;
+  m_errAfter = after;
+  m_errCount = count;
+}
+//------------------------------------------------------------------------------
+uint8_t msController::checkConnectedInitialized() {
+  if (!m_file) {
+    return MS_NO_MEDIA_ERR;
+  }
+  msDriveInfo.initialized = true;
+  return MS_CBW_PASS;
+}
+//------------------------------------------------------------------------------
+// Record sense data and map it to an error code the way the MSC driver does.
+uint8_t msController::senseError(uint8_t senseKey, uint8_t asc, uint8_t ascq) {
+  memset(&msSense, 0, sizeof(msSense));
+  msSense.ResponseCode = 0X70;
+  msSense.SenseKey = senseKey;
+  msSense.AdditionalLength = 10;
+  msSense.AdditionalSenseCode = asc;
+  msSense.AdditionalSenseQualifier = ascq;
+  switch (senseKey) {
+    case MS_UNIT_ATTENTION:
+      return asc == MS_MEDIA_CHANGED ? MS_MEDIA_CHANGED_ERR : MS_CMD_ERR;
+    case MS_NOT_READY:
+      return asc == MS_MEDIUM_NOT_PRESENT ? MS_NO_MEDIA_ERR : MS_UNIT_NOT_READY;
+    case MS_ILLEGAL_REQUEST:
+      return asc == MS_LBA_OUT_OF_RANGE ? MS_BAD_LBA_ERR : MS_CMD_ERR;
+    default:
+      return MS_CMD_ERR;
+  }
+}
+//------------------------------------------------------------------------------
+// Charge the command to the simulated clock and check for errors.
+uint8_t msController::command(uint64_t blockAddr, uint32_t blkCnt) {
+  uint64_t bytes = (uint64_t)blkCnt*msDriveInfo.capacity.BlockSize;
+  uint32_t us = m_commandMicros;
+
+  if (!m_file) {
+    return MS_NO_MEDIA_ERR;
+  }
+  if (m_bytesPerSecond) {
+    us += (uint32_t)(bytes*1000000/m_bytesPerSecond);
+  }
+  hostAdvanceMicros(us);
+  m_commands++;
+  if (m_errKey) {
+    if (m_errAfter) {
+      m_errAfter--;
+    } else {
+      uint8_t rtn = senseError(m_errKey, m_errAsc, m_errAscq);
+      if (m_errCount && --m_errCount == 0) {
+        m_errKey = 0;
+      }
+      return rtn;
+    }
+  }
+  if (blockAddr >= m_blocks || blkCnt > m_blocks - blockAddr) {
+    return senseError(MS_ILLEGAL_REQUEST, MS_LBA_OUT_OF_RANGE, 0);
+  }
+  if (m_maxBlocks && blkCnt > m_maxBlocks) {
+    // INVALID FIELD IN CDB
+    return senseError(MS_ILLEGAL_REQUEST, 0X24, 0);
+  }
+  if (fseeko(m_file, (off_t)blockAddr*msDriveInfo.capacity.BlockSize,
+             SEEK_SET)) {
+    return senseError(MS_MEDIUM_ERROR, 0X11, 0);
+  }
+  m_bytes += bytes;
+  // The real driver waits here for the data transfer.
+  yield();
+  return MS_CBW_PASS;
+}
+//------------------------------------------------------------------------------
+uint8_t msController::msReadBlocks(uint32_t blockAddr, uint16_t blkCnt,
+                                   uint16_t blockSize, void* buf) {
+  uint8_t rtn = command(blockAddr, blkCnt);
+  if (rtn == MS_CBW_PASS &&
+      fread(buf, blockSize, blkCnt, m_file) != blkCnt) {
+    rtn = senseError(MS_MEDIUM_ERROR, 0X11, 0);
+  }
+  return rtn;
+}
+//------------------------------------------------------------------------------
+// Charge a write to the flash model, see setFlashGeometry().
+void msController::flashWrite(uint64_t blockAddr, uint32_t blkCnt) {
+  if (!m_pageBlocks || !blkCnt) {
+    return;
+  }
+  uint64_t end = blockAddr + blkCnt;
+  uint64_t first = blockAddr/m_pageBlocks;
+  uint64_t last = (end - 1)/m_pageBlocks;
+  uint32_t us = (last - first + 1)*m_pageMicros;
+  if (blockAddr % m_pageBlocks) {
+    us += m_pageMicros;
+  }
+  if ((end % m_pageBlocks) && (first != last || !(blockAddr % m_pageBlocks))) {
+    us += m_pageMicros;
+  }
+  if (m_auBlocks) {
+    us += ((end - 1)/m_auBlocks - blockAddr/m_auBlocks)*m_auMicros;
+  }
+  hostAdvanceMicros(us);
+}
+//------------------------------------------------------------------------------
+uint8_t msController::msWriteBlocks(uint32_t blockAddr, uint16_t blkCnt,
+                                    uint16_t blockSize, const void* buf) {
+  uint8_t rtn = command(blockAddr, blkCnt);
+  if (rtn == MS_CBW_PASS && m_writeProtect) {
+    // DATA PROTECT, WRITE PROTECTED
+    rtn = senseError(0X07, 0X27, 0);
+  }
+  if (rtn == MS_CBW_PASS &&
+      fwrite(buf, blockSize, blkCnt, m_file) != blkCnt) {
+    rtn = senseError(MS_MEDIUM_ERROR, 0X0C, 0);
+  }
+  if (rtn == MS_CBW_PASS) {
+    flashWrite(blockAddr, blkCnt);
+    if (m_writeCache) {
+      m_unsynced += blkCnt;
+    }
+  }
+  return rtn;
+}
+//------------------------------------------------------------------------------
+uint8_t msController::msReadSectorsWithCB(uint32_t blockAddr, uint16_t blkCnt,
+                                          void (*callback)(uint32_t, uint8_t*),
+                                          uint32_t token) {
+  uint8_t buf[4096];
+  uint32_t blockSize = msDriveInfo.capacity.BlockSize;
+  uint8_t rtn = command(blockAddr, blkCnt);
+
+  if (blockSize > sizeof(buf)) {
+    return MS_CMD_ERR;
+  }
+  // One callback per block as the data arrives.
+  for (uint16_t i = 0; rtn == MS_CBW_PASS && i < blkCnt; i++) {
+    if (fread(buf, blockSize, 1, m_file) != 1) {
+      rtn = senseError(MS_MEDIUM_ERROR, 0X11, 0);
+    } else {
+      callback(token, buf);
+    }
+  }
+  return rtn;
+}
+//------------------------------------------------------------------------------
+static uint32_t getBe32(const uint8_t* p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3];
+}
+//------------------------------------------------------------------------------
+uint8_t msController::msDoCommand(msCommandBlockWrapper_t* CBW, void* buffer) {
+  if (CBW->CommandData[0] == 0X88 || CBW->CommandData[0] == 0X8A) {
+    return rw16(CBW, buffer);
+  }
+  uint8_t rtn = command(0, 0);
+
+  if (rtn != MS_CBW_PASS) {
+    return rtn;
+  }
+  if (CBW->CommandData[0] == 0X9E && (CBW->CommandData[1] & 0X1F) == 0X10) {
+    return readCapacity16(CBW, buffer);
+  }
+  if (CBW->CommandData[0] == 0X12 && (CBW->CommandData[1] & 1)) {
+    return inquiryVpd(CBW, buffer);
+  }
+  if (CBW->CommandData[0] == 0X42 && m_unmap) {
+    return m_writeProtect ? senseError(0X07, 0X27, 0) : unmap(CBW, buffer);
+  }
+  if (CBW->CommandData[0] == 0X1A) {
+    return modeSense(CBW, buffer);
+  }
+  if (CBW->CommandData[0] == 0X15 && m_cachePage) {
+    return modeSelect(CBW, buffer);
+  }
+  if (CBW->CommandData[0] == 0X35 && m_cachePage) {
+    m_syncs++;
+    m_unsynced = 0;
+    return MS_CBW_PASS;
+  }
+  // INVALID COMMAND OPERATION CODE
+  return senseError(MS_ILLEGAL_REQUEST, 0X20, 0);
+}
+//------------------------------------------------------------------------------
+static void putBe16(uint8_t* p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+//------------------------------------------------------------------------------
+static void putBe32(uint8_t* p, uint32_t v) {
+  putBe16(p, v >> 16);
+  putBe16(p + 2, v);
+}
+//------------------------------------------------------------------------------
+// Supported VPD Pages and Block Limits, SPC-4 7.8.16 and SBC-3 6.5.3.
+uint8_t msController::inquiryVpd(msCommandBlockWrapper_t* CBW, void* buffer) {
+  uint8_t page[64] = {0};
+  uint32_t len = (uint32_t)CBW->CommandData[3] << 8 | CBW->CommandData[4];
+
+  if (!m_blockLimits || CBW->Flags != CMD_DIR_DATA_IN ||
+      len > CBW->TransferLength) {
+    // INVALID FIELD IN CDB
+    return senseError(MS_ILLEGAL_REQUEST, 0X24, 0);
+  }
+  page[1] = CBW->CommandData[2];
+  if (page[1] == 0X00) {
+    putBe16(page + 2, 2);
+    page[5] = 0XB0;
+  } else if (page[1] == 0XB0) {
+    putBe16(page + 2, 0X3C);
+    putBe16(page + 6, m_granularity);
+    putBe32(page + 8, m_maxBlocks);
+    putBe32(page + 12, m_optimalBlocks);
+  } else {
+    return senseError(MS_ILLEGAL_REQUEST, 0X24, 0);
+  }
+  memcpy(buffer, page, len < sizeof(page) ? len : sizeof(page));
+  return MS_CBW_PASS;
+}
+//------------------------------------------------------------------------------
+uint8_t msController::unmap(msCommandBlockWrapper_t* CBW, void* buffer) {
+  const uint8_t* param = reinterpret_cast<const uint8_t*>(buffer);
+  uint8_t zero[4096] = {0};
+  uint32_t blockSize = msDriveInfo.capacity.BlockSize;
+  uint32_t len = (uint32_t)CBW->CommandData[7] << 8 | CBW->CommandData[8];
+
+  if (CBW->Flags != CMD_DIR_DATA_OUT || len > CBW->TransferLength ||
+      len < 8) {
+    // INVALID FIELD IN CDB
+    return senseError(MS_ILLEGAL_REQUEST, 0X24, 0);
+  }
+  // Parameter list header then 16 byte block descriptors.
+  for (uint32_t i = 8; i + 16 <= len; i += 16) {
+    const uint8_t* d = param + i;
+    uint64_t lba = (uint64_t)getBe32(d) << 32 | getBe32(d + 4);
+    uint32_t count = getBe32(d + 8);
+    if (lba >= m_blocks || count > m_blocks - lba) {
+      return senseError(MS_ILLEGAL_REQUEST, MS_LBA_OUT_OF_RANGE, 0);
+    }
+    if (fseeko(m_file, (off_t)lba*blockSize, SEEK_SET)) {
+      return senseError(MS_MEDIUM_ERROR, 0X0C, 0);
+    }
+    for (uint32_t k = 0; k < count; k++) {
+      if (fwrite(zero, blockSize, 1, m_file) != 1) {
+        return senseError(MS_MEDIUM_ERROR, 0X0C, 0);
+      }
+    }
+    m_unmapped += count;
+  }
+  return MS_CBW_PASS;
+}
+//------------------------------------------------------------------------------
+// READ CAPACITY(16) parameter data, SBC-3 5.16.2.
+uint8_t msController::readCapacity16(msCommandBlockWrapper_t* CBW,
+                                     void* buffer) {
+  uint8_t data[32] = {0};
+  uint32_t len = getBe32(&CBW->CommandData[10]);
+
+  if (CBW->Flags != CMD_DIR_DATA_IN || len > CBW->TransferLength) {
+    // INVALID FIELD IN CDB
+    return senseError(MS_ILLEGAL_REQUEST, 0X24, 0);
+  }
+  putBe32(data, (uint32_t)((m_blocks - 1) >> 32));
+  putBe32(data + 4, (uint32_t)(m_blocks - 1));
+  putBe32(data + 8, msDriveInfo.capacity.BlockSize);
+  memcpy(buffer, data, len < sizeof(data) ? len : sizeof(data));
+  return MS_CBW_PASS;
+}
+//------------------------------------------------------------------------------
+// READ(16) and WRITE(16), SBC-3 5.8 and 5.38.
+uint8_t msController::rw16(msCommandBlockWrapper_t* CBW, void* buffer) {
+  const uint8_t* cdb = CBW->CommandData;
+  bool write = cdb[0] == 0X8A;
+  uint32_t blockSize = msDriveInfo.capacity.BlockSize;
+  uint64_t lba = (uint64_t)getBe32(cdb + 2) << 32 | getBe32(cdb + 6);
+  uint32_t count = getBe32(cdb + 10);
+
+  if (CBW->Flags != (write ? CMD_DIR_DATA_OUT : CMD_DIR_DATA_IN) ||
+      CBW->TransferLength != (uint64_t)count*blockSize) {
+    // INVALID FIELD IN CDB
+    return senseError(MS_ILLEGAL_REQUEST, 0X24, 0);
+  }
+  uint8_t rtn = command(lba, count);
+  if (rtn != MS_CBW_PASS) {
+    return rtn;
+  }
+  if (!write) {
+    if (fread(buffer, blockSize, count, m_file) != count) {
+      return senseError(MS_MEDIUM_ERROR, 0X11, 0);
+    }
+    return MS_CBW_PASS;
+  }
+  if (m_writeProtect) {
+    return senseError(0X07, 0X27, 0);
+  }
+  if (fwrite(buffer, blockSize, count, m_file) != count) {
+    return senseError(MS_MEDIUM_ERROR, 0X0C, 0);
+  }
+  flashWrite(lba, count);
+  if (m_writeCache) {
+    m_unsynced += count;
+  }
+  return MS_CBW_PASS;
+}
+//------------------------------------------------------------------------------
+// Mode parameter header then the Caching page, SBC-3 6.4.5, if the drive
+// has one. Only current values of all pages or the Caching page.
+uint8_t msController::modeSense(msCommandBlockWrapper_t* CBW, void* buffer) {
+  uint8_t data[24] = {0};
+  uint8_t page = CBW->CommandData[2] & 0X3F;
+  uint32_t len = CBW->CommandData[4];
+
+  if (CBW->Flags != CMD_DIR_DATA_IN || len > CBW->TransferLength ||
+      (CBW->CommandData[2] & 0XC0) || (page != 0X3F && page != 0X08) ||
+      (page == 0X08 && !m_cachePage)) {
+    // INVALID FIELD IN CDB
+    return senseError(MS_ILLEGAL_REQUEST, 0X24, 0);
+  }
+  uint32_t n = 4;
+  data[2] = m_writeProtect ? 0X80 : 0;
+  if (m_cachePage) {
+    data[4] = 0X88;  // PS, the page can be saved
+    data[5] = 0X12;
+    data[6] = m_writeCache ? 0X04 : 0;
+    n += 20;
+  }
+  data[0] = n - 1;
+  memcpy(buffer, data, len < n ? len : n);
+  return MS_CBW_PASS;
+}
+//------------------------------------------------------------------------------
+// Only the write cache enable bit of the Caching page can be changed.
+uint8_t msController::modeSelect(msCommandBlockWrapper_t* CBW, void* buffer) {
+  const uint8_t* param = reinterpret_cast<const uint8_t*>(buffer);
+  uint32_t len = CBW->CommandData[4];
+
+  if (CBW->Flags != CMD_DIR_DATA_OUT || len > CBW->TransferLength ||
+      !(CBW->CommandData[1] & 0X10) || (CBW->CommandData[1] & 0X01)) {
+    // INVALID FIELD IN CDB, the page format bit is required and pages
+    // can not be saved.
+    return senseError(MS_ILLEGAL_REQUEST, 0X24, 0);
+  }
+  uint32_t i = 4 + param[3];
+  if (len < i + 3 || param[0] || param[i] != 0X08 || param[i + 1] != 0X12) {
+    // INVALID FIELD IN PARAMETER LIST
+    return senseError(MS_ILLEGAL_REQUEST, 0X26, 0);
+  }
+  m_writeCache = param[i + 2] & 0X04;
+  return MS_CBW_PASS;
+}
@@ -0,0 +1,27 @@
+#include <chrono>
+#include "Arduino.h"
+#include "SPI.h"
+
+HostSerial Serial;
+SPIClass SPI;
+
+static uint64_t simMicros = 0;
+static const auto startTime = std::chrono::steady_clock::now();
+//------------------------------------------------------------------------------
+static uint64_t hostMicros() {
+  auto t = std::chrono::steady_clock::now() - startTime;
+  return std::chrono::duration_cast<std::chrono::microseconds>(t).count() +
+         simMicros;
+}
+//------------------------------------------------------------------------------
+uint32_t micros() {return (uint32_t)hostMicros();}
+uint32_t millis() {return (uint32_t)(hostMicros()/1000);}
+void delay(uint32_t ms) {simMicros += (uint64_t)ms*1000;}
+void delayMicroseconds(uint32_t us) {simMicros += us;}
+void hostAdvanceMicros(uint32_t us) {simMicros += us;}
+void (*hostYieldHook)() = nullptr;
+void yield() {
+  if (hostYieldHook) {
+    hostYieldHook();
+  }
+}
@@ -0,0 +1,151 @@
+/*
+ * Minimal Arduino core for host builds of UsbMscFat.
+ *
+ * Time is real time plus simulated device time. The msController
+ * simulator and delay() advance the simulated part, so benchmarks see
+ * modelled drive latency without sleeping.
+ */
+#ifndef Arduino_h
+#define Arduino_h
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(s))
+
+class __FlashStringHelper;
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+/** Called by yield() if set. The msController simulator yields once per
+ * command, as the real driver does while it waits for a transfer.
+ */
+extern void (*hostYieldHook)();
+/** Advance the simulated part of micros()/millis(). */
+void hostAdvanceMicros(uint32_t us);
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline void digitalWriteFast(uint8_t, uint8_t) {}
+inline int digitalRead(uint8_t) {return LOW;}
+
+class String {
+ public:
+  String(const char* s = "") : m_str(s ? s : "") {}
+  const char* c_str() const {return m_str.c_str();}
+  unsigned int length() const {return m_str.size();}
+ private:
+  std::string m_str;
+};
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t* buf, size_t size) {
+    size_t n = 0;
+    while (size-- && write(*buf++)) n++;
+    return n;
+  }
+  size_t write(const char* s) {
+    return write(reinterpret_cast<const uint8_t*>(s), strlen(s));
+  }
+  virtual int availableForWrite() {return 0;}
+  virtual void flush() {}
+  size_t print(const char* s) {return write(s);}
+  size_t print(const String& s) {return write(s.c_str());}
+  size_t print(const __FlashStringHelper* s) {
+    return write(reinterpret_cast<const char*>(s));
+  }
+  size_t print(char c) {return write((uint8_t)c);}
+  size_t print(unsigned char n, int base = DEC) {return printNum(n, base);}
+  size_t print(int n, int base = DEC) {return printSigned(n, base);}
+  size_t print(unsigned int n, int base = DEC) {return printNum(n, base);}
+  size_t print(long n, int base = DEC) {return printSigned(n, base);}
+  size_t print(unsigned long n, int base = DEC) {return printNum(n, base);}
+  size_t print(long long n, int base = DEC) {return printSigned(n, base);}
+  size_t print(unsigned long long n, int base = DEC) {
+    return printNum(n, base);
+  }
+  size_t print(double n, int digits = 2) {
+    return printf("%.*f", digits, n);
+  }
+  size_t println() {return write("\r\n");}
+  template <typename T> size_t println(T v) {return print(v) + println();}
+  template <typename T> size_t println(T v, int f) {
+    return print(v, f) + println();
+  }
+  int printf(const char* format, ...)
+      __attribute__((format(printf, 2, 3))) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    return n < 0 ? n : write(buf);
+  }
+
+ private:
+  size_t printSigned(long long n, int base) {
+    if (n < 0 && base == DEC) {
+      return print('-') + printNum(-(unsigned long long)n, base);
+    }
+    return printNum(n, base);
+  }
+  size_t printNum(unsigned long long n, int base) {
+    char buf[66];
+    char* str = &buf[sizeof(buf) - 1];
+    *str = 0;
+    if (base < 2) base = DEC;
+    do {
+      int d = n % base;
+      *--str = d < 10 ? '0' + d : 'A' + d - 10;
+      n /= base;
+    } while (n);
+    return write(str);
+  }
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+/** Serial on stdout and stdin. */
+class HostSerial : public Stream {
+ public:
+  void begin(uint32_t) {}
+  operator bool() {return true;}
+  size_t write(uint8_t b) {return putchar(b) == EOF ? 0 : 1;}
+  size_t write(const uint8_t* buf, size_t size) {
+    return fwrite(buf, 1, size, stdout);
+  }
+  using Print::write;
+  int available() {return 0;}
+  int read() {return -1;}
+  int peek() {return -1;}
+  void flush() {fflush(stdout);}
+};
+extern HostSerial Serial;
+#endif  // Arduino_h
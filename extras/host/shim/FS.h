@@ -0,0 +1,100 @@
+/*
+ * Host copy of the Teensy core FS interface used by mscFS.h.
+ */
+#ifndef FS_H
+#define FS_H
+#include "Arduino.h"
+
+#define FILE_READ  0
+#define FILE_WRITE 1
+#define FILE_WRITE_BEGIN 2
+
+enum SeekMode {
+  SeekSet = 0,
+  SeekCur = 1,
+  SeekEnd = 2
+};
+
+/** Reference counted handle to a File implemented by a filesystem. */
+class File : public Stream {
+ public:
+  File() : f(nullptr) {}
+  File(File* file) : f(file) {
+    if (f) f->refcount++;
+  }
+  File(const File& file) : f(file.f) {
+    if (f) f->refcount++;
+  }
+  File& operator=(const File& file) {
+    if (file.f) file.f->refcount++;
+    release();
+    f = file.f;
+    return *this;
+  }
+  virtual ~File() {release();}
+
+  virtual size_t read(void* buf, size_t nbyte) {
+    return f ? f->read(buf, nbyte) : 0;
+  }
+  virtual size_t write(const void* buf, size_t size) {
+    return f ? f->write(buf, size) : 0;
+  }
+  virtual int available() {return f ? f->available() : 0;}
+  virtual int peek() {return f ? f->peek() : -1;}
+  virtual void flush() {if (f) f->flush();}
+  virtual bool truncate(uint64_t size = 0) {
+    return f ? f->truncate(size) : false;
+  }
+  virtual bool seek(uint64_t pos, int mode = SeekSet) {
+    return f ? f->seek(pos, mode) : false;
+  }
+  virtual uint64_t position() {return f ? f->position() : 0;}
+  virtual uint64_t size() {return f ? f->size() : 0;}
+  virtual void close() {
+    if (f) f->close();
+    release();
+  }
+  virtual operator bool() {return f ? (bool)*f : false;}
+  virtual const char* name() {return f ? f->name() : "";}
+  virtual bool isDirectory() {return f ? f->isDirectory() : false;}
+  virtual File openNextFile(uint8_t mode = 0) {
+    return f ? f->openNextFile(mode) : File();
+  }
+  virtual void rewindDirectory() {if (f) f->rewindDirectory();}
+
+  int read() {
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+  }
+  size_t write(uint8_t b) {return write(&b, 1);}
+  size_t write(const char* str) {return write(str, strlen(str));}
+  size_t write(const uint8_t* buf, size_t size) {
+    return write(static_cast<const void*>(buf), size);
+  }
+  bool seek(uint64_t pos, SeekMode mode) {return seek(pos, (int)mode);}
+  unsigned int getRefcount() const {return refcount;}
+
+ private:
+  void release() {
+    if (f && --f->refcount == 0) delete f;
+    f = nullptr;
+  }
+  File* f;
+  unsigned int refcount = 0;
+};
+
+/** Filesystem interface. */
+class FS {
+ public:
+  FS() {}
+  virtual ~FS() {}
+  virtual File open(const char* filename, uint8_t mode = FILE_READ) = 0;
+  virtual bool exists(const char* filepath) = 0;
+  virtual bool mkdir(const char* filepath) = 0;
+  virtual bool rename(const char* oldfilepath, const char* newfilepath) = 0;
+  virtual bool remove(const char* filepath) = 0;
+  virtual bool rmdir(const char* filepath) = 0;
+  virtual uint64_t usedSize() = 0;
+  virtual uint64_t totalSize() = 0;
+};
+#endif  // FS_H
@@ -0,0 +1,28 @@
+/*
+ * SPI stub for host builds. SdFat's SPI card driver links against it
+ * but no SD card is present.
+ */
+#ifndef SPI_h
+#define SPI_h
+#include "Arduino.h"
+
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+class SPISettings {
+ public:
+  SPISettings() {}
+  SPISettings(uint32_t, uint8_t, uint8_t) {}
+};
+
+class SPIClass {
+ public:
+  void begin() {}
+  void end() {}
+  void beginTransaction(SPISettings) {}
+  void endTransaction() {}
+  uint8_t transfer(uint8_t) {return 0XFF;}
+  void transfer(void* buf, size_t count) {memset(buf, 0XFF, count);}
+};
+extern SPIClass SPI;
+#endif  // SPI_h
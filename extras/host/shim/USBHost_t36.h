@@ -0,0 +1,284 @@
+/*
+ * Host stand-in for the parts of USBHost_t36 used by UsbMscFat.
+ *
+ * msController here is a simulated USB mass storage drive backed by a
+ * disk image file. Status codes and structures follow USBHost_t36's MSC
+ * driver so the library sources build unchanged.
+ */
+#ifndef USBHost_t36_h
+#define USBHost_t36_h
+#include <stdint.h>
+#include <stdio.h>
+#include "Arduino.h"
+
+// Status codes returned by the msController transfer functions.
+#define MS_CBW_PASS           0
+#define MS_CBW_FAIL           1
+#define MS_CBW_PHASE_ERROR    2
+#define MS_CSW_TAG_ERROR      253
+#define MS_CSW_SIG_ERROR      254
+#define MS_SCSI_ERROR         255
+
+// Command block wrapper flags.
+#define CBWSIGNATURE          0x43425355
+#define CMD_DIR_DATA_OUT      0x00
+#define CMD_DIR_DATA_IN       0x80
+
+// SCSI sense keys.
+#define MS_NOT_READY          0x02
+#define MS_MEDIUM_ERROR       0x03
+#define MS_ILLEGAL_REQUEST    0x05
+#define MS_UNIT_ATTENTION     0x06
+#define MS_LBA_OUT_OF_RANGE   0x21
+#define MS_MEDIA_CHANGED      0x28
+#define MS_MEDIUM_NOT_PRESENT 0x3A
+
+// Error codes derived from the sense data.
+#define MS_MEDIA_CHANGED_ERR  0x2A
+#define MS_NO_MEDIA_ERR       0x28
+#define MS_UNIT_NOT_READY     0x23
+#define MS_BAD_LBA_ERR        0x29
+#define MS_CMD_ERR            0x26
+
+typedef struct {
+  uint32_t Signature;
+  uint32_t Tag;
+  uint32_t TransferLength;
+  uint8_t  Flags;
+  uint8_t  LUN;
+  uint8_t  CommandLength;
+  uint8_t  CommandData[16];
+} __attribute__((packed)) msCommandBlockWrapper_t;
+
+typedef struct {
+  uint32_t Blocks;
+  uint32_t BlockSize;
+} msSCSICapacity_t;
+
+typedef struct {
+  unsigned DeviceType : 5;
+  unsigned PeripheralQualifier : 3;
+  unsigned Reserved : 7;
+  unsigned Removable : 1;
+  uint8_t  Version;
+  unsigned ResponseDataFormat : 4;
+  unsigned Reserved2 : 1;
+  unsigned NormACA : 1;
+  unsigned TrmTsk : 1;
+  unsigned AERC : 1;
+  uint8_t  AdditionalLength;
+  uint8_t  Reserved3[2];
+  unsigned SoftReset : 1;
+  unsigned CmdQue : 1;
+  unsigned Reserved4 : 1;
+  unsigned Linked : 1;
+  unsigned Sync : 1;
+  unsigned WideBus16Bit : 1;
+  unsigned WideBus32Bit : 1;
+  unsigned RelAddr : 1;
+  uint8_t  VendorID[8];
+  uint8_t  ProductID[16];
+  uint8_t  RevisionID[4];
+} msInquiryResponse_t;
+
+typedef struct {
+  uint8_t  ResponseCode;
+  uint8_t  SegmentNumber;
+  unsigned SenseKey : 4;
+  unsigned Reserved : 1;
+  unsigned ILI : 1;
+  unsigned EOM : 1;
+  unsigned FileMark : 1;
+  uint8_t  Information[4];
+  uint8_t  AdditionalLength;
+  uint8_t  CmdSpecificInformation[4];
+  uint8_t  AdditionalSenseCode;
+  uint8_t  AdditionalSenseQualifier;
+  uint8_t  FieldReplaceableUnitCode;
+  uint8_t  SenseKeySpecific[3];
+  uint8_t  padding[234];
+} msRequestSenseResponse_t;
+
+typedef struct {
+  bool     connected;
+  bool     initialized;
+  bool     mounted;
+  uint8_t  hubNumber;
+  uint8_t  hubPort;
+  uint8_t  deviceAddress;
+  uint16_t idVendor;
+  uint16_t idProduct;
+  msSCSICapacity_t    capacity;
+  msInquiryResponse_t inquiry;
+} msDriveInfo_t;
+
+class USBHost {
+ public:
+  static void begin() {}
+  static void Task() {}
+};
+
+class USBHub {
+ public:
+  explicit USBHub(USBHost&) {}
+};
+
+/**
+ * Simulated USB mass storage drive.
+ *
+ * Each command costs commandMicros plus its transfer time at
+ * bytesPerSecond on the host's simulated clock, see hostAdvanceMicros().
+ * An error can be armed to fail a later command with given sense data.
+ */
+class msController {
+ public:
+  msController() {}
+  explicit msController(USBHost&) {}
+  ~msController() {detach();}
+
+  // Simulation control.
+  /** Attach a disk image, created or extended to blocks*blockSize bytes
+   * if blocks is not zero. Like a real drive, one with more than
+   * 0XFFFFFFFF blocks reports 0XFFFFFFFF in msDriveInfo.capacity and its
+   * size in READ CAPACITY(16).
+   */
+  bool attachImage(const char* path, uint32_t blockSize = 512,
+                   uint64_t blocks = 0);
+  /** Remove the drive, later commands fail with MS_NO_MEDIA_ERR. */
+  void detach();
+  /** Set the timing model. Zero for both makes commands free. */
+  void setTiming(uint32_t commandMicros, uint32_t bytesPerSecond) {
+    m_commandMicros = commandMicros;
+    m_bytesPerSecond = bytesPerSecond;
+  }
+  /** Fail a command with the given sense data.
+   * \param[in] senseKey SCSI sense key, zero disarms.
+   * \param[in] asc Additional sense code.
+   * \param[in] ascq Additional sense code qualifier.
+   * \param[in] after Number of commands that succeed first.
+   * \param[in] count Number of commands to fail, zero for all.
+   */
+  void injectError(uint8_t senseKey, uint8_t asc, uint8_t ascq,
+                   uint32_t after = 0, uint32_t count = 1);
+  /** Accept or reject UNMAP. Unmapped blocks read back as zeros. */
+  void setUnmap(bool supported) {m_unmap = supported;}
+  /** Report a Block Limits VPD page, and claim SPC-4 so it is asked for.
+   * Reads and writes longer than maxBlocks fail as an illegal request.
+   * \param[in] maxBlocks Maximum transfer length, zero for no limit.
+   * \param[in] optimalBlocks Optimal transfer length, zero if unknown.
+   * \param[in] granularity Optimal transfer length granularity.
+   * Takes effect at the next attachImage(). Zero for all removes the page.
+   */
+  void setBlockLimits(uint32_t maxBlocks, uint32_t optimalBlocks,
+                      uint16_t granularity) {
+    m_maxBlocks = maxBlocks;
+    m_optimalBlocks = optimalBlocks;
+    m_granularity = granularity;
+    m_blockLimits = maxBlocks || optimalBlocks || granularity;
+  }
+  /** Model the flash behind the drive. Each write costs pageMicros for
+   * every page it touches, and again for a partial page that must be
+   * read first, plus auMicros for each allocation unit boundary it
+   * crosses. Zero pageBlocks turns the model off.
+   */
+  void setFlashGeometry(uint32_t pageBlocks, uint32_t auBlocks,
+                        uint32_t pageMicros, uint32_t auMicros) {
+    m_pageBlocks = pageBlocks;
+    m_auBlocks = auBlocks;
+    m_pageMicros = pageMicros;
+    m_auMicros = auMicros;
+  }
+  /** Set the write protect switch. Writes fail with DATA PROTECT. */
+  void setWriteProtect(bool protect) {m_writeProtect = protect;}
+  /** Give the drive a Caching mode page with a write cache, without one
+   * it rejects SYNCHRONIZE CACHE like many USB sticks.
+   * \param[in] supported The drive has the page.
+   * \param[in] enabled Initial write cache enable bit.
+   */
+  void setWriteCache(bool supported, bool enabled) {
+    m_cachePage = supported;
+    m_writeCache = enabled;
+  }
+  /** \return Write cache enable bit, as set by MODE SELECT. */
+  bool writeCacheEnabled() const {return m_writeCache;}
+  /** \return SYNCHRONIZE CACHE commands since attachImage(). */
+  uint32_t syncCount() const {return m_syncs;}
+  /** \return Blocks written through the write cache since the last
+   * SYNCHRONIZE CACHE, the ones a power cut could lose.
+   */
+  uint64_t unsyncedBlocks() const {return m_unsynced;}
+  /** \return Blocks unmapped since attachImage(). */
+  uint64_t unmapCount() const {return m_unmapped;}
+  /** \return Commands issued since attachImage(). */
+  uint32_t commandCount() const {return m_commands;}
+  /** \return Bytes moved since attachImage(). */
+  uint64_t byteCount() const {return m_bytes;}
+
+  // Interface used by UsbMscFat.
+  void mscInit() {}
+  uint8_t checkConnectedInitialized();
+  uint8_t msReadBlocks(uint32_t blockAddr, uint16_t blkCnt,
+                       uint16_t blockSize, void* buf);
+  uint8_t msWriteBlocks(uint32_t blockAddr, uint16_t blkCnt,
+                        uint16_t blockSize, const void* buf);
+  uint8_t msReadSectorsWithCB(uint32_t blockAddr, uint16_t blkCnt,
+                              void (*callback)(uint32_t, uint8_t*),
+                              uint32_t token);
+
+  msDriveInfo_t msDriveInfo = {};
+  msRequestSenseResponse_t msSense = {};
+  volatile bool mscTransferComplete = false;
+
+ private:
+  // msDoCommand() is private in USBHost_t36. USBMSCDevice only calls it
+  // with MSC_UNMAP, MSC_BLOCK_LIMITS, MSC_CACHE_CONTROL or MSC_LBA64,
+  // which need a USBHost_t36 patched to make it public. Defining one of
+  // them for the host build stands for that patched library.
+#if MSC_UNMAP || MSC_BLOCK_LIMITS || MSC_CACHE_CONTROL || MSC_LBA64
+ public:
+#endif  // MSC_UNMAP || MSC_BLOCK_LIMITS || MSC_CACHE_CONTROL || MSC_LBA64
+  /** Generic command, only INQUIRY of VPD pages, MODE SENSE(6),
+   * MODE SELECT(6), SYNCHRONIZE CACHE(10), UNMAP, READ CAPACITY(16),
+   * READ(16) and WRITE(16) are simulated.
+   */
+  uint8_t msDoCommand(msCommandBlockWrapper_t* CBW, void* buffer);
+
+ private:
+  uint8_t command(uint64_t blockAddr, uint32_t blkCnt);
+  void flashWrite(uint64_t blockAddr, uint32_t blkCnt);
+  uint8_t senseError(uint8_t senseKey, uint8_t asc, uint8_t ascq);
+  uint8_t inquiryVpd(msCommandBlockWrapper_t* CBW, void* buffer);
+  uint8_t unmap(msCommandBlockWrapper_t* CBW, void* buffer);
+  uint8_t readCapacity16(msCommandBlockWrapper_t* CBW, void* buffer);
+  uint8_t rw16(msCommandBlockWrapper_t* CBW, void* buffer);
+  uint8_t modeSense(msCommandBlockWrapper_t* CBW, void* buffer);
+  uint8_t modeSelect(msCommandBlockWrapper_t* CBW, void* buffer);
+
+  FILE*    m_file = nullptr;
+  uint64_t m_blocks = 0;
+  uint32_t m_commandMicros = 0;
+  uint32_t m_bytesPerSecond = 0;
+  uint32_t m_commands = 0;
+  uint64_t m_bytes = 0;
+  uint64_t m_unmapped = 0;
+  bool     m_unmap = true;
+  bool     m_blockLimits = false;
+  uint32_t m_maxBlocks = 0;
+  uint32_t m_optimalBlocks = 0;
+  uint16_t m_granularity = 0;
+  bool     m_writeProtect = false;
+  bool     m_cachePage = false;
+  bool     m_writeCache = false;
+  uint32_t m_syncs = 0;
+  uint64_t m_unsynced = 0;
+  uint32_t m_pageBlocks = 0;
+  uint32_t m_auBlocks = 0;
+  uint32_t m_pageMicros = 0;
+  uint32_t m_auMicros = 0;
+  uint8_t  m_errKey = 0;
+  uint8_t  m_errAsc = 0;
+  uint8_t  m_errAscq = 0;
+  uint32_t m_errAfter = 0;
+  uint32_t m_errCount = 0;
+};
+#endif  // USBHost_t36_h
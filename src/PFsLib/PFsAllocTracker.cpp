@@ -0,0 +1,291 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "PFsAllocTracker.h"
+#include "PFsFreeCount.h"
+//------------------------------------------------------------------------------
+void PFsAllocTracker::trackFat(uint8_t fatType, uint32_t fatStart,
+                               uint32_t clusterCount) {
+  m_type = fatType;
+  m_perSector = fatType == FAT_TYPE_FAT16 ? 512/2 : 512/4;
+  // Entries zero and one are reserved, clusters are numbered from two.
+  m_limit = clusterCount + 2;
+  m_start = fatStart;
+  m_end = fatStart + (m_limit + m_perSector - 1)/m_perSector;
+  m_valid = false;
+}
+//------------------------------------------------------------------------------
+void PFsAllocTracker::trackBitmap(uint32_t bitmapStart, uint32_t clusterCount) {
+  m_type = FAT_TYPE_EXFAT;
+  m_perSector = 512*8;
+  m_limit = clusterCount;
+  m_start = bitmapStart;
+  m_end = bitmapStart + (m_limit + m_perSector - 1)/m_perSector;
+  m_valid = false;
+}
+//------------------------------------------------------------------------------
+// Free entries in one sector of the tracked region.
+uint32_t PFsAllocTracker::countFree(uint32_t sector, const uint8_t* data) {
+  uint32_t n = entriesIn(sector - m_start);
+  if (m_type == FAT_TYPE_FAT16) {
+    return pfsFreeFat16(reinterpret_cast<const uint16_t*>(data), n);
+  } else if (m_type == FAT_TYPE_FAT32) {
+    return pfsFreeFat32(reinterpret_cast<const uint32_t*>(data), n);
+  }
+  return pfsFreeBitmap(data, n);
+}
+//------------------------------------------------------------------------------
+void PFsAllocTracker::accountRegion(uint32_t sector, const uint8_t* src,
+                                    size_t ns) {
+  uint8_t old[512];
+  uint16_t* index = m_valid ? this->index() : nullptr;
+  for (size_t i = 0; i < ns; i++, sector++, src += 512) {
+    if (sector < m_start || sector >= m_end) {
+      continue;
+    }
+    if (index) {
+      uint32_t free = countFree(sector, src);
+      m_free += free - index[sector - m_start];
+      index[sector - m_start] = free;
+    }
+    // Counting without an index and discard need the old copy. The device
+    // still holds it, SdFat writes from its cache.
+    bool count = m_valid && !index;
+    if (!count && !m_spc) {
+      continue;
+    }
+    if (!devRead(sector, old, 1)) {
+      // The change can't be told. Count again at the next call and drop
+      // the discard list rather than unmap a cluster this write allocated.
+      m_valid = m_valid && index;
+      m_pendingCount = 0;
+      continue;
+    }
+    if (count) {
+      m_free += countFree(sector, src) - countFree(sector, old);
+    }
+    if (m_spc) {
+      accountDiscard(sector, old, src);
+    }
+  }
+}
+//------------------------------------------------------------------------------
+// Queue clusters that go from used to free, drop queued clusters that
+// are allocated again.
+void PFsAllocTracker::accountDiscard(uint32_t sector, const uint8_t* old,
+                                     const uint8_t* src) {
+  uint32_t i = sector - m_start;
+  uint32_t n = entriesIn(i);
+  uint32_t first = i*m_perSector;
+
+  if (m_type == FAT_TYPE_EXFAT) {
+    // Bit k of the bitmap is cluster k + 2.
+    first += 2;
+    for (uint32_t k = 0; k < n; k += 8) {
+      uint8_t change = old[k >> 3] ^ src[k >> 3];
+      for (uint8_t b = 0; change && b < 8 && (k + b) < n; b++, change >>= 1) {
+        if (!(change & 1)) {
+          continue;
+        } else if (src[k >> 3] & (1 << b)) {
+          unqueueDiscard(first + k + b, 1);
+        } else {
+          queueDiscard(first + k + b, 1);
+        }
+      }
+    }
+    return;
+  }
+  // FAT entry k is cluster k, entries zero and one are never free.
+  for (uint32_t k = 0; k < n; k++) {
+    bool wasFree = isFree(old, k);
+    if (wasFree != isFree(src, k)) {
+      if (wasFree) {
+        unqueueDiscard(first + k, 1);
+      } else {
+        queueDiscard(first + k, 1);
+      }
+    }
+  }
+}
+//------------------------------------------------------------------------------
+// Data written to a queued cluster means it was allocated again, even if
+// the FAT or bitmap write that says so is still in the volume cache.
+void PFsAllocTracker::keepWritten(uint32_t sector, size_t ns) {
+  uint32_t bgn = sector > m_dataStart ? sector - m_dataStart : 0;
+  uint32_t end = sector + ns - m_dataStart;
+  uint32_t first = bgn/m_spc;
+  unqueueDiscard(first + 2, (end + m_spc - 1)/m_spc - first);
+}
+//------------------------------------------------------------------------------
+bool PFsAllocTracker::queueDiscard(uint32_t cluster, uint32_t count) {
+  for (uint8_t i = 0; i < m_pendingCount; i++) {
+    if ((m_pending[i].cluster + m_pending[i].count) == cluster) {
+      m_pending[i].count += count;
+      return true;
+    }
+    if ((cluster + count) == m_pending[i].cluster) {
+      m_pending[i].cluster = cluster;
+      m_pending[i].count += count;
+      return true;
+    }
+  }
+  if (m_pendingCount >= PFS_DISCARD_RANGES) {
+    return false;
+  }
+  m_pending[m_pendingCount].cluster = cluster;
+  m_pending[m_pendingCount].count = count;
+  m_pendingCount++;
+  return true;
+}
+//------------------------------------------------------------------------------
+void PFsAllocTracker::unqueueDiscard(uint32_t cluster, uint32_t count) {
+  uint32_t end = cluster + count;
+  uint8_t i = 0;
+  while (i < m_pendingCount) {
+    uint32_t bgn = m_pending[i].cluster;
+    uint32_t pendEnd = bgn + m_pending[i].count;
+    if (end <= bgn || cluster >= pendEnd) {
+      i++;
+    } else if (cluster <= bgn && end >= pendEnd) {
+      m_pending[i] = m_pending[--m_pendingCount];
+    } else if (cluster > bgn && end < pendEnd) {
+      // Split the range, the tail is lost if the list is full.
+      m_pending[i].count = cluster - bgn;
+      if (m_pendingCount < PFS_DISCARD_RANGES) {
+        m_pending[m_pendingCount].cluster = end;
+        m_pending[m_pendingCount].count = pendEnd - end;
+        m_pendingCount++;
+      }
+      return;
+    } else if (cluster <= bgn) {
+      m_pending[i].cluster = end;
+      m_pending[i].count = pendEnd - end;
+      i++;
+    } else {
+      m_pending[i].count = cluster - bgn;
+      i++;
+    }
+  }
+}
+//------------------------------------------------------------------------------
+bool PFsAllocTracker::flushDiscards() {
+  bool rtn = true;
+  if (fenced()) {
+    m_pendingCount = 0;
+    return false;
+  }
+  for (uint8_t i = 0; i < m_pendingCount; i++) {
+    uint64_t sector = m_base + m_dataStart +
+                      (uint64_t)(m_pending[i].cluster - 2)*m_spc;
+    if (!m_usb->unmapSectors(sector, (uint64_t)m_pending[i].count*m_spc)) {
+      rtn = false;
+      if (!m_usb->unmapSupported()) {
+        m_spc = 0;
+        break;
+      }
+    }
+  }
+  m_pendingCount = 0;
+  return rtn;
+}
+//------------------------------------------------------------------------------
+bool PFsAllocTracker::findFreeRun(uint32_t count, uint32_t* bgnCluster) {
+  uint8_t buf[512];
+  uint32_t bgn = 0;
+  uint32_t run = 0;
+
+  if (!m_valid || !index() || m_type == FAT_TYPE_EXFAT || count == 0 ||
+      count > m_free) {
+    return false;
+  }
+  for (uint32_t i = 0; i < indexSize(); i++) {
+    uint32_t first = i*m_perSector;
+    uint32_t n = entriesIn(i);
+    if (m_index[i] == n) {
+      // All free, extend the run without reading the sector.
+      if (run == 0) {
+        bgn = first;
+      }
+      run += n;
+    } else if (m_index[i] == 0) {
+      run = 0;
+      continue;
+    } else {
+      if (!devRead(m_start + i, buf, 1)) {
+        return false;
+      }
+      for (uint32_t k = 0; k < n && run < count; k++) {
+        if (!isFree(buf, k)) {
+          run = 0;
+        } else if (run++ == 0) {
+          bgn = first + k;
+        }
+      }
+    }
+    if (run >= count) {
+      *bgnCluster = bgn;
+      return true;
+    }
+  }
+  return false;
+}
+//------------------------------------------------------------------------------
+bool PFsAllocTracker::writeChain(uint32_t bgnCluster, uint32_t count,
+                                 uint8_t fatCount, uint32_t sectorsPerFat,
+                                 bool link) {
+  uint8_t buf[512];
+  uint32_t endCluster = bgnCluster + count - 1;
+  uint32_t cluster = bgnCluster;
+
+  if (fenced()) {
+    return false;
+  }
+  while (cluster <= endCluster) {
+    uint32_t sector = m_start + cluster/m_perSector;
+    if (!devRead(sector, buf, 1)) {
+      return false;
+    }
+    for (uint32_t k = cluster % m_perSector;
+         k < m_perSector && cluster <= endCluster; k++, cluster++) {
+      uint32_t next = !link ? 0 :
+                      cluster == endCluster ? 0X0FFFFFFF : cluster + 1;
+      if (m_type == FAT_TYPE_FAT16) {
+        reinterpret_cast<uint16_t*>(buf)[k] = next;
+      } else {
+        reinterpret_cast<uint32_t*>(buf)[k] = next;
+      }
+    }
+    // The first FAT goes through writeSector() to keep the count current.
+    if (!writeSector(sector, buf)) {
+      return false;
+    }
+    for (uint8_t f = 1; f < fatCount; f++) {
+      if (!devWrite(sector + f*sectorsPerFat, buf, 1)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,297 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PFsAllocTracker_h
+#define PFsAllocTracker_h
+/**
+ * \file
+ * \brief PFsAllocTracker include file.
+ */
+#include <SdFat.h>
+#include "USBMSCDevice.h"
+
+/** Number of freed cluster ranges held for the next discard. Clusters
+ * freed once the list is full are not discarded.
+ */
+#ifndef PFS_DISCARD_RANGES
+#define PFS_DISCARD_RANGES 16
+#endif
+
+/**
+ * \class PFsAllocTracker
+ * \brief Keeps a volume's free cluster count current.
+ *
+ * PFsVolume mounts its FatVolume or ExFatVolume on this device instead
+ * of the real one. Once a free count has been set, every write to a
+ * sector of the first FAT (FAT16/FAT32) or of the allocation bitmap
+ * (exFAT) adjusts the count by the change in the sector's free entries.
+ * All cluster allocation and release done by SdFat goes through these
+ * writes, so the count stays exact without rescanning the volume.
+ *
+ * Without an index the old sector is read back from the device to count
+ * the change. An index holds the free entry count of each sector, so the
+ * old sector need not be read.
+ *
+ * For FAT16/FAT32, findFreeRun() uses the index to skip full sectors and
+ * to pass over empty ones without reading them.
+ *
+ * A volume past the first 2 TB of a USB drive is reached through a 64-bit
+ * base sector added to every request.
+ *
+ * With discard on, the same FAT and bitmap writes collect the ranges of
+ * clusters that were freed. They are unmapped on the drive at the next
+ * syncDevice(), which SdFat calls after it has written its caches, so
+ * the drive never loses a cluster the volume still uses. A freed cluster
+ * that is allocated or written again before then is dropped from the
+ * list.
+ *
+ * When mounted on a USB drive every request is fenced by the drive's
+ * generation(). Once the drive is unplugged or reports a media change,
+ * the volume cache and all open files fail instead of reaching whatever
+ * media is attached next.
+ */
+class PFsAllocTracker : public BlockDeviceInterface {
+ public:
+  PFsAllocTracker() {}
+  /** Attach to the device holding the volume.
+   * \param[in] dev Device to forward all requests to.
+   * \param[in] usb USB drive behind dev, or nullptr, for the media fence.
+   * \param[in] base First sector of the volume on usb, sector 0 of this
+   *            device.
+   */
+  void begin(BlockDevice* dev, USBMSCDevice* usb = nullptr,
+             uint64_t base = 0) {
+    m_dev = dev;
+    m_usb = usb;
+    m_base = usb ? base : 0;
+    if (usb) {
+      usb->connect();
+    }
+    m_generation = usb ? usb->generation() : 0;
+    m_type = 0;
+    m_valid = false;
+    m_spc = 0;
+    m_pendingCount = 0;
+  }
+  /** \return true if the media the volume was mounted on is gone. */
+  bool mediaChanged() const {
+    return m_usb && m_usb->generation() != m_generation;
+  }
+  /** Track a FAT.
+   * \param[in] fatType FAT_TYPE_FAT16 or FAT_TYPE_FAT32.
+   * \param[in] fatStart First sector of the first FAT.
+   * \param[in] clusterCount Number of data clusters on the volume.
+   */
+  void trackFat(uint8_t fatType, uint32_t fatStart, uint32_t clusterCount);
+  /** Track an exFAT allocation bitmap.
+   * \param[in] bitmapStart First sector of the bitmap.
+   * \param[in] clusterCount Number of clusters in the cluster heap.
+   */
+  void trackBitmap(uint32_t bitmapStart, uint32_t clusterCount);
+  /** \return true if freeCount() is current. */
+  bool valid() const {return m_valid;}
+  /** \return The tracked free cluster count. */
+  uint32_t freeCount() const {return m_free;}
+  /** Start tracking from a known free cluster count. An index must
+   * have been filled by the same scan that counted.
+   * \param[in] count Free clusters on the volume.
+   */
+  void setFreeCount(uint32_t count) {
+    m_free = count;
+    m_valid = m_type != 0;
+  }
+  /** Stop tracking until setFreeCount() is called again. */
+  void invalidate() {m_valid = false;}
+  /** Provide memory for a FAT sector index. It is filled by the next
+   * volume scan, the tracked count is invalidated to force one.
+   * \param[in] index Array for the index or nullptr for none.
+   * \param[in] size Number of entries in index.
+   */
+  void setIndex(uint16_t* index, uint32_t size) {
+    m_index = index;
+    m_indexSize = size;
+    m_valid = false;
+  }
+  /** \return The index to fill while scanning or nullptr if the index
+   * is not used for the tracked region.
+   */
+  uint16_t* index() const {
+    return m_type && m_indexSize >= indexSize() ? m_index : nullptr;
+  }
+  /** \return Number of index entries needed for the tracked region. */
+  uint32_t indexSize() const {return m_end - m_start;}
+  /** Find the first run of free clusters in a FAT using the index.
+   * \param[in] count Number of clusters needed.
+   * \param[out] bgnCluster First cluster of the run.
+   * \return true for success or false if no run was found.
+   */
+  bool findFreeRun(uint32_t count, uint32_t* bgnCluster);
+  /** Link a run of free clusters into a chain in every FAT, or free
+   * the chain again.
+   * \param[in] bgnCluster First cluster of the run.
+   * \param[in] count Number of clusters in the run.
+   * \param[in] fatCount Number of FATs on the volume.
+   * \param[in] sectorsPerFat Size of one FAT.
+   * \param[in] link true to link the run, false to mark it free.
+   * \return true for success or false for failure.
+   */
+  bool writeChain(uint32_t bgnCluster, uint32_t count,
+                  uint8_t fatCount, uint32_t sectorsPerFat, bool link = true);
+
+  /** Start or stop discarding freed clusters. Needs a USB drive that
+   * supports UNMAP and a tracked FAT or bitmap.
+   * \param[in] dataStart First sector of cluster two.
+   * \param[in] sectorsPerCluster Cluster size, zero to stop.
+   * \return true if discard is on.
+   */
+  bool setDiscard(uint32_t dataStart, uint32_t sectorsPerCluster) {
+    m_dataStart = dataStart;
+    m_spc = m_usb && m_usb->unmapSupported() && m_type ? sectorsPerCluster : 0;
+    m_pendingCount = 0;
+    return m_spc != 0;
+  }
+  /** \return true if freed clusters are discarded. */
+  bool discardEnabled() const {return m_spc != 0;}
+  /** Add a run of free clusters to the discard list.
+   * \param[in] cluster First cluster of the run.
+   * \param[in] count Number of clusters in the run.
+   * \return true for success or false if the list is full.
+   */
+  bool queueDiscard(uint32_t cluster, uint32_t count);
+  /** Unmap the clusters in the discard list and empty it.
+   * \return true for success or false for failure.
+   */
+  bool flushDiscards();
+
+  // BlockDeviceInterface
+  bool isBusy() {return m_dev->isBusy();}
+  bool readSector(uint32_t sector, uint8_t* dst) {
+    return !fenced() && devRead(sector, dst, 1);
+  }
+  bool readSectors(uint32_t sector, uint8_t* dst, size_t ns) {
+    return !fenced() && devRead(sector, dst, ns);
+  }
+  uint32_t sectorCount() {
+    if (m_base) {
+      uint64_t n = m_usb->sectorCount64();
+      n = n > m_base ? n - m_base : 0;
+      return n > 0XFFFFFFFF ? 0XFFFFFFFF : (uint32_t)n;
+    }
+    return m_dev->sectorCount();
+  }
+  bool syncDevice() {
+    // Advisory, a failed discard does not fail the sync.
+    if (m_pendingCount) {
+      flushDiscards();
+    }
+    return m_dev->syncDevice();
+  }
+  bool writeSector(uint32_t sector, const uint8_t* src) {
+    if (fenced()) {
+      return false;
+    }
+    account(sector, src, 1);
+    return devWrite(sector, src, 1) || failWrite();
+  }
+  bool writeSectors(uint32_t sector, const uint8_t* src, size_t ns) {
+    if (fenced()) {
+      return false;
+    }
+    account(sector, src, ns);
+    return devWrite(sector, src, ns) || failWrite();
+  }
+
+ private:
+  // The count already includes a write that did not reach the device.
+  bool failWrite() {
+    m_valid = false;
+    return false;
+  }
+  bool fenced() {
+    if (mediaChanged()) {
+      m_valid = false;
+      return true;
+    }
+    return false;
+  }
+  // A cache or scheduler in front of the drive takes 32-bit addresses,
+  // sectors past them go to the drive. A sector always takes the same way.
+  bool devRead(uint32_t sector, uint8_t* dst, size_t ns) {
+    uint64_t s = m_base + sector;
+    return m_usb && (s + ns) > 0X100000000ULL ?
+           m_usb->readSectors64(s, dst, ns) :
+           m_dev->readSectors((uint32_t)s, dst, ns);
+  }
+  bool devWrite(uint32_t sector, const uint8_t* src, size_t ns) {
+    uint64_t s = m_base + sector;
+    return m_usb && (s + ns) > 0X100000000ULL ?
+           m_usb->writeSectors64(s, src, ns) :
+           m_dev->writeSectors((uint32_t)s, src, ns);
+  }
+  void account(uint32_t sector, const uint8_t* src, size_t ns) {
+    if (m_pendingCount && (sector + ns) > m_dataStart) {
+      keepWritten(sector, ns);
+    }
+    if ((m_valid || m_spc) && sector < m_end && (sector + ns) > m_start) {
+      accountRegion(sector, src, ns);
+    }
+  }
+  void accountRegion(uint32_t sector, const uint8_t* src, size_t ns);
+  void accountDiscard(uint32_t sector, const uint8_t* old, const uint8_t* src);
+  void keepWritten(uint32_t sector, size_t ns);
+  void unqueueDiscard(uint32_t cluster, uint32_t count);
+  uint32_t countFree(uint32_t sector, const uint8_t* data);
+  uint32_t entriesIn(uint32_t i) const {
+    uint32_t n = m_limit - i*m_perSector;
+    return n < m_perSector ? n : m_perSector;
+  }
+  bool isFree(const uint8_t* data, uint32_t i) const {
+    return m_type == FAT_TYPE_FAT16 ?
+           reinterpret_cast<const uint16_t*>(data)[i] == 0 :
+           (reinterpret_cast<const uint32_t*>(data)[i] & 0X0FFFFFFF) == 0;
+  }
+
+  BlockDevice* m_dev = nullptr;
+  USBMSCDevice* m_usb = nullptr;
+  uint64_t m_base = 0;
+  uint32_t m_generation = 0;
+  uint32_t m_start = 0;
+  uint32_t m_end = 0;
+  uint32_t m_limit = 0;
+  uint32_t m_perSector = 0;
+  uint32_t m_free = 0;
+  uint16_t* m_index = nullptr;
+  uint32_t m_indexSize = 0;
+  uint32_t m_dataStart = 0;
+  uint32_t m_spc = 0;
+  struct {
+    uint32_t cluster;
+    uint32_t count;
+  } m_pending[PFS_DISCARD_RANGES];
+  uint8_t  m_pendingCount = 0;
+  uint8_t  m_type = 0;
+  bool     m_valid = false;
+};
+#endif  // PFsAllocTracker_h
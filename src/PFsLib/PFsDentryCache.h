@@ -0,0 +1,140 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef PFsDentryCache_h
+#define PFsDentryCache_h
+/**
+ * \file
+ * \brief PFsDentryCache include file.
+ */
+#include <stdint.h>
+
+/** Number of path components a volume remembers, zero for none. Each
+ * one takes 16 bytes. With none and no directory index, paths are
+ * resolved by SdFat.
+ */
+#ifndef PFS_DENTRY_CACHE
+#define PFS_DENTRY_CACHE 0
+#endif
+
+/** A remembered path component. */
+typedef struct {
+  /** Key of the directory holding the name. */
+  uint32_t parent;
+  /** Hash of the name from PFsDirIndex::hashName(). */
+  uint32_t hash;
+  /** Entry index of the name in the directory. */
+  uint32_t entry;
+  /** Time of last use, zero for an unused slot. */
+  uint32_t used;
+} PFsDentry_t;
+/**
+ * \class PFsDentryCache
+ * \brief Least recently used names and where they were found.
+ *
+ * PFsVolume records each name it finds while resolving a path, so a path
+ * opened again goes from each directory straight to the entry for the
+ * next name. As with PFsDirIndex the name in the entry is checked before
+ * it is used, the cache only has to be cleared when a change could make
+ * it point somewhere that checks out but is wrong.
+ */
+class PFsDentryCache {
+ public:
+  PFsDentryCache() {clear();}
+  /** Forget all names. */
+  void clear() {
+    for (int i = 0; i < PFS_DENTRY_CACHE; i++) {
+      m_dentry[i].used = 0;
+    }
+    m_clock = 0;
+  }
+  /** Find a name.
+   * \param[in] parent Key of the directory.
+   * \param[in] hash Hash of the name.
+   * \param[out] entry Entry index of the name in the directory.
+   * \return true if found.
+   */
+  bool find(uint32_t parent, uint32_t hash, uint32_t* entry) {
+    PFsDentry_t* d = lookup(parent, hash);
+    if (!d) {
+      return false;
+    }
+    d->used = tick();
+    *entry = d->entry;
+    return true;
+  }
+  /** Remember a name, replacing the least recently used one.
+   * \param[in] parent Key of the directory.
+   * \param[in] hash Hash of the name.
+   * \param[in] entry Entry index of the name in the directory.
+   */
+  void insert(uint32_t parent, uint32_t hash, uint32_t entry) {
+    PFsDentry_t* d = lookup(parent, hash);
+    if (!d) {
+      for (int i = 0; i < PFS_DENTRY_CACHE; i++) {
+        if (!d || m_dentry[i].used < d->used) {
+          d = &m_dentry[i];
+        }
+      }
+    }
+    if (d) {
+      d->parent = parent;
+      d->hash = hash;
+      d->entry = entry;
+      d->used = tick();
+    }
+  }
+  /** Forget a name that did not check out.
+   * \param[in] parent Key of the directory.
+   * \param[in] hash Hash of the name.
+   */
+  void drop(uint32_t parent, uint32_t hash) {
+    PFsDentry_t* d = lookup(parent, hash);
+    if (d) {
+      d->used = 0;
+    }
+  }
+
+ private:
+  PFsDentry_t* lookup(uint32_t parent, uint32_t hash) {
+    for (int i = 0; i < PFS_DENTRY_CACHE; i++) {
+      PFsDentry_t* d = &m_dentry[i];
+      if (d->used && d->parent == parent && d->hash == hash) {
+        return d;
+      }
+    }
+    return nullptr;
+  }
+  uint32_t tick() {
+    if (++m_clock == 0) {
+      // Forget everything rather than let the clock wrap.
+      clear();
+      m_clock = 1;
+    }
+    return m_clock;
+  }
+  PFsDentry_t m_dentry[PFS_DENTRY_CACHE > 0 ? PFS_DENTRY_CACHE : 1];
+  uint32_t m_clock;
+};
+#endif  // PFsDentryCache_h
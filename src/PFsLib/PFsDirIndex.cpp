@@ -0,0 +1,147 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "PFsDirIndex.h"
+//------------------------------------------------------------------------------
+void PFsDirIndex::setTable(PFsDirSlot_t* table, uint32_t size) {
+  // A table that small would be full before it was useful.
+  m_table = size >= 16 ? table : nullptr;
+  m_size = m_table ? size : 0;
+  clear();
+}
+//------------------------------------------------------------------------------
+void PFsDirIndex::clear() {
+  for (uint32_t i = 0; i < m_size; i++) {
+    m_table[i].entry = EMPTY;
+  }
+  m_used = 0;
+  for (int i = 0; i < PFS_DIR_INDEX_DIRS; i++) {
+    m_state[i] = UNUSED;
+  }
+}
+//------------------------------------------------------------------------------
+int PFsDirIndex::findDir(uint32_t key) const {
+  for (int i = 0; i < PFS_DIR_INDEX_DIRS; i++) {
+    if (m_state[i] != UNUSED && m_key[i] == key) {
+      return m_state[i] == INDEXED ? i : TOO_LARGE;
+    }
+  }
+  return NOT_INDEXED;
+}
+//------------------------------------------------------------------------------
+int PFsDirIndex::addDir(uint32_t key) {
+  int i;
+  for (i = 0; i < PFS_DIR_INDEX_DIRS; i++) {
+    if (m_state[i] == UNUSED) {
+      break;
+    }
+  }
+  if (i == PFS_DIR_INDEX_DIRS) {
+    clear();
+    i = 0;
+  }
+  m_key[i] = key;
+  m_state[i] = INDEXED;
+  return i;
+}
+//------------------------------------------------------------------------------
+void PFsDirIndex::dropDir(uint32_t key) {
+  for (int i = 0; i < PFS_DIR_INDEX_DIRS; i++) {
+    if (m_state[i] != UNUSED && m_key[i] == key) {
+      m_state[i] = UNUSED;
+    }
+  }
+}
+//------------------------------------------------------------------------------
+bool PFsDirIndex::othersIndexed(int dir) const {
+  for (int i = 0; i < PFS_DIR_INDEX_DIRS; i++) {
+    if (i != dir && m_state[i] == INDEXED) {
+      return true;
+    }
+  }
+  return false;
+}
+//------------------------------------------------------------------------------
+bool PFsDirIndex::insert(int dir, uint32_t hash, uint32_t entry) {
+  // Keep a quarter of the slots empty so searches stay short and end.
+  if (m_used >= m_size - m_size/4 || entry > 0XFFFFFF) {
+    return false;
+  }
+  uint32_t i = probe(dir, hash);
+  while (m_table[i].entry != EMPTY) {
+    if (++i == m_size) {
+      i = 0;
+    }
+  }
+  m_table[i].hash = hash;
+  m_table[i].entry = (uint32_t)dir << 24 | entry;
+  m_used++;
+  return true;
+}
+//------------------------------------------------------------------------------
+bool PFsDirIndex::next(int dir, uint32_t hash, uint32_t* slot,
+                       uint32_t* entry) const {
+  uint32_t i = *slot;
+  while (m_table[i].entry != EMPTY) {
+    const PFsDirSlot_t& s = m_table[i];
+    if (++i == m_size) {
+      i = 0;
+    }
+    if (s.hash == hash && (s.entry >> 24) == (uint32_t)dir) {
+      *slot = i;
+      *entry = s.entry & 0XFFFFFF;
+      return true;
+    }
+  }
+  *slot = i;
+  return false;
+}
+//------------------------------------------------------------------------------
+// FNV-1a over the name with ASCII letters folded to upper case. FAT and
+// exFAT compare names without regard to case.
+uint32_t PFsDirIndex::hashName(const char* name, size_t len) {
+  uint32_t h = 0X811C9DC5;
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = name[i];
+    if (c >= 'a' && c <= 'z') {
+      c -= 'a' - 'A';
+    }
+    h = (h ^ c)*0X01000193;
+  }
+  return h;
+}
+//------------------------------------------------------------------------------
+uint32_t PFsDirIndex::exFatHash(const char* name, size_t len) {
+  uint16_t h = 0;
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = name[i];
+    if (c >= 'a' && c <= 'z') {
+      c -= 'a' - 'A';
+    }
+    // Low byte then high byte of the UTF-16 character.
+    h = ((h & 1) ? 0X8000 : 0) + (h >> 1) + c;
+    h = ((h & 1) ? 0X8000 : 0) + (h >> 1);
+  }
+  return exFatStreamHash(len, h);
+}
@@ -0,0 +1,163 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef PFsDirIndex_h
+#define PFsDirIndex_h
+/**
+ * \file
+ * \brief PFsDirIndex include file.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+/** Number of directories a volume's lookup index holds at once. */
+#ifndef PFS_DIR_INDEX_DIRS
+#define PFS_DIR_INDEX_DIRS 4
+#endif
+#if PFS_DIR_INDEX_DIRS < 1 || PFS_DIR_INDEX_DIRS > 254
+#error PFS_DIR_INDEX_DIRS must be 1 to 254
+#endif
+
+/** One slot of a directory lookup index. */
+typedef struct {
+  /** Hash of the entry's name. */
+  uint32_t hash;
+  /** Directory number in the high byte, entry index in the low 24 bits. */
+  uint32_t entry;
+} PFsDirSlot_t;
+/**
+ * \class PFsDirIndex
+ * \brief Hash table from names to directory entry indexes.
+ *
+ * PFsVolume fills it with every name in a directory the first time a
+ * path is looked up there, then opens files by entry index. Directories
+ * are known by a key, the sector holding their first entry. On exFAT the
+ * hash is the one already stored in each stream entry, so names are not
+ * read to build the index.
+ *
+ * Slots are never removed. A slot left behind by a removed or renamed
+ * file points at an entry that no longer has that name, so every match
+ * must be checked against the directory before it is used. What the
+ * index must not do is miss a name, so a directory that does not fit is
+ * not indexed at all.
+ */
+class PFsDirIndex {
+ public:
+  /** findDir() result for a directory that is not indexed. */
+  static const int NOT_INDEXED = -1;
+  /** findDir() result for a directory that did not fit. */
+  static const int TOO_LARGE = -2;
+
+  PFsDirIndex() {}
+  /** Provide memory for the table and forget all directories.
+   * \param[in] table Array of slots or nullptr to stop indexing.
+   * \param[in] size Number of slots in table.
+   */
+  void setTable(PFsDirSlot_t* table, uint32_t size);
+  /** \return true if a table has been provided. */
+  bool enabled() const {return m_table != nullptr;}
+  /** Forget all directories. */
+  void clear();
+  /** Find a directory.
+   * \param[in] key Directory key.
+   * \return Directory number, NOT_INDEXED or TOO_LARGE.
+   */
+  int findDir(uint32_t key) const;
+  /** Start a directory. Forgets all directories first if every directory
+   * number is in use.
+   * \param[in] key Directory key.
+   * \return Directory number for insert().
+   */
+  int addDir(uint32_t key);
+  /** Forget a directory, for one that was removed. Its slots stay until
+   * the table is cleared.
+   * \param[in] key Directory key.
+   */
+  void dropDir(uint32_t key);
+  /** Record that a directory did not fit.
+   * \param[in] dir Directory number from addDir().
+   */
+  void setTooLarge(int dir) {m_state[dir] = TOO_LARGE_DIR;}
+  /** \return true if another directory is indexed besides dir.
+   * \param[in] dir Directory number.
+   */
+  bool othersIndexed(int dir) const;
+  /** Add a name.
+   * \param[in] dir Directory number.
+   * \param[in] hash Hash of the name from hashName() or exFatHash().
+   * \param[in] entry Entry index of the name in the directory.
+   * \return false if the table is full or entry is out of range.
+   */
+  bool insert(int dir, uint32_t hash, uint32_t entry);
+  /** \return The slot to start a search for hash in dir.
+   * \param[in] dir Directory number.
+   * \param[in] hash Hash of the name.
+   */
+  uint32_t probe(int dir, uint32_t hash) const {
+    return (hash ^ (uint32_t)dir*0X9E3779B9UL) % m_size;
+  }
+  /** Find the next entry in dir that may have the name.
+   * \param[in] dir Directory number.
+   * \param[in] hash Hash of the name.
+   * \param[in,out] slot Slot from probe(), advanced past the match.
+   * \param[out] entry Entry index to check.
+   * \return false if there are no more matches.
+   */
+  bool next(int dir, uint32_t hash, uint32_t* slot, uint32_t* entry) const;
+  /** Hash a name, ignoring ASCII case.
+   * \param[in] name Name, not terminated.
+   * \param[in] len Length of name.
+   * \return Hash of the name.
+   */
+  static uint32_t hashName(const char* name, size_t len);
+  /** Hash an ASCII name the way exFAT does for the NameHash field of a
+   * stream entry, over the up-cased UTF-16 name.
+   * \param[in] name Name, not terminated.
+   * \param[in] len Length of name.
+   * \return The NameHash in the low 16 bits and the name length in
+   *         bits 16 to 23, to compare with exFatStreamHash().
+   */
+  static uint32_t exFatHash(const char* name, size_t len);
+  /** \return The name length and NameHash of an exFAT stream entry in
+   * the form exFatHash() gives.
+   * \param[in] nameLength NameLength field of the entry.
+   * \param[in] nameHash NameHash field of the entry.
+   */
+  static uint32_t exFatStreamHash(uint8_t nameLength, uint16_t nameHash) {
+    return (uint32_t)nameLength << 16 | nameHash;
+  }
+
+ private:
+  static const uint32_t EMPTY = 0XFFFFFFFF;
+  static const uint8_t UNUSED = 0;
+  static const uint8_t INDEXED = 1;
+  static const uint8_t TOO_LARGE_DIR = 2;
+
+  PFsDirSlot_t* m_table = nullptr;
+  uint32_t m_size = 0;
+  uint32_t m_used = 0;
+  uint32_t m_key[PFS_DIR_INDEX_DIRS];
+  uint8_t m_state[PFS_DIR_INDEX_DIRS] = {};
+};
+#endif  // PFsDirIndex_h
@@ -139,6 +139,20 @@ bool PFsExFatFormatter::format(PFsVolume &partVol, uint8_t* secBuf, print_t* pr)
   //   At least FatOffset + FatLength * NumberOfFats, to account for the sectors all the preceding regions consume
   //   At most 2^32- 1 or VolumeLength - (ClusterCount * 2^SectorsPerClusterShift), whichever calculation is less
   clusterHeapOffset = 2*fatLength;
+  // Clusters are at least 128 KB, so starting the heap on a drive block
+  // aligns every cluster. The pad comes out of the slack after the heap.
+  m = m_clusterAlign;
+  if (partVol.usbDevice() && partVol.usbDevice()->sectorsPerBlock() > m) {
+    m = partVol.usbDevice()->sectorsPerBlock();
+  }
+  // Start on an allocation unit found by profileDrive() if the slack
+  // covers the pad.
+  if (partVol.usbDevice() &&
+      partVol.usbDevice()->profile().auSectors > m &&
+      partVol.usbDevice()->profile().auSectors <= fatLength) {
+    m = partVol.usbDevice()->profile().auSectors;
+  }
+  clusterHeapOffset += (0 - (partitionOffset + clusterHeapOffset)) & (m - 1);
   //clusterHeapOffset = partVol.getExFatVol()->clusterHeapStartSector() - m_relativeSectors;
   
   //The ClusterCount field shall describe the number of clusters the Cluster Heap contains
@@ -482,6 +496,10 @@ bool PFsExFatFormatter::createExFatPartition(BlockDevice* dev, uint32_t startSec
   //   At least FatOffset + FatLength * NumberOfFats, to account for the sectors all the preceding regions consume
   //   At most 2^32- 1 or VolumeLength - (ClusterCount * 2^SectorsPerClusterShift), whichever calculation is less
   clusterHeapOffset = 2*fatLength;
+  // Clusters are at least 128 KB, so starting the heap on a drive block
+  // aligns every cluster. The pad comes out of the slack after the heap.
+  clusterHeapOffset += (0 - (partitionOffset + clusterHeapOffset)) &
+                       (m_clusterAlign - 1);
   //clusterHeapOffset = partVol.getExFatVol()->clusterHeapStartSector() - m_relativeSectors;
   
   //The ClusterCount field shall describe the number of clusters the Cluster Heap contains
@@ -49,6 +49,15 @@ class PFsExFatFormatter {
   bool createExFatPartition(BlockDevice* dev, uint32_t startSector, uint32_t sectorCount, uint8_t* secBuf, print_t* pr);
   uint8_t addExFatPartitionToMbr();
   void dump_hexbytes(const void *ptr, int len);
+  /**
+   * Align the cluster heap to drive blocks. format() also aligns to the
+   * block size of the USB drive it is on, and to its allocation unit if
+   * USBMSCDevice::profileDrive() was run.
+   *
+   * \param[in] sectors Alignment in 512 byte sectors, a power of two.
+   *            8 for 4Kn drives, 1 for no alignment.
+   */
+  void setClusterAlign(uint8_t sectors) {m_clusterAlign = sectors;}
 
  private:
  
@@ -82,6 +91,7 @@ class PFsExFatFormatter {
   uint32_t m_part_relativeSectors;
   uint32_t m_bytesPerCluster;
   uint8_t m_part;
+  uint8_t m_clusterAlign = 1;
   uint32_t m_sectorCount;
   uint32_t m_capacityMB;
   char volName[32];
@@ -42,6 +42,9 @@ uint16_t  BU32 = 8192;
 // Assume 512 byte sectors.
 const uint16_t BYTES_PER_SECTOR = 512;
 const uint16_t SECTORS_PER_MB = 0X100000/BYTES_PER_SECTOR;
+// Smallest buffer used to zero the FATs, smaller FATs are written a
+// sector at a time.
+#define CSECTORS_PER_WRITE 32
 const uint16_t FAT16_ROOT_ENTRY_COUNT = 512;
 const uint16_t FAT16_ROOT_SECTOR_COUNT =
                32*FAT16_ROOT_ENTRY_COUNT/BYTES_PER_SECTOR;
@@ -111,6 +114,32 @@ bool PFsFatFormatter::format(PFsVolume &partVol, uint8_t fat_type, uint8_t* secB
     // SDXC cards
     m_sectorsPerCluster = 128;
   }
+  m_align = m_clusterAlign;
+  if (partVol.usbDevice() &&
+      partVol.usbDevice()->sectorsPerBlock() > m_align) {
+    m_align = partVol.usbDevice()->sectorsPerBlock();
+  }
+  m_dataAlign = m_align;
+  if (partVol.usbDevice()) {
+    // Clusters of at least a flash page and a data area that starts on an
+    // allocation unit, if profileDrive() found them.
+    const msDriveProfile_t& profile = partVol.usbDevice()->profile();
+    if (profile.pageSectors > m_align && profile.pageSectors <= 128) {
+      m_align = profile.pageSectors;
+    }
+    m_dataAlign = m_align;
+    if (profile.auSectors > m_dataAlign && profile.auSectors <= BU32) {
+      m_dataAlign = profile.auSectors;
+    }
+  }
+  m_writeSectors = CSECTORS_PER_WRITE;
+  if (partVol.usbDevice() &&
+      partVol.usbDevice()->optimalTransferSectors() > m_writeSectors) {
+    m_writeSectors = partVol.usbDevice()->optimalTransferSectors();
+  }
+  if (m_sectorsPerCluster < m_align) {
+    m_sectorsPerCluster = m_align;
+  }
     
   //rtn = m_sectorCount < 0X400000 ? makeFat16() :makeFat32();
   
@@ -176,6 +205,12 @@ bool PFsFatFormatter::createFatPartition(BlockDevice* dev, uint8_t fat_type, uin
     // SDXC cards
     m_sectorsPerCluster = 128;
   }
+  m_align = m_clusterAlign;
+  m_dataAlign = m_align;
+  m_writeSectors = CSECTORS_PER_WRITE;
+  if (m_sectorsPerCluster < m_align) {
+    m_sectorsPerCluster = m_align;
+  }
 
 if (fat_type == 0) {
   if (m_capacityMB < 2048) fat_type = FAT_TYPE_FAT16;
@@ -207,43 +242,23 @@ bool PFsFatFormatter::makeFat16() {
 	
   DBGPrintf(" MAKEFAT16\n");
   uint32_t nc;
-  uint32_t r;
   PbsFat_t* pbs = reinterpret_cast<PbsFat_t*>(m_secBuf);
   
-  for (m_dataStart = 2*BU16; ; m_dataStart += BU16) {
-    nc = (m_sectorCount - m_dataStart)/m_sectorsPerCluster;
-    m_fatSize = (nc + 2 + (BYTES_PER_SECTOR/2) - 1)/(BYTES_PER_SECTOR/2);
-    r = BU16 + 1 + 2*m_fatSize + FAT16_ROOT_SECTOR_COUNT;
-    if (m_dataStart >= r) {
-      m_relativeSectors = m_dataStart - r + BU16;
-      break;
-    }
-  }
+  nc = layoutFat(1, FAT16_ROOT_SECTOR_COUNT, BYTES_PER_SECTOR/2, m_dataAlign);
 
-  //nc = (m_sectorCount - m_dataStart)/m_sectorsPerCluster;
-  //m_fatSize = (nc + 2 + (BYTES_PER_SECTOR/2) - 1)/(BYTES_PER_SECTOR/2);
-  
-  DBGPrintf("m_relativeSectors: %u, m_fatSize: %u, m_dataStart: %u\n",m_relativeSectors, m_fatSize, m_dataStart) ;
+  DBGPrintf("m_reservedSectorCount: %u, m_fatSize: %u, m_dataStart: %u\n", m_reservedSectorCount, m_fatSize, m_dataStart) ;
   
   // check valid cluster count for FAT16 volume
   if (nc < 4085 || nc >= 65525) {
     writeMsg("Bad cluster count\r\n");
     return false;
   }
-  m_reservedSectorCount = 1;
-  m_fatStart = m_relativeSectors + m_reservedSectorCount;
-  m_totalSectors = nc*m_sectorsPerCluster
-                   + 2*m_fatSize + m_reservedSectorCount + 32;
-  if (m_totalSectors < 65536) {
+  if (m_sectorCount < 65536) {
     m_partType = 0X04;
   } else {
     m_partType = 0X06;
   }
-
-	//Added to keep relative sectors straight
 	m_relativeSectors = m_part_relativeSectors;
-	m_fatStart = m_relativeSectors + m_reservedSectorCount;
-  	m_dataStart= m_fatStart + 2 * m_fatSize + FAT16_ROOT_SECTOR_COUNT;
 	m_totalSectors = m_sectorCount;
 
   DBGPrintf("partType: %d, m_relativeSectors: %u, fatStart: %u, fatDatastart: %u, totalSectors: %u\n", m_partType, m_relativeSectors, m_fatStart, m_dataStart, m_totalSectors);
@@ -277,29 +292,55 @@ bool PFsFatFormatter::makeFat16() {
 }
 
 
+//------------------------------------------------------------------------------
+// Lay out the reserved area, two FATs and the root directory in the
+// partition. The reserved area is padded so the first cluster starts on
+// align sectors of the drive, a drive block or an allocation unit if the
+// drive has been profiled. The pad is taken before the cluster count and
+// the FAT size are set, so the count returned is the one SdFat finds.
+uint32_t PFsFatFormatter::layoutFat(uint16_t reserved, uint32_t rootSectors,
+                                    uint32_t entriesPerSector, uint32_t align) {
+  uint32_t nc;
+  // Start below the size needed, each FAT sector maps entriesPerSector
+  // clusters and the pad is less than align.
+  uint32_t used = reserved + rootSectors + align;
+  m_fatSize = m_sectorCount > used ? (m_sectorCount - used)/
+              ((uint32_t)m_sectorsPerCluster*entriesPerSector + 2) : 0;
+  if (m_fatSize == 0) {
+    m_fatSize = 1;
+  }
+  for (;;) {
+    uint32_t dataOffset = reserved + 2*m_fatSize + rootSectors;
+    uint32_t pad = (0 - (m_part_relativeSectors + dataOffset)) & (align - 1);
+    dataOffset += pad;
+    if (dataOffset >= m_sectorCount) {
+      return 0;
+    }
+    nc = (m_sectorCount - dataOffset)/m_sectorsPerCluster;
+    // A larger FAT only lowers the count, so this ends.
+    uint32_t fatSize = (nc + 2 + entriesPerSector - 1)/entriesPerSector;
+    if (fatSize <= m_fatSize) {
+      m_reservedSectorCount = reserved + pad;
+      m_fatStart = m_part_relativeSectors + m_reservedSectorCount;
+      m_dataStart = m_part_relativeSectors + dataOffset;
+      return nc;
+    }
+    m_fatSize = fatSize;
+  }
+}
 //------------------------------------------------------------------------------
 bool PFsFatFormatter::makeFat32() {
 	DBGPrintf(" MAKEFAT32\n");
   uint32_t nc;
-  uint32_t r;
   
   PbsFat_t* pbs = reinterpret_cast<PbsFat_t*>(m_secBuf);
   FsInfo_t* fsi = reinterpret_cast<FsInfo_t*>(m_secBuf);
   
-  m_relativeSectors = BU32;
-  for (m_dataStart = 2*BU32; ; m_dataStart += BU32) {
-    nc = (m_sectorCount - m_dataStart)/m_sectorsPerCluster;
-    m_fatSize = (nc + 2 + (BYTES_PER_SECTOR/4) - 1)/(BYTES_PER_SECTOR/4);
-    r = m_relativeSectors + 9 + 2*m_fatSize;
-	DBGPrintf("m_dataStart: %u, m_fatSize: %u, r: %u\n", m_dataStart, m_fatSize, r);
-    if (m_dataStart >= r) {
-      break;
-    }
-  }
-  
-    //nc = (m_sectorCount - m_dataStart)/m_sectorsPerCluster;
-    //m_fatSize = (nc + 2 + (BYTES_PER_SECTOR/4) - 1)/(BYTES_PER_SECTOR/4);
-	DBGPrintf("    m_part: %d\n", m_part);
+  // The boot sectors and their backups take the first nine sectors. The
+  // data area starts on BU32, which covers the drive's alignment.
+  nc = layoutFat(9, 0, BYTES_PER_SECTOR/4, BU32);
+
+    DBGPrintf("    m_part: %d\n", m_part);
     DBGPrintf("    m_sectorCount: %d\n", m_sectorCount);
     DBGPrintf("    m_dataStart: %d\n", m_dataStart);
     DBGPrintf("    m_sectorsPerCluster: %d\n", m_sectorsPerCluster);
@@ -311,12 +352,9 @@ bool PFsFatFormatter::makeFat32() {
     writeMsg("Bad cluster count\r\n");
     return false;
   }
-  m_reservedSectorCount = m_dataStart - m_relativeSectors - 2*m_fatSize;
-  m_fatStart = m_relativeSectors + m_reservedSectorCount;
-  m_totalSectors = nc*m_sectorsPerCluster + m_dataStart - m_relativeSectors;
   // type depends on address of end sector
   // max CHS has lba = 16450560 = 1024*255*63
-  if ((m_relativeSectors + m_totalSectors) <= 16450560) {
+  if ((m_part_relativeSectors + m_sectorCount) <= 16450560) {
     // FAT32 with CHS and LBA
     m_partType = 0X0B;
   } else {
@@ -324,11 +362,7 @@ bool PFsFatFormatter::makeFat32() {
     m_partType = 0X0C;
   }
   
-  //Write MBR
-  //Added to keep relative sectors straight
 	m_relativeSectors = m_part_relativeSectors;
-	m_fatStart = m_relativeSectors + m_reservedSectorCount;
-	m_dataStart = m_relativeSectors + m_dataStart;
 	m_totalSectors = m_sectorCount;
 	
 #if defined(DBG_Print)
@@ -504,38 +538,44 @@ uint8_t PFsFatFormatter::addPartitionToMbr() {
 
 //-----------------------------------------------------------------------------
 
-#define CSECTORS_PER_WRITE 32
 bool PFsFatFormatter::initFatDir(uint8_t fatType, uint32_t sectorCount) {
   DBGPrintf("PFsFatFormatter::initFatDir(%u, %u)\n", fatType, sectorCount);
   size_t n;
   uint32_t fat_sector = 1;
   writeMsg("Writing FAT ");
-  if (sectorCount >= CSECTORS_PER_WRITE) {
-    uint8_t *large_buffer = (uint8_t *)malloc(BYTES_PER_SECTOR * CSECTORS_PER_WRITE);
-    if (large_buffer) {
-      memset(large_buffer, 0, BYTES_PER_SECTOR * CSECTORS_PER_WRITE);
-      uint32_t sectors_remaining = sectorCount;
-      uint32_t loops_per_dot = sectorCount/(32*CSECTORS_PER_WRITE);
-      uint32_t loop_count = 0;
-      while (sectors_remaining >= CSECTORS_PER_WRITE) {
-        if (!m_dev->writeSectors(m_fatStart + fat_sector, large_buffer, CSECTORS_PER_WRITE)) {
-           return false;
-        }
-        fat_sector += CSECTORS_PER_WRITE;
-        sectors_remaining -= CSECTORS_PER_WRITE;
-        if (++loop_count == loops_per_dot) {
-          writeMsg(".");
-          loop_count = 0;
-        }
+  // Zero the FATs in the drive's optimal transfer size, less if the
+  // buffer can't be had.
+  uint32_t chunk = m_writeSectors < sectorCount ? m_writeSectors : sectorCount;
+  uint8_t *large_buffer = nullptr;
+  while (chunk >= CSECTORS_PER_WRITE &&
+         !(large_buffer = (uint8_t *)malloc(BYTES_PER_SECTOR * chunk))) {
+    chunk /= 2;
+  }
+  if (large_buffer) {
+    memset(large_buffer, 0, BYTES_PER_SECTOR * chunk);
+    uint32_t sectors_remaining = sectorCount;
+    uint32_t loops_per_dot = sectorCount/(32*chunk);
+    uint32_t loop_count = 0;
+    while (sectors_remaining >= chunk) {
+      if (!m_dev->writeSectors(m_fatStart + fat_sector, large_buffer, chunk)) {
+         free(large_buffer);
+         return false;
       }
-      if (sectors_remaining) {
-        if (!m_dev->writeSectors(m_fatStart + fat_sector, large_buffer, sectors_remaining)) {
-           return false;
-        }
-        fat_sector += sectors_remaining;
+      fat_sector += chunk;
+      sectors_remaining -= chunk;
+      if (++loop_count == loops_per_dot) {
+        writeMsg(".");
+        loop_count = 0;
+      }
+    }
+    if (sectors_remaining) {
+      if (!m_dev->writeSectors(m_fatStart + fat_sector, large_buffer, sectors_remaining)) {
+         free(large_buffer);
+         return false;
       }
-      free(large_buffer);
+      fat_sector += sectors_remaining;
     }
+    free(large_buffer);
   }
   if (fat_sector < sectorCount) {
     memset(m_secBuf, 0, BYTES_PER_SECTOR);
@@ -47,8 +47,20 @@ class PFsFatFormatter {
   bool format(PFsVolume &partVol, uint8_t fat_type, uint8_t* secBuf, print_t* pr);
   bool createFatPartition(BlockDevice* dev, uint8_t fat_type, uint32_t startSector, uint32_t sectorCount, uint8_t* secBuf, print_t* pr);
   void dump_hexbytes(const void *ptr, int len);
+  /**
+   * Align clusters to drive blocks. Clusters are made at least this
+   * large and the data area is padded to start on a multiple of it.
+   * format() also aligns to the block size of the USB drive it is on,
+   * and to its flash geometry if USBMSCDevice::profileDrive() was run.
+   *
+   * \param[in] sectors Alignment in 512 byte sectors, a power of two.
+   *            8 for 4Kn drives, 1 for no alignment.
+   */
+  void setClusterAlign(uint8_t sectors) {m_clusterAlign = sectors;}
 
  private:
+  uint32_t layoutFat(uint16_t reserved, uint32_t rootSectors,
+                     uint32_t entriesPerSector, uint32_t align);
   bool initFatDir(uint8_t fatType, uint32_t sectorCount);
   void initPbs();
   bool makeFat16();
@@ -71,6 +83,10 @@ class PFsFatFormatter {
   uint8_t m_partType;
   uint8_t m_sectorsPerCluster;
   uint8_t m_part;
+  uint8_t m_clusterAlign = 1;
+  uint8_t m_align;
+  uint32_t m_dataAlign;
+  uint32_t m_writeSectors;
   uint32_t m_part_relativeSectors;
   char volName[32];
 };
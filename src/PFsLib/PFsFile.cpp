@@ -27,6 +27,7 @@
 PFsBaseFile::PFsBaseFile(const PFsBaseFile& from) {
   m_fFile = nullptr;
   m_xFile = nullptr;
+  m_vol = from.m_vol;
   if (from.m_fFile) {
     m_fFile = new (m_fileMem) FatFile;
     *m_fFile = *from.m_fFile;
@@ -39,6 +40,7 @@ PFsBaseFile::PFsBaseFile(const PFsBaseFile& from) {
 PFsBaseFile& PFsBaseFile::operator=(const PFsBaseFile& from) {
   if (this == &from) return *this;
   close();
+  m_vol = from.m_vol;
   if (from.m_fFile) {
     m_fFile = new (m_fileMem) FatFile;
     *m_fFile = *from.m_fFile;
@@ -50,6 +52,7 @@ PFsBaseFile& PFsBaseFile::operator=(const PFsBaseFile& from) {
 }
 //------------------------------------------------------------------------------
 bool PFsBaseFile::close() {
+  m_raBuf = nullptr;
   if (m_fFile && m_fFile->close()) {
     m_fFile = nullptr;
     return true;
@@ -63,20 +66,27 @@ bool PFsBaseFile::close() {
 //------------------------------------------------------------------------------
 bool PFsBaseFile::mkdir(PFsBaseFile* dir, const char* path, bool pFlag) {
   close();
+  m_vol = dir->m_vol;
   if (dir->m_fFile) {
     m_fFile = new (m_fileMem) FatFile;
     if (m_fFile->mkdir(dir->m_fFile, path, pFlag)) {
-      return true;
+      goto done;
     }
     m_fFile = nullptr;
   } else if (dir->m_xFile) {
     m_xFile = new (m_fileMem) ExFatFile;
     if (m_xFile->mkdir(dir->m_xFile, path, pFlag)) {
-      return true;
+      goto done;
     }
     m_xFile = nullptr;
   }
   return false;
+
+ done:
+  if (m_vol) {
+    m_vol->dirIndexDrop(dir, path);
+  }
+  return true;
 }
 //------------------------------------------------------------------------------
 bool PFsBaseFile::open(PFsVolume* vol, const char* path, oflag_t oflag) {
@@ -84,24 +94,47 @@ bool PFsBaseFile::open(PFsVolume* vol, const char* path, oflag_t oflag) {
     return false;
   }
   close();
+  m_vol = vol;
+  if (vol->useLookup(path)) {
+    PFsBaseFile root;
+    return root.openRoot(vol) && vol->lookupOpen(&root, path, oflag, this);
+  }
   if (vol->m_fVol) {
     m_fFile = new (m_fileMem) FatFile;
     if (m_fFile && m_fFile->open(vol->m_fVol, path, oflag)) {
-      return true;
+      goto done;
     }
     m_fFile = nullptr;
   } else if (vol->m_xVol) {
     m_xFile = new (m_fileMem) ExFatFile;
     if (m_xFile && m_xFile->open(vol->m_xVol, path, oflag)) {
-      return true;
+      goto done;
     }
     m_xFile = nullptr;
   }
   return false;
+
+ done:
+  // A name created here, relative to a working directory other than the
+  // root, is missing from that directory's index.
+  if ((oflag & O_CREAT) && vol->lookupEnabled()) {
+    vol->m_dirIndex.clear();
+  }
+  return true;
 }
 //------------------------------------------------------------------------------
 bool PFsBaseFile::open(PFsBaseFile* dir, const char* path, oflag_t oflag) {
+  if (dir->m_vol && dir->m_vol->lookupEnabled()) {
+    return dir->m_vol->lookupOpen(dir, path, oflag, this);
+  }
+  return openScan(dir, path, oflag);
+}
+//------------------------------------------------------------------------------
+// Open by searching the directory, without the volume's dentry cache and
+// directory index.
+bool PFsBaseFile::openScan(PFsBaseFile* dir, const char* path, oflag_t oflag) {
   close();
+  m_vol = dir->m_vol;
   if (dir->m_fFile) {
     m_fFile = new (m_fileMem) FatFile;
     if (m_fFile->open(dir->m_fFile, path, oflag)) {
@@ -118,8 +151,17 @@ bool PFsBaseFile::open(PFsBaseFile* dir, const char* path, oflag_t oflag) {
   return false;
 }
 //------------------------------------------------------------------------------
+int PFsBaseFile::readDir(PFsDirEnt_t* ents, size_t count) {
+  return m_vol ? m_vol->readDir(this, ents, count) : -1;
+}
+//------------------------------------------------------------------------------
+bool PFsBaseFile::findName(const char* name, uint32_t* index) {
+  return m_vol && isDir() && m_vol->findName(this, name, index);
+}
+//------------------------------------------------------------------------------
 bool PFsBaseFile::open(PFsBaseFile* dir, uint32_t index, oflag_t oflag) {
   close();
+  m_vol = dir->m_vol;
   if (dir->m_fFile) {
     m_fFile = new (m_fileMem) FatFile;
     if (m_fFile->open(dir->m_fFile, index, oflag)) {
@@ -138,6 +180,7 @@ bool PFsBaseFile::open(PFsBaseFile* dir, uint32_t index, oflag_t oflag) {
 //------------------------------------------------------------------------------
 bool PFsBaseFile::openNext(PFsBaseFile* dir, oflag_t oflag) {
   close();
+  m_vol = dir->m_vol;
   if (dir->m_fFile) {
     m_fFile = new (m_fileMem) FatFile;
     if (m_fFile->openNext(dir->m_fFile, oflag)) {
@@ -159,6 +202,7 @@ bool PFsBaseFile::openRoot(PFsVolume* vol) {
     return false;
   }
   close();
+  m_vol = vol;
   if (vol->m_fVol) {
     m_fFile = new (m_fileMem) FatFile;
     if (m_fFile && m_fFile->openRoot(vol->m_fVol)) {
@@ -190,7 +234,50 @@ bool PFsBaseFile::remove() {
   return false;
 }
 //------------------------------------------------------------------------------
+bool PFsBaseFile::rename(const char* newPath) {
+  PFsBaseFile root;
+  PFsBaseFile parent;
+  char name[256];
+  size_t len;
+
+  if (m_vol && m_vol->useLookup(newPath)) {
+    // Find the new parent directory through the dentry cache and index.
+    if (!root.openRoot(m_vol) ||
+        !m_vol->walk(&root, &newPath, &len, &parent) ||
+        len == 0 || len >= sizeof(name)) {
+      return false;
+    }
+    memcpy(name, newPath, len);
+    name[len] = 0;
+    return rename(&parent, name);
+  }
+  if (m_vol) {
+    m_vol->m_dentries.clear();
+    m_vol->m_dirIndex.clear();
+  }
+  return m_fFile ? m_fFile->rename(newPath) :
+         m_xFile ? m_xFile->rename(newPath) : false;
+}
+//------------------------------------------------------------------------------
+bool PFsBaseFile::rename(PFsBaseFile* dirFile, const char* newPath) {
+  bool rtn = m_fFile ? m_fFile->rename(dirFile->m_fFile, newPath) :
+             m_xFile ? m_xFile->rename(dirFile->m_xFile, newPath) : false;
+  if (rtn && m_vol) {
+    // Paths through the old name would fail their name check, forget
+    // them now instead.
+    m_vol->m_dentries.clear();
+    m_vol->dirIndexDrop(dirFile, newPath);
+  }
+  return rtn;
+}
+//------------------------------------------------------------------------------
 bool PFsBaseFile::rmdir() {
+  // Clusters of a removed directory may become a new directory with the
+  // same key, so forget its index first.
+  if (m_vol && isDir()) {
+    m_vol->m_dentries.clear();
+    m_vol->dirIndexDrop(this);
+  }
   if (m_fFile) {
     if (m_fFile->rmdir()) {
       m_fFile = nullptr;
@@ -204,3 +291,231 @@ bool PFsBaseFile::rmdir() {
   }
   return false;
 }
+//------------------------------------------------------------------------------
+bool PFsBaseFile::setReadAhead(uint8_t* buf, size_t size) {
+  m_raBuf = nullptr;
+  m_raLen = 0;
+  if (!buf) {
+    return true;
+  }
+  size &= ~(size_t)511;
+  if (!isFile() || isWritable() || !m_vol || size < 1024) {
+    return false;
+  }
+  m_raBuf = buf;
+  m_raSize = size;
+  m_raNext = curPosition();
+  return true;
+}
+//------------------------------------------------------------------------------
+// Map the sector aligned position start to a sector. On return end is
+// reduced to the end of the run of consecutive clusters holding start and
+// cluster is the cluster holding start.
+bool PFsBaseFile::sectorRun(uint64_t start, uint64_t* end, uint32_t* sector,
+                            uint32_t* cluster) {
+  fspos_t fpos;
+  uint32_t bpc = m_vol->bytesPerCluster();
+  uint64_t runEnd = (start | (bpc - 1)) + 1;
+  uint32_t last;
+
+  // The current cluster is the one holding the byte before the position.
+  if (!seekSet(start + 1)) {
+    return false;
+  }
+  fgetpos(&fpos);
+  *cluster = last = fpos.cluster;
+  *sector = m_vol->clusterStartSector(last) +
+            (uint32_t)((start & (bpc - 1)) >> 9);
+  while (runEnd < *end) {
+    if (!seekSet(runEnd + 1)) {
+      return false;
+    }
+    fgetpos(&fpos);
+    if (fpos.cluster != (last + 1)) {
+      break;
+    }
+    last++;
+    runEnd += bpc;
+  }
+  if (*end > runEnd) {
+    *end = runEnd;
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+// Fill the window starting at the sector holding pos. The window ends at
+// EOF, the buffer size or the first break in the cluster chain.
+bool PFsBaseFile::fillReadAhead(uint64_t pos) {
+  uint64_t start = pos & ~(uint64_t)511;
+  uint64_t end = fileSize();
+  uint32_t sector;
+
+  m_raLen = 0;
+  if (end > (start + m_raSize)) {
+    end = start + m_raSize;
+  }
+  // Raw reads bypass the volume's media fence, check it here. They also
+  // go past the volume cache, which may hold a dirty sector written
+  // through another open file.
+  if (m_vol->mediaChanged() || !m_vol->cacheClear() ||
+      !sectorRun(start, &end, &sector, &m_raCluster) ||
+      !m_vol->blockDevice()->readSectors(sector, m_raBuf,
+                                         (uint32_t)((end - start + 511) >> 9))) {
+    return false;
+  }
+  m_raPos = start;
+  m_raLen = end - start;
+  return true;
+}
+//------------------------------------------------------------------------------
+// Set the file position. Clusters in the window are consecutive so the
+// current cluster can be computed instead of following the FAT chain.
+bool PFsBaseFile::seekReadAhead(uint64_t pos) {
+  if (pos > m_raPos && pos <= (m_raPos + m_raLen)) {
+    uint32_t bpc = m_vol->bytesPerCluster();
+    fspos_t fpos;
+    fpos.position = pos;
+    fpos.cluster = m_raCluster +
+                   (uint32_t)(((pos - 1) - (m_raPos & ~(uint64_t)(bpc - 1)))/bpc);
+    fsetpos(&fpos);
+    return true;
+  }
+  return seekSet(pos);
+}
+//------------------------------------------------------------------------------
+int PFsBaseFile::readAhead(void* buf, size_t count) {
+  uint8_t* dst = reinterpret_cast<uint8_t*>(buf);
+  uint64_t pos = curPosition();
+  uint64_t avail = available64();
+  size_t done = 0;
+  int n;
+
+  if (count > avail) {
+    count = avail;
+  }
+  while (done < count) {
+    if (pos >= m_raPos && pos < (m_raPos + m_raLen)) {
+      size_t k = m_raPos + m_raLen - pos;
+      if (k > (count - done)) {
+        k = count - done;
+      }
+      memcpy(dst + done, m_raBuf + (size_t)(pos - m_raPos), k);
+      done += k;
+      pos += k;
+      m_raNext = pos;
+      continue;
+    }
+    // Prefetch only for sequential access. Random reads use the file's
+    // sector cache and large reads use multi-sector transfers.
+    if (pos != m_raNext || (count - done) >= m_raSize || !fillReadAhead(pos)) {
+      if (!seekReadAhead(pos)) {
+        return -1;
+      }
+      n = m_fFile ? m_fFile->read(dst + done, count - done) :
+                    m_xFile->read(dst + done, count - done);
+      if (n < 0) {
+        return -1;
+      }
+      done += n;
+      m_raNext = pos + n;
+      return done;
+    }
+  }
+  if (!seekReadAhead(pos)) {
+    return -1;
+  }
+  m_raNext = pos;
+  return done;
+}
+//------------------------------------------------------------------------------
+// State for readWithCB(), passed to the per sector callback as its token.
+typedef struct {
+  PFsReadCallback_t callback;
+  uintptr_t token;
+  uint32_t skip;
+  uint64_t remain;
+} pfsReadCB_t;
+
+static void _readWithCBSector(uintptr_t token, uint8_t* data) {
+  pfsReadCB_t* rcb = (pfsReadCB_t*)token;
+  size_t n = 512 - rcb->skip;
+  if (n > rcb->remain) {
+    n = rcb->remain;
+  }
+  if (n) {
+    rcb->callback(rcb->token, data + rcb->skip, n);
+  }
+  rcb->skip = 0;
+  rcb->remain -= n;
+}
+//------------------------------------------------------------------------------
+ssize_t PFsBaseFile::readWithCB(size_t count, PFsReadCallback_t callback,
+                                uintptr_t token) {
+  uint8_t buf[512];
+  pfsReadCB_t rcb;
+  fspos_t fpos;
+  uint64_t pos = curPosition();
+  uint64_t end;
+  uint64_t runEnd;
+  uint32_t bpc;
+  uint32_t sector;
+  uint32_t cluster;
+  uint32_t ns;
+  USBMSCDevice* dev;
+
+  if (!isFile() || !m_vol || !callback) {
+    return -1;
+  }
+  if (count > available64()) {
+    count = available64();
+  }
+  if (count > ((size_t)-1 >> 1)) {
+    count = (size_t)-1 >> 1;
+  }
+  // Sectors are read from the drive, past the volume cache. A partial
+  // sector written through this or another open file may still be there.
+  if (!m_vol->cacheClear()) {
+    return -1;
+  }
+  bpc = m_vol->bytesPerCluster();
+  dev = m_vol->usbDevice();
+  if ((BlockDevice*)dev != m_vol->blockDevice()) {
+    // Mounted through a cache or other wrapper, bounce through buf.
+    dev = nullptr;
+  }
+  rcb.callback = callback;
+  rcb.token = token;
+  end = pos + count;
+  while (pos < end) {
+    uint64_t start = pos & ~(uint64_t)511;
+    // msReadSectorsWithCB() takes a 16-bit sector count.
+    runEnd = end < (start + 0XFFFFUL*512) ? end : start + 0XFFFFUL*512;
+    if (m_vol->mediaChanged() ||
+        !sectorRun(start, &runEnd, &sector, &cluster)) {
+      return -1;
+    }
+    ns = (uint32_t)((runEnd - start + 511) >> 9);
+    rcb.skip = pos - start;
+    rcb.remain = runEnd - pos;
+    if (dev) {
+      if (!dev->readSectorsWithCallback(sector, ns, _readWithCBSector,
+                                        (uintptr_t)&rcb)) {
+        return -1;
+      }
+    } else {
+      for (uint32_t i = 0; i < ns; i++) {
+        if (!m_vol->blockDevice()->readSector(sector + i, buf)) {
+          return -1;
+        }
+        _readWithCBSector((uintptr_t)&rcb, buf);
+      }
+    }
+    // Leave the file positioned after the run without walking the chain.
+    fpos.position = runEnd;
+    fpos.cluster = cluster +
+                   (uint32_t)(((runEnd - 1) - (start & ~(uint64_t)(bpc - 1)))/bpc);
+    fsetpos(&fpos);
+    pos = runEnd;
+  }
+  return count;
+}
@@ -28,9 +28,57 @@
  * \file
  * \brief PFsBaseFile include file.
  */
+#include <sys/types.h>
 #include "PFsNew.h"
 #include "FatLib/FatLib.h"
 #include "ExFatLib/ExFatLib.h"
+/** Callback for PFsBaseFile::readWithCB().
+ * \param[in] token Value passed to readWithCB().
+ * \param[in] data File data, only valid during the call.
+ * \param[in] count Number of bytes at data, at most 512.
+ */
+typedef void (*PFsReadCallback_t)(uintptr_t token, const uint8_t* data,
+                                  size_t count);
+
+/** Size of the name in a PFsDirEnt_t, in bytes with the terminating zero. */
+#ifndef PFS_DIRENT_NAME_SIZE
+#define PFS_DIRENT_NAME_SIZE 256
+#endif
+/** PFsDirEnt_t attributes bit for a read only file. */
+const uint8_t PFS_ATTRIB_READ_ONLY = 0X01;
+/** PFsDirEnt_t attributes bit for a hidden file. */
+const uint8_t PFS_ATTRIB_HIDDEN = 0X02;
+/** PFsDirEnt_t attributes bit for a system file. */
+const uint8_t PFS_ATTRIB_SYSTEM = 0X04;
+/** PFsDirEnt_t attributes bit for a directory. */
+const uint8_t PFS_ATTRIB_DIRECTORY = 0X10;
+/** PFsDirEnt_t attributes bit for a file changed since its last backup. */
+const uint8_t PFS_ATTRIB_ARCHIVE = 0X20;
+/** PFsDirEnt_t flags bit for a name cut short to fit. */
+const uint8_t PFS_DIRENT_TRUNCATED = 0X01;
+/** One directory entry from PFsBaseFile::readDir(). */
+typedef struct {
+  /** File size in bytes, zero for FAT directories. */
+  uint64_t size;
+  /** First cluster of the file, zero for an empty file. */
+  uint32_t firstCluster;
+  /** Entry index, for PFsBaseFile::open(dir, index, oflag). */
+  uint32_t index;
+  /** Creation date in FAT format. */
+  uint16_t createDate;
+  /** Creation time in FAT format. */
+  uint16_t createTime;
+  /** Modification date in FAT format. */
+  uint16_t modifyDate;
+  /** Modification time in FAT format. */
+  uint16_t modifyTime;
+  /** PFS_ATTRIB_ bits. */
+  uint8_t attributes;
+  /** PFS_DIRENT_TRUNCATED if the name did not fit. */
+  uint8_t flags;
+  /** Name in UTF-8, zero terminated. */
+  char name[PFS_DIRENT_NAME_SIZE];
+} PFsDirEnt_t;
 /**
  * \class PFsBaseFile
  * \brief PFsBaseFile class.
@@ -127,9 +175,20 @@ class PFsBaseFile {
    * \return true if the file exists else false.
    */
   bool exists(const char* path) {
-    return m_fFile ? m_fFile->exists(path) :
-           m_xFile ? m_xFile->exists(path) : false;
+    PFsBaseFile file;
+    return file.open(this, path, O_RDONLY);
   }
+  /** Search this directory for a name without opening each file.
+   *
+   * On exFAT the name length and hash in each stream entry are compared
+   * first, so the name entries of other files are never read.
+   *
+   * \param[in] name Name of a file or subdirectory, not a path.
+   * \param[out] index Entry index of the name, for open(dir, index, oflag).
+   *
+   * \return true if the name was found.
+   */
+  bool findName(const char* name, uint32_t* index);
   /** get position for streams
    * \param[out] pos struct to receive position
    */
@@ -584,9 +643,44 @@ class PFsBaseFile {
    * or an I/O error occurred.
    */
   int read(void* buf, size_t count) {
-    return m_fFile ? m_fFile->read(buf, count) :
+    return m_raBuf ? readAhead(buf, count) :
+           m_fFile ? m_fFile->read(buf, count) :
            m_xFile ? m_xFile->read(buf, count) : -1;
   }
+  /** Read data from a file starting at the current position without
+   * copying it to a user buffer.
+   *
+   * Each run of consecutive clusters is read with one
+   * USBMSCDevice::readSectorsWithCallback() transfer and the data is passed to
+   * \a callback straight from the USB transfer buffer. On volumes not
+   * mounted directly on a USBMSCDevice sectors are read one at a time.
+   * The volume cache is written and cleared first, so data written
+   * through any open file and not yet synced is seen.
+   *
+   * \param[in] count Maximum number of bytes to read.
+   * \param[in] callback Called with each piece of data, in file order.
+   * \param[in] token Value passed to callback, may hold a pointer.
+   *
+   * \return The number of bytes read, less than \a count at EOF,
+   * or -1 if an error occurs.
+   */
+  ssize_t readWithCB(size_t count, PFsReadCallback_t callback,
+                     uintptr_t token);
+  /** Read the next entries of a directory into an array of records.
+   *
+   * Entries are decoded straight from the directory's sectors, so no
+   * file is opened and nothing is allocated. Reading continues from the
+   * directory's position, like openNext(), and rewind() starts over.
+   * Deleted entries, the volume label and the "." and ".." entries are
+   * skipped.
+   *
+   * \param[out] ents Records to fill.
+   * \param[in] count Number of records in \a ents.
+   *
+   * \return The number of records filled, zero at the end of the
+   * directory, or -1 if this is not an open directory or an error occurs.
+   */
+  int readDir(PFsDirEnt_t* ents, size_t count);
   /** Remove a file.
    *
    * The directory entry and all data for the file are deleted.
@@ -613,8 +707,8 @@ class PFsBaseFile {
    * \return true for success or false for failure.
    */
   bool remove(const char* path) {
-    return m_fFile ? m_fFile->remove(path) :
-           m_xFile ? m_xFile->remove(path) : false;
+    PFsBaseFile file;
+    return file.open(this, path, O_WRONLY) && file.remove();
   }
   /** Rename a file or subdirectory.
    *
@@ -622,10 +716,7 @@ class PFsBaseFile {
    *
    * \return true for success or false for failure.
    */
-  bool rename(const char* newPath) {
-    return m_fFile ? m_fFile->rename(newPath) :
-           m_xFile ? m_xFile->rename(newPath) : false;
-  }
+  bool rename(const char* newPath);
   /** Rename a file or subdirectory.
    *
    * \param[in] dirFile Directory for the new path.
@@ -633,10 +724,7 @@ class PFsBaseFile {
    *
    * \return true for success or false for failure.
    */
-  bool rename(PFsBaseFile* dirFile, const char* newPath) {
-    return m_fFile ? m_fFile->rename(dirFile->m_fFile, newPath) :
-           m_xFile ? m_xFile->rename(dirFile->m_xFile, newPath) : false;
-  }
+  bool rename(PFsBaseFile* dirFile, const char* newPath);
   /** Set the file's current position to zero. */
   void rewind() {
     if (m_fFile) m_fFile->rewind();
@@ -691,6 +779,22 @@ class PFsBaseFile {
     return m_fFile ? pos < (1ULL << 32) && m_fFile->seekSet(pos) :
            m_xFile ? m_xFile->seekSet(pos) : false;
   }
+  /** Enable read-ahead for a file opened read only.
+   *
+   * Sequential reads smaller than the buffer are served from a window
+   * that is filled with one readSectors() call covering the next run of
+   * consecutive clusters. Random reads and reads at least as large as
+   * the buffer go to the file as usual. The file must not be written
+   * through another file object while read-ahead is enabled.
+   *
+   * The setting is cleared by close() and is not copied.
+   *
+   * \param[in] buf Buffer for the window, nullptr disables read-ahead.
+   * \param[in] size Size of buf, rounded down to a multiple of 512.
+   *            At least two sectors, 8 to 64 sectors work well.
+   * \return true for success or false for failure.
+   */
+  bool setReadAhead(uint8_t* buf, size_t size);
   /** \return the file's size. */
   uint64_t size() const {return fileSize();}
   /** The sync() call causes all modified data and directory fields
@@ -788,9 +892,26 @@ class PFsBaseFile {
   }
 
  private:
+  /** PFsVolume allowed access to private members. */
+  friend class PFsVolume;
+  bool fillReadAhead(uint64_t pos);
+  bool openScan(PFsBaseFile* dir, const char* path, oflag_t oflag);
+  int readAhead(void* buf, size_t count);
+  bool sectorRun(uint64_t start, uint64_t* end, uint32_t* sector,
+                 uint32_t* cluster);
+  bool seekReadAhead(uint64_t pos);
+
   newalign_t m_fileMem[FS_ALIGN_DIM(ExFatFile, FatFile)];
   FatFile*   m_fFile = nullptr;
   ExFatFile* m_xFile = nullptr;
+  PFsVolume* m_vol = nullptr;
+  // Read-ahead window, m_raCluster holds the byte at m_raPos.
+  uint8_t*   m_raBuf = nullptr;
+  uint32_t   m_raSize = 0;
+  uint32_t   m_raLen = 0;
+  uint32_t   m_raCluster = 0;
+  uint64_t   m_raPos = 0;
+  uint64_t   m_raNext = 0;
 };
 /**
  * \class PFsFile
@@ -0,0 +1,130 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <string.h>
+#include "PFsFreeCount.h"
+//------------------------------------------------------------------------------
+static inline uint32_t popcount32(uint32_t v) {
+#if defined(__GNUC__) && (defined(__POPCNT__) || defined(__aarch64__))
+  return __builtin_popcount(v);
+#else  // defined(__GNUC__) && (defined(__POPCNT__) || defined(__aarch64__))
+  // Cortex-M has no popcount instruction, libgcc's version is a loop.
+  v = v - ((v >> 1) & 0X55555555);
+  v = (v & 0X33333333) + ((v >> 2) & 0X33333333);
+  return (((v + (v >> 4)) & 0X0F0F0F0F)*0X01010101) >> 24;
+#endif  // defined(__GNUC__) && (defined(__POPCNT__) || defined(__aarch64__))
+}
+//------------------------------------------------------------------------------
+uint32_t pfsFreeFat16(const uint16_t* fat, size_t n) {
+  uint32_t free = 0;
+  if (n && (reinterpret_cast<uintptr_t>(fat) & 2)) {
+    free += *fat++ == 0;
+    n--;
+  }
+  // Two entries per word. For each half, adding 0X7FFF to the low
+  // fifteen bits carries into bit fifteen unless they are zero, so after
+  // or-ing in the word bit fifteen is clear only for a zero entry.
+  while (n >= 2) {
+    // Each half of acc counts at most 0XFFFF entries.
+    size_t k = n/2 < 0X8000 ? n/2 : 0X8000 - 1;
+    uint32_t acc = 0;
+    n -= 2*k;
+    while (k--) {
+      uint32_t w;
+      memcpy(&w, fat, 4);
+      fat += 2;
+      uint32_t y = ((w & 0X7FFF7FFF) + 0X7FFF7FFF) | w;
+      acc += (~y & 0X80008000) >> 15;
+    }
+    free += (acc & 0XFFFF) + (acc >> 16);
+  }
+  if (n) {
+    free += *fat == 0;
+  }
+  return free;
+}
+//------------------------------------------------------------------------------
+uint32_t pfsFreeFat32(const uint32_t* fat, size_t n) {
+  uint32_t free = 0;
+  // Branch free and unrolled, the loop is load bound.
+  while (n >= 4) {
+    free += ((fat[0] & 0X0FFFFFFF) == 0) + ((fat[1] & 0X0FFFFFFF) == 0) +
+            ((fat[2] & 0X0FFFFFFF) == 0) + ((fat[3] & 0X0FFFFFFF) == 0);
+    fat += 4;
+    n -= 4;
+  }
+  while (n--) {
+    free += (*fat++ & 0X0FFFFFFF) == 0;
+  }
+  return free;
+}
+//------------------------------------------------------------------------------
+uint32_t pfsFreeBitmap(const uint8_t* bitmap, size_t n) {
+  uint32_t used = 0;
+  size_t bits = n;
+  while (n >= 32) {
+    uint32_t w;
+    memcpy(&w, bitmap, 4);
+    bitmap += 4;
+    n -= 32;
+    // Runs of full or empty words are the usual case.
+    if (w == 0XFFFFFFFF) {
+      used += 32;
+    } else if (w) {
+      used += popcount32(w);
+    }
+  }
+  while (n >= 8) {
+    used += popcount32(*bitmap++);
+    n -= 8;
+  }
+  if (n) {
+    used += popcount32(*bitmap & ((1 << n) - 1));
+  }
+  return bits - used;
+}
+//------------------------------------------------------------------------------
+uint32_t pfsFreeFat16Scalar(const uint16_t* fat, size_t n) {
+  uint32_t free = 0;
+  while (n--) {
+    if (*fat++ == 0) free++;
+  }
+  return free;
+}
+//------------------------------------------------------------------------------
+uint32_t pfsFreeFat32Scalar(const uint32_t* fat, size_t n) {
+  uint32_t free = 0;
+  while (n--) {
+    if ((*fat++ & 0X0FFFFFFF) == 0) free++;
+  }
+  return free;
+}
+//------------------------------------------------------------------------------
+uint32_t pfsFreeBitmapScalar(const uint8_t* bitmap, size_t n) {
+  uint32_t free = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!(bitmap[i >> 3] & (1 << (i & 7)))) free++;
+  }
+  return free;
+}
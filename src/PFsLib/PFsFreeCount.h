@@ -0,0 +1,65 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PFsFreeCount_h
+#define PFsFreeCount_h
+/**
+ * \file
+ * \brief Free cluster counting kernels.
+ *
+ * These count free entries in a run of FAT16 or FAT32 entries or in
+ * an exFAT allocation bitmap. They only depend on the C library so
+ * they can be built and timed on a host, see extras/FreeCountBench.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+/** Count zero entries in a FAT16.
+ * \param[in] fat Entries, two byte aligned.
+ * \param[in] n Number of entries.
+ * \return Number of free entries.
+ */
+uint32_t pfsFreeFat16(const uint16_t* fat, size_t n);
+/** Count free entries in a FAT32. The upper four bits are ignored.
+ * \param[in] fat Entries, four byte aligned.
+ * \param[in] n Number of entries.
+ * \return Number of free entries.
+ */
+uint32_t pfsFreeFat32(const uint32_t* fat, size_t n);
+/** Count clear bits in an exFAT allocation bitmap.
+ * \param[in] bitmap Bitmap, bit zero of byte zero is the first cluster.
+ * \param[in] n Number of bits to check.
+ * \return Number of free clusters.
+ */
+uint32_t pfsFreeBitmap(const uint8_t* bitmap, size_t n);
+
+// Entry at a time versions, kept for reference and benchmarking.
+/** \copydoc pfsFreeFat16 */
+uint32_t pfsFreeFat16Scalar(const uint16_t* fat, size_t n);
+/** \copydoc pfsFreeFat32 */
+uint32_t pfsFreeFat32Scalar(const uint32_t* fat, size_t n);
+/** \copydoc pfsFreeBitmap */
+uint32_t pfsFreeBitmapScalar(const uint8_t* bitmap, size_t n);
+#endif  // PFsFreeCount_h
@@ -30,6 +30,7 @@
  */
 #include "PFsVolume.h"
 #include "PFsFile.h"
+#include "PFsStreamWriter.h"
 #include "PFsFatFormatter.h"
 #include "PFsExFatFormatter.h"
 
@@ -43,6 +44,13 @@ class PFsLib : public PFsFatFormatter, public PFsExFatFormatter
 	void print_partion_info(PFsVolume &partVol, Stream &Serialx);
 	uint32_t mbrDmp(BlockDeviceInterface *blockDev, uint32_t device_sector_count, Stream &Serialx);
 	void compare_dump_hexbytes(const void *ptr, const uint8_t *compare_buf, int len);
+	/** Align clusters of FAT and exFAT volumes to drive blocks.
+	 * \param[in] sectors Alignment in 512 byte sectors, 8 for 4Kn drives.
+	 */
+	void setClusterAlign(uint8_t sectors) {
+		PFsFatFormatter::setClusterAlign(sectors);
+		PFsExFatFormatter::setClusterAlign(sectors);
+	}
 
  private:
 	BlockDevice* m_dev;
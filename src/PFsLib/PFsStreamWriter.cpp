@@ -0,0 +1,351 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "PFsLib.h"
+//------------------------------------------------------------------------------
+// exFAT entry set checksum, bytes 2 and 3 of the file entry are skipped.
+static uint16_t exFatDirChecksum(const uint8_t* data, uint16_t checksum) {
+  bool skip = data[0] == EXFAT_TYPE_FILE;
+  for (size_t i = 0; i < 32; i += (i == 1 && skip ? 3 : 1)) {
+    checksum = ((checksum << 15) | (checksum >> 1)) + data[i];
+  }
+  return checksum;
+}
+//------------------------------------------------------------------------------
+bool PFsStreamWriter::begin(PFsVolume* vol, const char* path,
+                            uint64_t maxLength, uint8_t* buf, size_t bufSize,
+                            uint8_t bufCount) {
+  char dirPath[256];
+  const char* name;
+  uint32_t spc;
+  uint32_t bgnSector;
+  uint32_t endSector;
+
+  close();
+  if (!vol || !path || !buf || bufCount < 2 || maxLength == 0) {
+    return false;
+  }
+  spc = vol->sectorsPerCluster();
+  m_segSectors = (bufSize/bufCount) >> 9;
+  if (m_segSectors >= spc) {
+    m_segSectors -= m_segSectors % spc;
+  } else {
+    while (m_segSectors & (m_segSectors - 1)) {
+      m_segSectors &= m_segSectors - 1;
+    }
+  }
+  if (m_segSectors == 0) {
+    return false;
+  }
+  // Keep the parent directory open, close() needs it to patch exFAT entries.
+  name = strrchr(path, '/');
+  if (name && name != path) {
+    PFsFile root;
+    size_t len = name - path;
+    if (len >= sizeof(dirPath) || !root.openRoot(vol)) {
+      return false;
+    }
+    memcpy(dirPath, path, len);
+    dirPath[len] = 0;
+    if (!m_dir.open(&root, dirPath, O_RDONLY)) {
+      return false;
+    }
+  } else if (!m_dir.openRoot(vol)) {
+    return false;
+  }
+  name = name ? name + 1 : path;
+  if (!m_file.open(&m_dir, name, O_RDWR | O_CREAT | O_TRUNC)) {
+    goto fail;
+  }
+  if (!(fatPreAllocate(vol, maxLength, buf) ||
+        m_file.preAllocate(maxLength)) ||
+      !m_file.contiguousRange(&bgnSector, &endSector) ||
+      !m_file.sync()) {
+    m_file.remove();
+    goto fail;
+  }
+  // Data goes around the volume cache, make sure it holds nothing stale.
+  if (!vol->cacheClear()) {
+    goto fail;
+  }
+  m_vol = vol;
+  m_dev = vol->usbDevice();
+  if ((BlockDevice*)m_dev != vol->blockDevice()) {
+    // Mounted through a cache or other wrapper, use its synchronous path.
+    m_dev = nullptr;
+  }
+  m_buf = buf;
+  m_segCount = bufCount;
+  m_maxLength = maxLength;
+  m_position = 0;
+  m_sector = bgnSector;
+  m_endSector = endSector + 1;
+  m_fill = 0;
+  m_cur = 0;
+  m_submitted = 0;
+  m_completed = 0;
+  m_written = 0;
+  m_error = false;
+  return true;
+
+ fail:
+  m_file.close();
+  m_dir.close();
+  return false;
+}
+//------------------------------------------------------------------------------
+// Preallocate a FAT16/FAT32 file from the volume's free space index. The
+// chain is attached by editing the directory entry of the closed file,
+// then the file is opened again. Returns false, with the file still open
+// and empty, if the volume has no index, no run was found or the chain
+// could not be attached.
+bool PFsStreamWriter::fatPreAllocate(PFsVolume* vol, uint64_t length,
+                                     uint8_t* cache) {
+  uint32_t bpc = vol->bytesPerCluster();
+  uint32_t count = (length + bpc - 1)/bpc;
+  uint32_t index = m_file.dirIndex();
+  uint32_t first;
+  uint32_t sector;
+  DirFat_t* dir;
+
+  if (!vol->getFatVol() || vol->mediaChanged() ||
+      length >= (1ULL << 32) ||
+      !m_file.sync() ||
+      !vol->allocContiguous(count, &first)) {
+    return false;
+  }
+  if (!m_file.close() || !vol->cacheClear() ||
+      !vol->dirEntrySector(&m_dir, index, &sector) ||
+      !vol->blockDevice()->readSector(sector, cache)) {
+    goto fail;
+  }
+  dir = reinterpret_cast<DirFat_t*>(cache + ((index << 5) & 511));
+  setLe16(dir->firstClusterHigh, first >> 16);
+  setLe16(dir->firstClusterLow, first & 0XFFFF);
+  setLe32(dir->fileSize, length);
+  if (!vol->blockDevice()->writeSector(sector, cache)) {
+    goto fail;
+  }
+  // The chain belongs to the file from here on.
+  return m_file.open(&m_dir, index, O_RDWR);
+
+ fail:
+  // Give the chain back so the failure does not leak it.
+  vol->freeContiguous(count, first);
+  if (!m_file.isOpen()) {
+    m_file.open(&m_dir, index, O_RDWR);
+  }
+  return false;
+}
+//------------------------------------------------------------------------------
+void PFsStreamWriter::writeDone(uintptr_t token, uint8_t status) {
+  PFsStreamWriter* w = reinterpret_cast<PFsStreamWriter*>(token);
+  if (status != MS_CBW_PASS) {
+    w->m_error = true;
+  } else if ((uint8_t)w->m_written == w->m_completed) {
+    // Segments complete in order, count them up to the first failure.
+    w->m_written++;
+  }
+  w->m_completed++;
+}
+//------------------------------------------------------------------------------
+// Send ns sectors of the current segment to the drive and advance.
+bool PFsStreamWriter::submit(uint32_t ns) {
+  uint8_t* seg = m_buf + m_cur*(m_segSectors << 9);
+  // Segments go straight to the drive, never to media that replaced ours.
+  if ((m_sector + ns) > m_endSector || m_vol->mediaChanged()) {
+    m_error = true;
+    return false;
+  }
+  if (m_dev) {
+    while (!m_dev->asyncReady()) {
+      m_dev->poll();
+    }
+    m_submitted++;
+    if (!m_dev->writeSectorsAsync(m_sector, seg, ns, writeDone,
+                                  reinterpret_cast<uintptr_t>(this))) {
+      m_submitted--;
+      m_error = true;
+      return false;
+    }
+  } else if (!m_vol->blockDevice()->writeSectors(m_sector, seg, ns)) {
+    m_error = true;
+    return false;
+  } else {
+    m_written++;
+  }
+  m_sector += ns;
+  m_fill = 0;
+  m_cur = m_cur + 1 < m_segCount ? m_cur + 1 : 0;
+  return true;
+}
+//------------------------------------------------------------------------------
+// Wait until the current segment is no longer in flight.
+bool PFsStreamWriter::waitSegment() {
+  while (inFlight() >= m_segCount && !m_error) {
+    m_dev->poll();
+  }
+  return !m_error;
+}
+//------------------------------------------------------------------------------
+size_t PFsStreamWriter::write(const void* src, size_t n) {
+  const uint8_t* s = reinterpret_cast<const uint8_t*>(src);
+  uint32_t segBytes = m_segSectors << 9;
+  size_t done = 0;
+
+  if (!m_vol || m_error) {
+    return 0;
+  }
+  while (done < n) {
+    if (m_fill == 0 && !waitSegment()) {
+      break;
+    }
+    size_t k = segBytes - m_fill;
+    if (k > (n - done)) {
+      k = n - done;
+    }
+    if (k > (m_maxLength - m_position)) {
+      k = m_maxLength - m_position;
+    }
+    if (k == 0) {
+      break;
+    }
+    memcpy(m_buf + m_cur*segBytes + m_fill, s + done, k);
+    m_fill += k;
+    m_position += k;
+    done += k;
+    if (m_fill == segBytes && !submit(m_segSectors)) {
+      break;
+    }
+  }
+  return done;
+}
+//------------------------------------------------------------------------------
+void PFsStreamWriter::poll() {
+  if (m_dev && inFlight()) {
+    m_dev->poll();
+  }
+}
+//------------------------------------------------------------------------------
+bool PFsStreamWriter::sync() {
+  while (m_dev && inFlight()) {
+    m_dev->poll();
+  }
+  return !m_error;
+}
+//------------------------------------------------------------------------------
+// Set validLength in the stream entry of the file's directory set and
+// recompute the set checksum. The file must be closed and the volume
+// cache clear so the entries on the drive are current.
+bool PFsStreamWriter::exFatSetValidLength(uint32_t index) {
+  // Segments are idle after sync(), use the first one as a sector buffer.
+  uint8_t* cache = m_buf;
+  uint32_t cacheSector = 0;
+  uint32_t fileSector = 0;
+  uint32_t sector;
+  uint16_t checksum = 0;
+  uint8_t setCount = 1;
+  BlockDevice* dev = m_vol->blockDevice();
+
+  if (m_vol->mediaChanged()) {
+    return false;
+  }
+  for (uint8_t i = 0; i <= setCount; i++) {
+    if (!m_vol->dirEntrySector(&m_dir, index + i, &sector)) {
+      return false;
+    }
+    if (i == 0 || sector != cacheSector) {
+      if (!dev->readSector(sector, cache)) {
+        return false;
+      }
+      cacheSector = sector;
+    }
+    uint8_t* entry = cache + (((index + i) << 5) & 511);
+    if (i == 0) {
+      DirFile_t* dirFile = reinterpret_cast<DirFile_t*>(entry);
+      if (dirFile->type != EXFAT_TYPE_FILE || dirFile->setCount < 2) {
+        return false;
+      }
+      setCount = dirFile->setCount;
+      fileSector = sector;
+    } else if (i == 1) {
+      DirStream_t* dirStream = reinterpret_cast<DirStream_t*>(entry);
+      if (dirStream->type != EXFAT_TYPE_STREAM) {
+        return false;
+      }
+      setLe64(dirStream->validLength, m_position);
+      if (!dev->writeSector(sector, cache)) {
+        return false;
+      }
+    }
+    checksum = exFatDirChecksum(entry, checksum);
+  }
+  if (!dev->readSector(fileSector, cache)) {
+    return false;
+  }
+  DirFile_t* dirFile = reinterpret_cast<DirFile_t*>(cache + ((index << 5) & 511));
+  setLe16(dirFile->setChecksum, checksum);
+  return dev->writeSector(fileSector, cache);
+}
+//------------------------------------------------------------------------------
+bool PFsStreamWriter::close() {
+  bool rtn;
+  uint32_t index;
+
+  if (!m_vol) {
+    return false;
+  }
+  rtn = !m_error;
+  if (rtn && m_fill) {
+    // Zero fill the tail of the last partial sector.
+    uint32_t ns = (m_fill + 511) >> 9;
+    memset(m_buf + m_cur*(m_segSectors << 9) + m_fill, 0, (ns << 9) - m_fill);
+    rtn = submit(ns);
+  }
+  rtn = sync() && rtn;
+  if (!rtn) {
+    // Keep only the data ahead of the first segment that failed, the
+    // last segment may be partial.
+    uint64_t written = (uint64_t)m_written*(m_segSectors << 9);
+    if (written < m_position) {
+      m_position = written;
+    }
+  }
+  if (m_vol->fatType() == FAT_TYPE_EXFAT) {
+    // exFAT will not seek past validLength so set it in the directory
+    // entry, then truncate() releases the unused preallocated clusters.
+    index = m_file.dirIndex();
+    rtn = m_file.close() && rtn;
+    rtn = m_vol->cacheClear() && rtn;
+    rtn = rtn && exFatSetValidLength(index);
+    rtn = m_file.open(&m_dir, index, O_RDWR) && rtn;
+  }
+  rtn = m_file.truncate(m_position) && rtn;
+  rtn = m_file.close() && rtn;
+  m_dir.close();
+  m_vol = nullptr;
+  m_dev = nullptr;
+  return rtn;
+}
@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PFsStreamWriter_h
+#define PFsStreamWriter_h
+/**
+ * \file
+ * \brief PFsStreamWriter include file.
+ */
+#include "PFsVolume.h"
+#include "PFsFile.h"
+
+/**
+ * \class PFsStreamWriter
+ * \brief Sustained rate writer for a preallocated contiguous file.
+ *
+ * The file is created with preAllocate() so its sectors are contiguous.
+ * On a FAT16/FAT32 volume with a free space index, see
+ * PFsVolume::setFreeIndex(), the run comes from allocContiguous() instead.
+ * Data is collected in a caller supplied buffer that is split into two or
+ * more segments. Full segments are written straight to the file's sector
+ * range, bypassing the FatFile byte path and the volume cache. On a USB
+ * drive segments are queued with USBMSCDevice::writeSectorsAsync() so
+ * write() only waits when every segment is still in flight. Call poll()
+ * from idle time to move queued segments to the drive.
+ *
+ * The file size is fixed up by close(). Until then the directory entry
+ * holds the preallocated size (FAT) or a zero valid length (exFAT).
+ *
+ * Paths are resolved from the volume root.
+ */
+class PFsStreamWriter {
+ public:
+  PFsStreamWriter() {}
+  ~PFsStreamWriter() {close();}
+  /** Create a file and prepare it for streaming.
+   *
+   * \param[in] vol Volume for the file.
+   * \param[in] path Path for the file. An existing file is truncated.
+   * \param[in] maxLength Space to preallocate. Writes past this fail.
+   * \param[in] buf Buffer for the segments.
+   * \param[in] bufSize Size of buf in bytes.
+   * \param[in] bufCount Number of segments to split buf into, at least two.
+   *
+   * Each segment is bufSize/bufCount rounded down to a multiple of the
+   * cluster size, or to a power of two sectors if smaller than a cluster.
+   *
+   * \return true for success or false for failure.
+   */
+  bool begin(PFsVolume* vol, const char* path, uint64_t maxLength,
+             uint8_t* buf, size_t bufSize, uint8_t bufCount = 2);
+  /** Write data to the stream.
+   *
+   * \param[in] src Data to be written.
+   * \param[in] n Number of bytes to write.
+   * \return Number of bytes written. Less than n if the preallocated
+   *         space is full or a device write failed.
+   */
+  size_t write(const void* src, size_t n);
+  /** Start the next queued segment write, if any. Call from idle time. */
+  void poll();
+  /** Wait for all full segments to be written.
+   * \return true for success or false for failure.
+   */
+  bool sync();
+  /** Write remaining data, set the file size and close the file. After
+   * a failed write the file ends at the last segment written before it.
+   * \return true for success or false for failure.
+   */
+  bool close();
+  /** \return Number of bytes written to the stream. */
+  uint64_t curPosition() const {return m_position;}
+  /** \return Preallocated space in bytes. */
+  uint64_t maxLength() const {return m_maxLength;}
+  /** \return Size of one segment in bytes. */
+  uint32_t segmentSize() const {return (uint32_t)m_segSectors << 9;}
+  /** \return Number of segments written but not yet on the drive. */
+  uint8_t inFlight() const {return m_submitted - m_completed;}
+  /** \return true if a write has failed. */
+  bool getWriteError() const {return m_error;}
+  /** \return true if the stream is open. */
+  bool isOpen() const {return m_vol != nullptr;}
+
+ private:
+  static void writeDone(uintptr_t token, uint8_t status);
+  bool submit(uint32_t ns);
+  bool waitSegment();
+  bool exFatSetValidLength(uint32_t index);
+  bool fatPreAllocate(PFsVolume* vol, uint64_t length, uint8_t* cache);
+
+  PFsVolume* m_vol = nullptr;
+  USBMSCDevice* m_dev = nullptr;
+  PFsFile m_dir;
+  PFsFile m_file;
+  uint8_t* m_buf = nullptr;
+  uint64_t m_maxLength = 0;
+  uint64_t m_position = 0;
+  uint32_t m_sector = 0;
+  uint32_t m_endSector = 0;
+  uint32_t m_segSectors = 0;
+  uint32_t m_fill = 0;
+  uint8_t m_segCount = 0;
+  uint8_t m_cur = 0;
+  volatile uint8_t m_submitted = 0;
+  volatile uint8_t m_completed = 0;
+  volatile uint32_t m_written = 0;
+  volatile bool m_error = false;
+};
+#endif  // PFsStreamWriter_h
@@ -23,28 +23,103 @@
  * DEALINGS IN THE SOFTWARE.
  */
 #include "PFsLib.h"
+#include "PFsFreeCount.h"
 PFsVolume* PFsVolume::m_cwv = nullptr;
 //------------------------------------------------------------------------------
 bool PFsVolume::begin(USBMSCDevice* dev, bool setCwv, uint8_t part) {
-  m_usmsci = dev;
-  m_blockDev = dev;  
   //Serial.printf("PFsVolume::begin USBmscInterface(%x, %u)\n", (uint32_t)dev, part);  
-  return begin((BlockDevice*)dev, setCwv, part);
+  return begin(dev, dev, setCwv, part);
 }
 
 bool PFsVolume::begin(BlockDevice* blockDev, bool setCwv, uint8_t part) {
   //Serial.printf("PFsVolume::begin(%x, %u)\n", (uint32_t)blockDev, part);
   if ((m_blockDev != blockDev) && (m_blockDev != nullptr)) m_usmsci = nullptr; // 
   m_blockDev = blockDev;
+  // Mount through the tracker so FAT and bitmap writes update the free count.
+  m_tracker.begin(m_blockDev, m_usmsci);
+  return mount(setCwv, part);
+}
+//------------------------------------------------------------------------------
+// A GPT disk has a protective MBR holding one partition of type 0XEE, the
+// GPT header in sector 1 and an array of partition entries, UEFI 2.8 5.3.
+static bool gptStart(BlockDevice* dev, uint8_t part, uint64_t* start) {
+  uint8_t buf[512];
+  MbrSector_t* mbr = reinterpret_cast<MbrSector_t*>(buf);
+  if (part == 0 || !dev->readSector(0, buf) ||
+      getLe16(mbr->signature) != MBR_SIGNATURE || mbr->part[0].type != 0XEE) {
+    return false;
+  }
+  if (!dev->readSector(1, buf) || memcmp(buf, "EFI PART", 8)) {
+    return false;
+  }
+  uint64_t entries = getLe64(buf + 72);
+  uint32_t count = getLe32(buf + 80);
+  uint32_t size = getLe32(buf + 84);
+  if (part > count || size < 128 || size > 512 || (512 % size)) {
+    return false;
+  }
+  uint64_t sector = entries + (uint64_t)(part - 1)*size/512;
+  if (sector > 0XFFFFFFFF || !dev->readSector((uint32_t)sector, buf)) {
+    return false;
+  }
+  // An unused entry has a zero partition type GUID.
+  const uint8_t* entry = buf + (part - 1)*size % 512;
+  for (uint8_t i = 0; i < 16; i++) {
+    if (entry[i]) {
+      *start = getLe64(entry + 32);
+      return *start != 0;
+    }
+  }
+  return false;
+}
+//------------------------------------------------------------------------------
+bool PFsVolume::begin(USBMSCDevice* dev, BlockDevice* front, bool setCwv,
+                      uint8_t part) {
+  uint64_t start;
+  m_usmsci = dev;
+  m_blockDev = front;
+  dev->connect();
+  if (gptStart(front, part, &start)) {
+    // Mounted like beginAt(), sector 0 of the volume is its boot sector.
+    m_tracker.begin(front, dev, start);
+    m_blockDev = &m_tracker;
+    return mount(setCwv, 0);
+  }
+  m_tracker.begin(front, dev);
+  return mount(setCwv, part);
+}
+//------------------------------------------------------------------------------
+bool PFsVolume::beginAt(USBMSCDevice* dev, uint64_t startSector, bool setCwv) {
+  m_usmsci = dev;
+  m_tracker.begin(dev, dev, startSector);
+  // Sector numbers from the volume are relative to startSector, so raw
+  // access through blockDevice() goes through the tracker as well.
+  m_blockDev = startSector ? (BlockDevice*)&m_tracker : (BlockDevice*)dev;
+  return mount(setCwv, 0);
+}
+//------------------------------------------------------------------------------
+bool PFsVolume::mount(bool setCwv, uint8_t part) {
   m_part = part;
+  m_dirIndex.clear();
+  m_dentries.clear();
+  m_vwdRoot = true;
   m_fVol = nullptr;
   m_xVol = new (m_volMem) ExFatVolume;
-  if (m_xVol && m_xVol->begin(m_blockDev, setCwv, part)) {
+  if (m_xVol && m_xVol->begin(&m_tracker, setCwv, part)) {
+    uint32_t bitmapStart;
+    if (exFatBitmapStart(&bitmapStart)) {
+      m_tracker.trackBitmap(bitmapStart, m_xVol->clusterCount());
+    }
     goto done;
   }
   m_xVol = nullptr;
   m_fVol = new (m_volMem) FatVolume;
-  if (m_fVol && m_fVol->begin(m_blockDev, setCwv, part)) {
+  if (m_fVol && m_fVol->begin(&m_tracker, setCwv, part)) {
+    if (m_fVol->fatType() == FAT_TYPE_FAT16 ||
+        m_fVol->fatType() == FAT_TYPE_FAT32) {
+      m_tracker.trackFat(m_fVol->fatType(), m_fVol->fatStartSector(),
+                         m_fVol->clusterCount());
+    }
     goto done;
   }
   m_cwv = nullptr;
@@ -56,6 +131,29 @@ bool PFsVolume::begin(BlockDevice* blockDev, bool setCwv, uint8_t part) {
   return true;
 }
 //------------------------------------------------------------------------------
+// The allocation bitmap entry is one of the first entries in the exFAT
+// root directory.
+bool PFsVolume::exFatBitmapStart(uint32_t* sector) {
+  uint8_t buf[512];
+  uint32_t root_dir = clusterStartSector(m_xVol->rootDirectoryCluster());
+  uint32_t spc = m_xVol->sectorsPerCluster();
+
+  for (uint32_t i = 0; i < spc; i++) {
+    if (!m_blockDev->readSector(root_dir + i, buf)) return false;
+    for (uint16_t index_in_sector = 0; index_in_sector < 512;
+         index_in_sector += 32) {
+      DirBitmap_t *dir = reinterpret_cast<DirBitmap_t*>(&buf[index_in_sector]);
+      if (dir->type == EXFAT_TYPE_BITMAP) {
+        *sector = clusterStartSector(getLe32(dir->firstCluster));
+        return true;
+      } else if (dir->type == 0) {
+        return false;
+      }
+    }
+  }
+  return false;
+}
+//------------------------------------------------------------------------------
 bool PFsVolume::ls(print_t* pr, const char* path, uint8_t flags) {
   PFsBaseFile dir;
   return dir.open(this, path, O_RDONLY) && dir.ls(pr, flags);
@@ -66,6 +164,672 @@ PFsFile PFsVolume::open(const char *path, oflag_t oflag) {
   tmpFile.open(this, path, oflag);
   return tmpFile;
 }
+//------------------------------------------------------------------------------
+// exists(), remove(), rename() and rmdir() open through PFsBaseFile, as
+// SdFat does through FatFile, so they use the dentry cache and index.
+bool PFsVolume::exists(const char* path) {
+  PFsBaseFile file;
+  return file.open(this, path, O_RDONLY);
+}
+//------------------------------------------------------------------------------
+bool PFsVolume::remove(const char* path) {
+  PFsBaseFile file;
+  return file.open(this, path, O_WRONLY) && file.remove();
+}
+//------------------------------------------------------------------------------
+bool PFsVolume::rename(const char* oldPath, const char* newPath) {
+  PFsBaseFile file;
+  return file.open(this, oldPath, O_RDONLY) && file.rename(newPath);
+}
+//------------------------------------------------------------------------------
+bool PFsVolume::rmdir(const char* path) {
+  PFsBaseFile dir;
+  return dir.open(this, path, O_RDONLY) && dir.rmdir();
+}
+//------------------------------------------------------------------------------
+bool PFsVolume::mkdir(const char* path, bool pFlag) {
+  PFsBaseFile root;
+  PFsBaseFile parent;
+  PFsBaseFile dir;
+  const char* name = path;
+  char buf[256];
+  size_t len;
+
+  if (useLookup(path)) {
+    if (root.openRoot(this) && walk(&root, &name, &len, &parent)) {
+      if (len == 0 || len >= sizeof(buf)) {
+        return false;
+      }
+      memcpy(buf, name, len);
+      buf[len] = 0;
+      return dir.mkdir(&parent, buf, false);
+    }
+    if (!pFlag) {
+      return false;
+    }
+    // Let SdFat create the missing parents.
+  }
+  m_dirIndex.clear();
+  return m_fVol ? m_fVol->mkdir(path, pFlag) :
+         m_xVol ? m_xVol->mkdir(path, pFlag) : false;
+}
+//------------------------------------------------------------------------------
+bool PFsVolume::setDirIndex(PFsDirSlot_t* table, uint32_t size) {
+  m_dirIndex.setTable(table, size);
+  return m_dirIndex.enabled();
+}
+//------------------------------------------------------------------------------
+// Forget the index of dir after a change the index can't follow. A path
+// through subdirectories may have changed any directory.
+void PFsVolume::dirIndexDrop(PFsBaseFile* dir, const char* path) {
+  uint32_t key;
+  if (strchr(path, '/') || !dirEntrySector(dir, 0, &key)) {
+    m_dirIndex.clear();
+  } else {
+    m_dirIndex.dropDir(key);
+  }
+}
+//------------------------------------------------------------------------------
+// Reads the 32 byte entries of a directory straight from the drive a
+// sector at a time, like PFsStreamWriter. The volume cache must be clear.
+class DirEntryReader {
+ public:
+  DirEntryReader(PFsVolume* vol, PFsBaseFile* dir) : m_vol(vol), m_dir(dir) {}
+  // Entry i, or nullptr past the end of the directory or on error.
+  const uint8_t* entry(uint32_t i) {
+    uint32_t sector;
+    uint64_t size = m_dir->fileSize();
+    if (!m_sector || (i >> 4) != m_group) {
+      // Contiguous directories are not ended by their cluster chain.
+      if ((size && (uint64_t)i*32 >= size) ||
+          !m_vol->dirEntrySector(m_dir, i, &sector)) {
+        return nullptr;
+      }
+      if (!m_vol->blockDevice()->readSector(sector, m_buf)) {
+        m_error = true;
+        return nullptr;
+      }
+      m_sector = true;
+      m_group = i >> 4;
+    }
+    return m_buf + ((i & 15) << 5);
+  }
+  // True if an entry was missing because of a read error.
+  bool error() const {return m_error;}
+
+ private:
+  PFsVolume* m_vol;
+  PFsBaseFile* m_dir;
+  uint32_t m_group = 0;
+  bool m_sector = false;
+  bool m_error = false;
+  uint8_t m_buf[512];
+};
+//------------------------------------------------------------------------------
+// Reads the file sets of an exFAT directory, looking only at the file and
+// stream entries until a name is wanted. Sectors holding nothing but the
+// names of other files are skipped.
+class ExFatSetReader : public DirEntryReader {
+ public:
+  ExFatSetReader(PFsVolume* vol, PFsBaseFile* dir) : DirEntryReader(vol, dir) {}
+  // Step to the next file set, false at the end of the directory.
+  bool next() {
+    for (;;) {
+      const DirFile_t* dirFile =
+        reinterpret_cast<const DirFile_t*>(entry(m_next));
+      if (!dirFile || dirFile->type == 0) {
+        return false;
+      }
+      if (dirFile->type != EXFAT_TYPE_FILE || dirFile->setCount < 2) {
+        m_next++;
+        continue;
+      }
+      m_file = *dirFile;
+      const DirStream_t* dirStream =
+        reinterpret_cast<const DirStream_t*>(entry(m_next + 1));
+      if (!dirStream) {
+        return false;
+      }
+      if (dirStream->type != EXFAT_TYPE_STREAM) {
+        m_next++;
+        continue;
+      }
+      m_stream = *dirStream;
+      m_index = m_next;
+      m_next += 1 + m_file.setCount;
+      return true;
+    }
+  }
+  // Read the UTF-16 name of the current set, at most 255 characters.
+  // Returns its length, short if a name entry is missing.
+  size_t getName(uint16_t* name) {
+    const uint8_t* dirName = nullptr;
+    size_t k;
+    for (k = 0; k < m_stream.nameLength; k++) {
+      if (k % 15 == 0) {
+        dirName = k/15 + 1 < m_file.setCount ? entry(m_index + 2 + k/15) :
+                  nullptr;
+        if (!dirName || dirName[0] != EXFAT_TYPE_NAME) {
+          break;
+        }
+      }
+      // Name entries hold 15 UTF-16 characters after two header bytes.
+      name[k] = getLe16(dirName + 2 + 2*(k % 15));
+    }
+    return k;
+  }
+  // Compare the name of the current set with an ASCII name, ignoring case.
+  bool nameIs(const char* name, size_t len) {
+    uint16_t check[255];
+    if (len != m_stream.nameLength || getName(check) != len) {
+      return false;
+    }
+    for (size_t k = 0; k < len; k++) {
+      uint16_t c = check[k];
+      uint8_t n = name[k];
+      if (c >= 'a' && c <= 'z') {
+        c -= 'a' - 'A';
+      }
+      if (n >= 'a' && n <= 'z') {
+        n -= 'a' - 'A';
+      }
+      if (c != n) {
+        return false;
+      }
+    }
+    return true;
+  }
+  // Name length and hash of the current set, as PFsDirIndex::exFatHash().
+  uint32_t hash() const {
+    return PFsDirIndex::exFatStreamHash(m_stream.nameLength,
+                                        getLe16(m_stream.nameHash));
+  }
+  // Entry index of the file entry of the current set.
+  uint32_t index() const {return m_index;}
+  // Entry index where next() looks for the next set.
+  uint32_t position() const {return m_next;}
+  // File and stream entries of the current set.
+  const DirFile_t* dirFile() const {return &m_file;}
+  const DirStream_t* dirStream() const {return &m_stream;}
+  // Continue from entry index i.
+  void seek(uint32_t i) {m_next = i;}
+
+ private:
+  DirFile_t m_file;
+  DirStream_t m_stream;
+  uint32_t m_next = 0;
+  uint32_t m_index = 0;
+};
+//------------------------------------------------------------------------------
+// Find an ASCII name in an exFAT directory by the name hash of each set.
+bool PFsVolume::exFatFind(PFsBaseFile* dir, const char* name, size_t len,
+                          uint32_t hash, uint32_t* index) {
+  ExFatSetReader sets(this, dir);
+
+  if (!cacheClear()) {
+    return false;
+  }
+  while (sets.next()) {
+    if (sets.hash() == hash && sets.nameIs(name, len)) {
+      *index = sets.index();
+      return true;
+    }
+  }
+  return false;
+}
+//------------------------------------------------------------------------------
+bool PFsVolume::findName(PFsBaseFile* dir, const char* name, uint32_t* index) {
+  PFsBaseFile file;
+  size_t len = strlen(name);
+  bool ascii = m_xVol && len < 256 && !strpbrk(name, "/*?");
+
+  for (size_t k = 0; ascii && k < len; k++) {
+    ascii = (uint8_t)name[k] < 0X80;
+  }
+  // Spaces and dots at the end are dropped by SdFat before a search.
+  if (ascii && len && name[0] != ' ' && name[len - 1] != ' ' &&
+      name[len - 1] != '.') {
+    return exFatFind(dir, name, len, PFsDirIndex::exFatHash(name, len), index);
+  }
+  if (!file.openScan(dir, name, O_RDONLY)) {
+    return false;
+  }
+  *index = file.dirIndex();
+  return true;
+}
+//------------------------------------------------------------------------------
+// Store a UTF-16 name in ent as UTF-8, cut at a character that does not fit.
+static void direntName(PFsDirEnt_t* ent, const uint16_t* name, size_t len) {
+  size_t n = 0;
+  ent->flags = 0;
+  for (size_t k = 0; k < len; k++) {
+    uint32_t c = name[k];
+    uint8_t u[4];
+    size_t m;
+    if (c >= 0XD800 && c < 0XDC00 && k + 1 < len &&
+        name[k + 1] >= 0XDC00 && name[k + 1] < 0XE000) {
+      c = 0X10000 + ((c - 0XD800) << 10) + (name[++k] - 0XDC00);
+    }
+    if (c < 0X80) {
+      u[0] = c;
+      m = 1;
+    } else if (c < 0X800) {
+      u[0] = 0XC0 | (c >> 6);
+      u[1] = 0X80 | (c & 0X3F);
+      m = 2;
+    } else if (c < 0X10000) {
+      u[0] = 0XE0 | (c >> 12);
+      u[1] = 0X80 | ((c >> 6) & 0X3F);
+      u[2] = 0X80 | (c & 0X3F);
+      m = 3;
+    } else {
+      u[0] = 0XF0 | (c >> 18);
+      u[1] = 0X80 | ((c >> 12) & 0X3F);
+      u[2] = 0X80 | ((c >> 6) & 0X3F);
+      u[3] = 0X80 | (c & 0X3F);
+      m = 4;
+    }
+    if (n + m >= sizeof(ent->name)) {
+      ent->flags = PFS_DIRENT_TRUNCATED;
+      break;
+    }
+    memcpy(ent->name + n, u, m);
+    n += m;
+  }
+  ent->name[n] = 0;
+}
+//------------------------------------------------------------------------------
+// Decode the FAT entry at *index and any long name before it into ent.
+// On return *index is the entry after it. False at the end of the
+// directory.
+static bool fatDirEnt(DirEntryReader* entries, uint32_t* index,
+                      PFsDirEnt_t* ent) {
+  // Offsets of the 13 UTF-16 characters in a long name entry.
+  static const uint8_t lfnOffset[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22,
+                                        24, 28, 30};
+  uint16_t name[20*13];
+  uint8_t ord = 0;
+  uint8_t sum = 0;
+  uint8_t lfnCount = 0;
+
+  for (;;) {
+    const DirFat_t* dir =
+      reinterpret_cast<const DirFat_t*>(entries->entry(*index));
+    if (!dir || dir->name[0] == FAT_NAME_FREE) {
+      return false;
+    }
+    (*index)++;
+    if (dir->name[0] == FAT_NAME_DELETED) {
+      ord = 0;
+      continue;
+    }
+    if ((dir->attributes & 0X3F) == 0X0F) {
+      // Long name entries come last part first, ending with ord 1.
+      const uint8_t* lfn = reinterpret_cast<const uint8_t*>(dir);
+      uint8_t n = lfn[0] & 0X1F;
+      if (lfn[0] & 0X40) {
+        ord = n <= 20 ? n : 0;
+        lfnCount = ord;
+        sum = lfn[13];
+      } else if (!ord || n != ord - 1 || lfn[13] != sum) {
+        ord = 0;
+        continue;
+      } else {
+        ord = n;
+      }
+      for (uint8_t k = 0; ord && k < 13; k++) {
+        name[13*(ord - 1) + k] = getLe16(lfn + lfnOffset[k]);
+      }
+      continue;
+    }
+    if (dir->name[0] == '.' || (dir->attributes & 0X08)) {
+      ord = 0;
+      continue;
+    }
+    uint8_t check = 0;
+    for (uint8_t k = 0; k < 11; k++) {
+      check = ((check & 1) << 7) + (check >> 1) + dir->name[k];
+    }
+    size_t len = 0;
+    if (ord == 1 && check == sum) {
+      while (len < 13u*lfnCount && name[len] != 0 && name[len] != 0XFFFF) {
+        len++;
+      }
+    } else {
+      // Short name, lower case where the case flags say so.
+      for (uint8_t k = 0; k < 11; k++) {
+        uint8_t c = dir->name[k];
+        if (c == ' ') {
+          continue;
+        }
+        if (k == 8) {
+          name[len++] = '.';
+        }
+        if (c >= 'A' && c <= 'Z' &&
+            (dir->caseFlags & (k < 8 ? FAT_CASE_LC_BASE : FAT_CASE_LC_EXT))) {
+          c += 'a' - 'A';
+        }
+        name[len++] = c;
+      }
+    }
+    direntName(ent, name, len);
+    ent->size = getLe32(dir->fileSize);
+    ent->firstCluster = (uint32_t)getLe16(dir->firstClusterHigh) << 16 |
+                        getLe16(dir->firstClusterLow);
+    ent->index = *index - 1;
+    ent->createDate = getLe16(dir->createDate);
+    ent->createTime = getLe16(dir->createTime);
+    ent->modifyDate = getLe16(dir->modifyDate);
+    ent->modifyTime = getLe16(dir->modifyTime);
+    ent->attributes = dir->attributes & 0X37;
+    return true;
+  }
+}
+//------------------------------------------------------------------------------
+// Decode the current file set of sets into ent.
+static void exFatDirEnt(ExFatSetReader* sets, PFsDirEnt_t* ent) {
+  uint16_t name[255];
+  const DirFile_t* dirFile = sets->dirFile();
+  const DirStream_t* dirStream = sets->dirStream();
+  uint32_t createTime = getLe32(dirFile->createTime);
+  uint32_t modifyTime = getLe32(dirFile->modifyTime);
+
+  direntName(ent, name, sets->getName(name));
+  ent->size = getLe64(dirStream->validLength);
+  ent->firstCluster = getLe32(dirStream->firstCluster);
+  ent->index = sets->index();
+  ent->createDate = createTime >> 16;
+  ent->createTime = createTime & 0XFFFF;
+  ent->modifyDate = modifyTime >> 16;
+  ent->modifyTime = modifyTime & 0XFFFF;
+  ent->attributes = getLe16(dirFile->attributes) & 0X37;
+}
+//------------------------------------------------------------------------------
+int PFsVolume::readDir(PFsBaseFile* dir, PFsDirEnt_t* ents, size_t count) {
+  // Round up in case the position is inside an entry.
+  uint32_t next = (dir->curPosition() + 31) >> 5;
+  size_t n = 0;
+
+  if (!dir->isDir() || !cacheClear()) {
+    return -1;
+  }
+  if (m_xVol) {
+    ExFatSetReader sets(this, dir);
+    sets.seek(next);
+    while (n < count && sets.next()) {
+      exFatDirEnt(&sets, &ents[n++]);
+    }
+    if (sets.error()) {
+      return -1;
+    }
+    next = sets.position();
+  } else {
+    DirEntryReader entries(this, dir);
+    while (n < count && fatDirEnt(&entries, &next, &ents[n])) {
+      n++;
+    }
+    if (entries.error()) {
+      return -1;
+    }
+  }
+  // Leave the directory after the last entry returned for the next call.
+  if (!dir->seekSet((uint64_t)next << 5)) {
+    return -1;
+  }
+  return n;
+}
+//------------------------------------------------------------------------------
+// Return the directory number of an open directory, reading every name
+// in it the first time. The sector of its first entry is its key. An
+// exFAT directory is indexed by the name hash in its stream entries.
+int PFsVolume::indexDir(PFsBaseFile* dir, uint32_t key) {
+  char name[256];
+  PFsBaseFile file;
+  ExFatSetReader sets(this, dir);
+  bool retried = false;
+  int d;
+
+  if (!m_dirIndex.enabled()) {
+    return PFsDirIndex::NOT_INDEXED;
+  }
+  d = m_dirIndex.findDir(key);
+  if (d != PFsDirIndex::NOT_INDEXED) {
+    return d;
+  }
+  if (m_xVol && !cacheClear()) {
+    return PFsDirIndex::NOT_INDEXED;
+  }
+  d = m_dirIndex.addDir(key);
+  dir->rewind();
+  for (;;) {
+    size_t n = 1;
+    uint32_t hash;
+    uint32_t entry;
+    if (m_xVol) {
+      if (!sets.next()) {
+        break;
+      }
+      hash = sets.hash();
+      entry = sets.index();
+    } else {
+      if (!file.openNext(dir, O_RDONLY)) {
+        break;
+      }
+      n = file.getName(name, sizeof(name));
+      hash = PFsDirIndex::hashName(name, n);
+      entry = file.dirIndex();
+      file.close();
+    }
+    if (n && m_dirIndex.insert(d, hash, entry)) {
+      continue;
+    }
+    if (n && !retried && m_dirIndex.othersIndexed(d)) {
+      // Make room by forgetting the other directories.
+      m_dirIndex.clear();
+      d = m_dirIndex.addDir(key);
+      retried = true;
+      dir->rewind();
+      sets.seek(0);
+      continue;
+    }
+    // Too many entries, or a name too long to read. Remember that so
+    // the directory is not read again on every lookup.
+    m_dirIndex.setTooLarge(d);
+    return PFsDirIndex::TOO_LARGE;
+  }
+  if (sets.error() || mediaChanged()) {
+    m_dirIndex.dropDir(key);
+    return PFsDirIndex::NOT_INDEXED;
+  }
+  return d;
+}
+//------------------------------------------------------------------------------
+// Open the directory holding the last name of path, starting from dir.
+// On return path points to the last name and len is its length.
+bool PFsVolume::walk(PFsBaseFile* dir, const char** path, size_t* len,
+                     PFsBaseFile* parent) {
+  PFsBaseFile sub;
+  const char* p = *path;
+
+  if (*p == '/') {
+    while (*p == '/') {
+      p++;
+    }
+    if (!parent->openRoot(this)) {
+      return false;
+    }
+  } else {
+    *parent = *dir;
+  }
+  for (;;) {
+    size_t n = strcspn(p, "/");
+    const char* next = p + n;
+    while (*next == '/') {
+      next++;
+    }
+    if (*next == 0) {
+      *path = p;
+      *len = n;
+      return true;
+    }
+    if (!lookupName(parent, p, n, O_RDONLY, &sub) || !sub.isDir()) {
+      return false;
+    }
+    *parent = sub;
+    p = next;
+  }
+}
+//------------------------------------------------------------------------------
+bool PFsVolume::lookupOpen(PFsBaseFile* dir, const char* path, oflag_t oflag,
+                           PFsBaseFile* file) {
+  PFsBaseFile parent;
+  size_t len;
+
+  file->close();
+  if (*path == '/' && path[strspn(path, "/")] == 0) {
+    return file->openRoot(this);
+  }
+  return walk(dir, &path, &len, &parent) &&
+         lookupName(&parent, path, len, oflag, file);
+}
+//------------------------------------------------------------------------------
+static bool sameName(const char* a, const char* b) {
+  for (;; a++, b++) {
+    char ca = *a >= 'a' && *a <= 'z' ? *a - ('a' - 'A') : *a;
+    char cb = *b >= 'a' && *b <= 'z' ? *b - ('a' - 'A') : *b;
+    if (ca != cb) {
+      return false;
+    }
+    if (ca == 0) {
+      return true;
+    }
+  }
+}
+//------------------------------------------------------------------------------
+// Open entry of dir read only and check that it has name. Dentries and
+// index slots may be stale.
+static bool entryIs(PFsBaseFile* dir, uint32_t entry, const char* name,
+                    size_t len, PFsBaseFile* file) {
+  char check[256];
+  if (file->open(dir, entry, O_RDONLY) &&
+      file->getName(check, sizeof(check)) == len && sameName(check, name)) {
+    return true;
+  }
+  file->close();
+  return false;
+}
+//------------------------------------------------------------------------------
+// Open a file found by entryIs() with the caller's flags.
+static bool openFound(PFsBaseFile* dir, uint32_t entry, oflag_t oflag,
+                      PFsBaseFile* file) {
+  if ((oflag & O_CREAT) && (oflag & O_EXCL)) {
+    file->close();
+    return false;
+  }
+  return oflag == O_RDONLY ||
+         file->open(dir, entry, oflag & ~(O_CREAT | O_EXCL));
+}
+//------------------------------------------------------------------------------
+// Open one name in dir, from the dentry cache, the directory index or a
+// search of the directory. Names SdFat would change before comparing,
+// with leading or trailing spaces or trailing dots, non-ASCII names and
+// wildcards are always searched for.
+bool PFsVolume::lookupName(PFsBaseFile* dir, const char* name, size_t len,
+                           oflag_t oflag, PFsBaseFile* file) {
+  char buf[256];
+  bool search = len == 0 || name[0] == ' ' || name[len - 1] == ' ' ||
+                name[len - 1] == '.';
+  uint32_t key;
+  uint32_t hash;
+  uint32_t slot;
+  uint32_t entry;
+  int d;
+
+  if (len >= sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, name, len);
+  buf[len] = 0;
+  for (size_t k = 0; k < len; k++) {
+    if ((uint8_t)buf[k] >= 0X80 || buf[k] == '*' || buf[k] == '?') {
+      search = true;
+    }
+  }
+  if (search || !dirEntrySector(dir, 0, &key)) {
+    if (!file->openScan(dir, buf, oflag)) {
+      return false;
+    }
+    // The name created may not be the one given, "A." creates "A".
+    if (search && (oflag & O_CREAT)) {
+      dirIndexDrop(dir);
+    }
+    return true;
+  }
+  // Computed once for the dentry cache, the index and an exFAT search.
+  hash = m_xVol ? PFsDirIndex::exFatHash(buf, len) :
+         PFsDirIndex::hashName(buf, len);
+  if (m_dentries.find(key, hash, &entry)) {
+    if (entryIs(dir, entry, buf, len, file)) {
+      return openFound(dir, entry, oflag, file);
+    }
+    m_dentries.drop(key, hash);
+  }
+  d = indexDir(dir, key);
+  if (d >= 0) {
+    slot = m_dirIndex.probe(d, hash);
+    while (m_dirIndex.next(d, hash, &slot, &entry)) {
+      if (entryIs(dir, entry, buf, len, file)) {
+        goto found;
+      }
+    }
+    // Not in the directory, unless it is the short alias of a long name.
+    if (!(oflag & O_CREAT) && !(m_fVol && strchr(buf, '~'))) {
+      return false;
+    }
+  } else if (m_xVol) {
+    // exFatFind() has compared the name, only the file needs opening.
+    if (exFatFind(dir, buf, len, hash, &entry)) {
+      if (file->open(dir, entry, O_RDONLY)) {
+        goto found;
+      }
+    } else if (!(oflag & O_CREAT)) {
+      return false;
+    }
+  }
+  if (!file->openScan(dir, buf, oflag)) {
+    return false;
+  }
+  entry = file->dirIndex();
+  if (d >= 0 && (oflag & O_CREAT) && !m_dirIndex.insert(d, hash, entry)) {
+    // Full, read the directory again next time or mark it too large.
+    dirIndexDrop(dir);
+  }
+  m_dentries.insert(key, hash, entry);
+  return true;
+
+ found:
+  m_dentries.insert(key, hash, entry);
+  return openFound(dir, entry, oflag, file);
+}
+
+//------------------------------------------------------------------------------
+bool PFsVolume::dirEntrySector(PFsBaseFile* dir, uint32_t index, uint32_t* sector) {
+  fspos_t fpos;
+  uint64_t pos = (uint64_t)index*32;
+  // Position one byte into the entry so the file's current cluster is the
+  // one holding the entry even when it starts on a cluster boundary.
+  if (!dir->isDir() || !dir->seekSet(pos + 1)) return false;
+  dir->fgetpos(&fpos);
+  if (fpos.cluster == 0) {
+    // FAT12/FAT16 root directory lives in a fixed area before the data region.
+    if (!m_fVol || fatType() > FAT_TYPE_FAT16) return false;
+    *sector = m_fVol->rootDirStart() + (uint32_t)(pos >> 9);
+    return true;
+  }
+  *sector = clusterStartSector(fpos.cluster) +
+            (uint32_t)((pos & (bytesPerCluster() - 1)) >> 9);
+  return true;
+}
 
 extern void dump_hexbytes(const void *ptr, int len);
 
@@ -319,56 +1083,151 @@ typedef struct {
   uint32_t todo;
   uint32_t clusters_per_sector;
   uint32_t sectors_left_in_call;
+  uint16_t *index;  // FAT sector free counts or nullptr.
+  PFsAllocTracker *discard;  // Queue for free runs or nullptr.
+  uint32_t cluster;    // Cluster of the next entry.
+  uint32_t run_start;
+  uint32_t run_count;
+  uint32_t skip;       // Clusters below this were queued before a restart.
+  uint32_t resume;     // Start of the first run that did not fit or zero.
 } _gfcc_t;
 
+static void _gfccEndRun(_gfcc_t *gfcc) {
+  if (gfcc->run_count && !gfcc->resume &&
+      !gfcc->discard->queueDiscard(gfcc->run_start, gfcc->run_count)) {
+    gfcc->resume = gfcc->run_start;
+  }
+  gfcc->run_count = 0;
+}
+
+static void _gfccDiscardRuns(_gfcc_t *gfcc, const uint8_t *buffer,
+                             uint32_t cnt, uint32_t free) {
+  if (free == 0 || gfcc->cluster + cnt <= gfcc->skip) {
+    _gfccEndRun(gfcc);
+    gfcc->cluster += cnt;
+    return;
+  }
+  if (free == cnt && gfcc->cluster >= gfcc->skip) {
+    if (gfcc->run_count == 0) gfcc->run_start = gfcc->cluster;
+    gfcc->run_count += cnt;
+    gfcc->cluster += cnt;
+    return;
+  }
+  for (uint32_t i = 0; i < cnt; i++, gfcc->cluster++) {
+    bool entry_free;
+    if (gfcc->clusters_per_sector == 512/2) {
+      entry_free = ((const uint16_t *)buffer)[i] == 0;
+    } else if (gfcc->clusters_per_sector == 512/4) {
+      entry_free = (((const uint32_t *)buffer)[i] & 0X0FFFFFFF) == 0;
+    } else {
+      entry_free = !(buffer[i >> 3] & (1 << (i & 7)));
+    }
+    if (entry_free && gfcc->cluster >= gfcc->skip) {
+      if (gfcc->run_count++ == 0) gfcc->run_start = gfcc->cluster;
+    } else {
+      _gfccEndRun(gfcc);
+    }
+  }
+}
+
 
-static void _getfreeclustercountCB(uint32_t token, uint8_t *buffer) 
+static void _getfreeclustercountCB(uintptr_t token, uint8_t *buffer) 
 {
   //digitalWriteFast(1, HIGH);
 //  Serial.print("&");
   _gfcc_t *gfcc = (_gfcc_t *)token;
-  uint16_t cnt = gfcc->clusters_per_sector;
+  uint32_t cnt = gfcc->clusters_per_sector;
+  uint32_t free;
   if (cnt > gfcc->todo) cnt = gfcc->todo;
   gfcc->todo -= cnt; // update count here...
   gfcc->sectors_left_in_call--;
   if (gfcc->clusters_per_sector == 512/2) {
     // fat16
-    uint16_t *fat16 = (uint16_t *)buffer;
-    while (cnt-- ) {
-      if (*fat16++ == 0) gfcc->free++;
-    }
+    free = pfsFreeFat16((uint16_t *)buffer, cnt);
+  } else if (gfcc->clusters_per_sector == 512/4) {
+    free = pfsFreeFat32((uint32_t *)buffer, cnt);
   } else {
-    uint32_t *fat32 = (uint32_t *)buffer;
-    while (cnt-- ) {
-      if (*fat32++ == 0) gfcc->free++;
-      //else gfcc->not_free++;
-    }
+    // exFAT allocation bitmap
+    free = pfsFreeBitmap(buffer, cnt);
   }
+  gfcc->free += free;
+  // Sectors past the last cluster have nothing to count or index.
+  if (gfcc->index && cnt) *gfcc->index++ = free;
+  if (gfcc->discard) _gfccDiscardRuns(gfcc, buffer, cnt, free);
 
   //digitalWriteFast(1, LOW);
 }
 
+//-------------------------------------------------------------------------------------------------
+// cacheClear() writes only the data cache. SdFat writes its FAT and bitmap
+// caches in cacheSync(), reached through a file's sync(). The caches stay
+// valid and nothing is sent if none is dirty.
+bool PFsVolume::syncCaches() {
+  if (m_fVol) {
+    FatFile root;
+    return root.openRoot(m_fVol) && root.sync();
+  }
+  if (m_xVol) {
+    ExFatFile root;
+    return root.openRoot(m_xVol) && root.sync();
+  }
+  return false;
+}
 //-------------------------------------------------------------------------------------------------
 uint32_t PFsVolume::freeClusterCount()  {
-  // For XVolume lets let the original code do it.
+  if (!m_fVol && !m_xVol) return 0;
+  // Write dirty FAT and bitmap sectors so their changes are counted.
+  if (!syncCaches()) return (uint32_t)-1;
+  if (!m_tracker.valid()) {
+    uint32_t free = scanFreeClusterCount();
+    if (free == (uint32_t)-1) return free;
+    m_tracker.setFreeCount(free);
+  }
+  return m_tracker.freeCount();
+}
+//-------------------------------------------------------------------------------------------------
+// With discard set, runs of free clusters are unmapped as they are found
+// and the return is zero for success.
+uint32_t PFsVolume::scanFreeClusterCount(bool discard)  {
 //  Serial.println("PFsVolume::freeClusterCount() called");
-  if (m_xVol) return m_xVol->freeClusterCount();
-
-  if (!m_fVol) return 0;
+  if (!m_fVol && !m_xVol) return 0;
 
-  if (!m_usmsci) return m_fVol->freeClusterCount();
-
-  // So roll our own here for Fat16/32...
+  // So roll our own here for Fat16/32 and the exFAT bitmap...
   _gfcc_t gfcc; 
   gfcc.free = 0;
+  gfcc.index = discard ? nullptr : m_tracker.index();
+  gfcc.discard = discard ? &m_tracker : nullptr;
+  gfcc.run_count = 0;
+  gfcc.skip = 0;
+  gfcc.resume = 0;
   //gfcc.not_free = 0;
+  uint32_t first_sector;
+  uint32_t sectors_left;
 
-  switch (m_fVol->fatType()) {
-    default: return 0;
-    case FAT_TYPE_FAT16: gfcc.clusters_per_sector = 512/2; break;
-    case FAT_TYPE_FAT32: gfcc.clusters_per_sector = 512/4; break;
+  if (m_xVol) {
+    // For XVolume lets let the original code do it if the bitmap is not found.
+    if (!exFatBitmapStart(&first_sector)) {
+      return discard ? (uint32_t)-1 : m_xVol->freeClusterCount();
+    }
+    gfcc.clusters_per_sector = 512*8;
+    gfcc.todo = m_xVol->clusterCount();
+    sectors_left = (gfcc.todo + 512*8 - 1)/(512*8);
+  } else {
+    switch (m_fVol->fatType()) {
+      default: return 0;
+      case FAT_TYPE_FAT16: gfcc.clusters_per_sector = 512/2; break;
+      case FAT_TYPE_FAT32: gfcc.clusters_per_sector = 512/4; break;
+    }
+    gfcc.todo = m_fVol->clusterCount() + 2;
+    first_sector = m_fVol->fatStartSector();
+    sectors_left = m_fVol->sectorsPerFat();
   }
-  gfcc.todo = m_fVol->clusterCount() + 2;
+  // Bitmap bit zero is cluster two, FAT entry n is cluster n.
+  const uint32_t base_cluster = m_xVol ? 2 : 0;
+  const uint32_t scan_start = first_sector;
+  const uint32_t scan_sectors = sectors_left;
+  const uint32_t scan_entries = gfcc.todo;
+  gfcc.cluster = base_cluster;
 #if 0    
     Serial.printf("###PFsVolume::freeClusterCount: FT:%u\n", m_fVol->fatType());
     Serial.printf("    m_sectorsPerCluster:%u\n", m_fVol->sectorsPerCluster());
@@ -387,18 +1246,51 @@ uint32_t PFsVolume::freeClusterCount()  {
 //  digitalWriteFast(0, HIGH);
 //  Serial.println("    Using readSectorswithCB");
   #define CNT_FATSECTORS_PER_CALL 256
-  uint32_t first_sector = m_fVol->fatStartSector();
-  uint32_t sectors_left = m_fVol->sectorsPerFat();
   bool succeeded = true;
+  bool usb_direct = m_usmsci && (BlockDevice*)m_usmsci == m_blockDev;
+  // Read straight from USB in the drive's optimal transfer size.
+  uint32_t sectors_per_call = usb_direct ?
+      m_usmsci->optimalTransferSectors() : CNT_FATSECTORS_PER_CALL;
 
   while (sectors_left) {
-    uint32_t sectors_to_write = (sectors_left < CNT_FATSECTORS_PER_CALL)? sectors_left : CNT_FATSECTORS_PER_CALL;
+    uint32_t sectors_to_write = (sectors_left < sectors_per_call)? sectors_left : sectors_per_call;
     gfcc.sectors_left_in_call = sectors_to_write;
 
-    succeeded = m_usmsci->readSectorsWithCB(first_sector,sectors_to_write, &_getfreeclustercountCB, (uint32_t)&gfcc);
+    if (usb_direct) {
+      succeeded = m_usmsci->readSectorsWithCallback(first_sector,sectors_to_write, &_getfreeclustercountCB, (uintptr_t)&gfcc);
+    } else {
+      // Not a USB drive, same scan one sector at a time.
+      uint8_t buffer[512];
+      for (uint32_t i = 0; succeeded && i < sectors_to_write; i++) {
+        succeeded = m_blockDev->readSector(first_sector + i, buffer);
+        if (succeeded) _getfreeclustercountCB((uintptr_t)&gfcc, buffer);
+      }
+    }
     if (!succeeded) break;
     sectors_left -= sectors_to_write;
     first_sector += sectors_to_write;
+    if (discard && !sectors_left) _gfccEndRun(&gfcc);
+    if (discard && gfcc.resume) {
+      // The queue filled, unmap what it holds and scan again from the
+      // sector with the first run that did not fit. No unmap can be sent
+      // while the drive is still sending the FAT.
+      if (!m_tracker.flushDiscards()) {
+        succeeded = false;
+        break;
+      }
+      uint32_t skip_sectors = (gfcc.resume - base_cluster)/gfcc.clusters_per_sector;
+      first_sector = scan_start + skip_sectors;
+      sectors_left = scan_sectors - skip_sectors;
+      gfcc.cluster = base_cluster + skip_sectors*gfcc.clusters_per_sector;
+      gfcc.todo = scan_entries - skip_sectors*gfcc.clusters_per_sector;
+      gfcc.skip = gfcc.resume;
+      gfcc.resume = 0;
+      gfcc.run_count = 0;
+    }
+  }
+  if (discard) {
+    if (succeeded) succeeded = m_tracker.flushDiscards();
+    return succeeded ? 0 : (uint32_t)-1;
   }
 
 //  digitalWriteFast(0, LOW);
@@ -407,9 +1299,57 @@ uint32_t PFsVolume::freeClusterCount()  {
   return gfcc.free;
 }
 
+//-------------------------------------------------------------------------------------------------
+bool PFsVolume::setFreeIndex(uint16_t* index, uint32_t size) {
+  m_tracker.setIndex(index, size);
+  return m_tracker.index() != nullptr;
+}
+//-------------------------------------------------------------------------------------------------
+bool PFsVolume::allocContiguous(uint32_t count, uint32_t* firstCluster) {
+  // freeClusterCount() syncs the FAT cache and builds the index.
+  if (!m_fVol || !m_tracker.index() ||
+      freeClusterCount() == (uint32_t)-1) return false;
+  if (!m_tracker.findFreeRun(count, firstCluster)) return false;
+  bool rtn = m_tracker.writeChain(*firstCluster, count, m_fVol->fatCount(),
+                                  m_fVol->sectorsPerFat());
+  return reloadFat() && rtn;
+}
+//-------------------------------------------------------------------------------------------------
+bool PFsVolume::freeContiguous(uint32_t count, uint32_t firstCluster) {
+  if (!m_fVol || !syncCaches()) return false;
+  bool rtn = m_tracker.writeChain(firstCluster, count, m_fVol->fatCount(),
+                                  m_fVol->sectorsPerFat(), false);
+  return reloadFat() && rtn;
+}
+//-------------------------------------------------------------------------------------------------
+// The FAT was written behind SdFat, whose FAT cache may hold an old copy of
+// a sector. SdFat has no call to drop that cache, init() starts over with
+// empty caches. It is the same partition, so open files are not affected,
+// and the caches were synced before the FAT was written.
+bool PFsVolume::reloadFat() {
+  return m_fVol->init(&m_tracker, m_part);
+}
+
+//-------------------------------------------------------------------------------------------------
+bool PFsVolume::setDiscard(bool enable) {
+  return m_tracker.setDiscard(dataStartSector(),
+                              enable ? sectorsPerCluster() : 0);
+}
+//-------------------------------------------------------------------------------------------------
+bool PFsVolume::discardFreeSpace() {
+  bool enabled = m_tracker.discardEnabled();
+  // Write back the FAT or bitmap so every free cluster is free on the
+  // drive.
+  bool rtn = syncCaches() && setDiscard(true) &&
+             scanFreeClusterCount(true) != (uint32_t)-1;
+  setDiscard(enabled);
+  return rtn;
+}
+
 uint32_t PFsVolume::getFSInfoSectorFreeClusterCount() {
   uint8_t sector_buffer[512];
-  if (fatType() != FAT_TYPE_FAT32) return (uint32_t)-1;
+  // Only FAT32 volumes found through the MBR.
+  if (fatType() != FAT_TYPE_FAT32 || m_part == 0) return (uint32_t)-1;
 
   // We could probably avoid this read if our class remembered the starting sector number for the partition...
   if (!m_blockDev->readSector(0, sector_buffer)) return (uint32_t)-1;
@@ -445,7 +1385,7 @@ uint32_t PFsVolume::getFSInfoSectorFreeClusterCount() {
 
 bool PFsVolume::setUpdateFSInfoSectorFreeClusterCount(uint32_t free_count) {
   uint8_t sector_buffer[512];
-  if (fatType() != FAT_TYPE_FAT32) return (uint32_t)false;
+  if (fatType() != FAT_TYPE_FAT32 || m_part == 0) return (uint32_t)false;
 
   if (free_count == (uint32_t)-1) free_count = freeClusterCount();
 
@@ -29,12 +29,16 @@
  * \brief PFsVolume include file.
  */
 #include "PFsNew.h"
+#include "PFsAllocTracker.h"
+#include "PFsDentryCache.h"
+#include "PFsDirIndex.h"
 #include <SdFat.h>
 #include "USBMSCDevice.h"
 //#include "../FatLib/FatLib.h"
 //#include "../ExFatLib/ExFatLib.h"
 
 class PFsFile;
+class PFsBaseFile;
 /**
  * \class PFsVolume
  * \brief PFsVolume class.
@@ -49,17 +53,50 @@ class PFsVolume {
    * Initialize an FatVolume object.
    * \param[in] blockDev Device block driver.
    * \param[in] setCwv Set current working volume if true.
-   * \param[in] part partition to initialize.
+   * \param[in] part partition to initialize, the GPT partition entry on
+   *            a GPT disk.
    * \return true for success or false for failure.
    */
   bool begin(USBMSCDevice* dev, bool setCwv = true, uint8_t part = 1);
   bool begin(BlockDevice* dev, bool setCwv = true, uint8_t part = 1);
+  /**
+   * Initialize a volume through a USBmscCache or USBmscScheduler placed
+   * in front of a USB drive. The drive is still used for media change
+   * detection and discard. On a GPT disk part selects a GPT partition
+   * entry, which may start past the first 2 TB like with beginAt().
+   * Start front with begin(dev) so it drops its sectors, too, after a
+   * media change.
+   * \param[in] dev USB drive holding the volume.
+   * \param[in] front Cache or scheduler attached to dev.
+   * \param[in] setCwv Set current working volume if true.
+   * \param[in] part partition to initialize.
+   * \return true for success or false for failure.
+   */
+  bool begin(USBMSCDevice* dev, BlockDevice* front, bool setCwv = true,
+             uint8_t part = 1);
+  /**
+   * Initialize a volume that starts at a 64-bit sector address, for
+   * volumes past the first 2 TB of a drive. The volume itself is limited
+   * to 2^32 sectors.
+   * \param[in] dev USB drive holding the volume.
+   * \param[in] startSector First sector of the volume, its boot sector.
+   * \param[in] setCwv Set current working volume if true.
+   * \return true for success or false for failure.
+   */
+  bool beginAt(USBMSCDevice* dev, uint64_t startSector, bool setCwv = true);
 
   FatVolume*  getFatVol() {return m_fVol;}
   ExFatVolume* getExFatVol() { return m_xVol; }
 
   uint8_t part() {return m_part;}
   BlockDevice* blockDevice() {return m_blockDev;}
+  /** \return the USB MSC device or nullptr if not mounted on one. */
+  USBMSCDevice* usbDevice() {return m_usmsci;}
+  /** \return true if the USB drive was unplugged or its media changed
+   * since begin(). The volume and its open files then fail until begin()
+   * is called again.
+   */
+  bool mediaChanged() const {return m_tracker.mediaChanged();}
 
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
   // Use sectorsPerCluster(). blocksPerCluster() will be removed in the future.
@@ -75,6 +112,7 @@ class PFsVolume {
    * \return true for success or false for failure.
    */
   bool chdir() {
+    m_vwdRoot = true;
     return m_fVol ? m_fVol->chdir() :
            m_xVol ? m_xVol->chdir() : false;
   }
@@ -83,10 +121,35 @@ class PFsVolume {
    * \param[in] path Path for volume working directory.
    * \return true for success or false for failure.
    */
-    bool chdir(const char* path) {
-    return m_fVol ? m_fVol->chdir(path) :
-           m_xVol ? m_xVol->chdir(path) : false;
+  bool chdir(const char* path) {
+    bool rtn = m_fVol ? m_fVol->chdir(path) :
+               m_xVol ? m_xVol->chdir(path) : false;
+    if (rtn) {
+      m_vwdRoot = path[strspn(path, "/")] == 0;
+    }
+    return rtn;
+  }
+  /** \return The first sector of a data cluster. */
+  uint32_t clusterStartSector(uint32_t cluster) const {
+    return dataStartSector() + (cluster - 2)*sectorsPerCluster();
+  }
+  /** Write any dirty data in the volume cache and invalidate it.
+   * Not for normal apps, use before and after raw sector access.
+   * \return true for success or false for failure.
+   */
+  bool cacheClear() {
+    return m_fVol ? m_fVol->cacheClear() != nullptr :
+           m_xVol ? m_xVol->cacheClear() != nullptr : false;
   }
+  /** Find the sector holding a directory entry. Not for normal apps.
+   *
+   * \param[in] dir Open directory file. Its position is changed.
+   * \param[in] index Index of the 32 byte entry in dir.
+   * \param[out] sector Sector containing the entry. The byte offset in
+   *             the sector is (32*index) & 511.
+   * \return true for success or false for failure.
+   */
+  bool dirEntrySector(PFsBaseFile* dir, uint32_t index, uint32_t* sector);
   /** Change global working volume to this volume. */
   void chvol() {m_cwv = this;}
   /** \return The total number of clusters in the volume. */
@@ -101,6 +164,9 @@ class PFsVolume {
   }
   /** free dynamic memory and end access to volume */
   void end() {
+    m_tracker.invalidate();
+    m_dirIndex.clear();
+    m_dentries.clear();
     m_fVol = nullptr;
     m_xVol = nullptr;
   }
@@ -110,10 +176,7 @@ class PFsVolume {
    *
    * \return true if the file exists else false.
    */
-  bool exists(const char* path) {
-    return m_fVol ? m_fVol->exists(path) :
-           m_xVol ? m_xVol->exists(path) : false;
-  }
+  bool exists(const char* path);
   /** \return The logical sector number for the start of the first FAT. */
   uint32_t fatStartSector() const {
     return m_fVol ? m_fVol->fatStartSector() :
@@ -140,9 +203,81 @@ class PFsVolume {
    }
   
   
-  /** \return the free cluster count. */
+  /** Count free clusters. Dirty FAT and bitmap sectors in the volume
+   * caches are written first, so the count includes them. The volume is
+   * scanned once per mount and the count is then kept current as
+   * clusters are allocated and freed.
+   * \return the free cluster count.
+   */
   uint32_t freeClusterCount();
 
+  /** Provide memory for a free space index. The index holds the free
+   * entry count of each sector of the FAT or exFAT bitmap and is built
+   * by the next freeClusterCount() scan. It keeps the free count current
+   * without reading back each FAT or bitmap sector that is written.
+   * allocContiguous() needs it on FAT16/FAT32.
+   *
+   * \param[in] index Array of at least freeIndexSize() entries or
+   *            nullptr to stop using an index.
+   * \param[in] size Number of entries in index.
+   * \return true if the index will be used for this volume.
+   */
+  bool setFreeIndex(uint16_t* index, uint32_t size);
+  /** \return Index entries needed for this volume, zero for FAT12. */
+  uint32_t freeIndexSize() {
+    return m_tracker.indexSize();
+  }
+  /** Allocate a run of contiguous clusters with the free space index.
+   * The run is linked into a chain in each FAT but not attached to a file.
+   *
+   * \param[in] count Number of clusters needed.
+   * \param[out] firstCluster First cluster of the chain.
+   * \return true for success or false for failure.
+   */
+  bool allocContiguous(uint32_t count, uint32_t* firstCluster);
+  /** Free a chain from allocContiguous() that was not attached to a file.
+   *
+   * \param[in] count Number of clusters in the chain.
+   * \param[in] firstCluster First cluster of the chain.
+   * \return true for success or false for failure.
+   */
+  bool freeContiguous(uint32_t count, uint32_t firstCluster);
+  /** Discard clusters on the drive as they are freed. Ranges freed by
+   * remove(), truncate() and rmdir() are batched and sent with SCSI UNMAP
+   * at the next sync, so a flash drive can erase them before they are
+   * needed again. Each FAT or bitmap write then costs one extra read.
+   * begin() turns discard off.
+   *
+   * \param[in] enable true to start, false to stop.
+   * \return true if discard is on. False if the volume is not on a USB
+   *         drive, the drive rejected UNMAP or the volume is FAT12.
+   */
+  bool setDiscard(bool enable);
+  /** Discard every free cluster on the volume, for a drive that was used
+   * without setDiscard(). Uses the freeClusterCount() scan and may take
+   * a while on a large, fragmented volume.
+   *
+   * \return true for success or false for failure.
+   */
+  bool discardFreeSpace();
+  /** Provide memory for a directory lookup index. The first lookup of a
+   * path in a directory reads the whole directory once and stores a hash
+   * of each name. Later opens, exists() and remove() in that directory
+   * cost a hash probe and a read of the entry. Names created, renamed
+   * and removed through this volume and its files keep the index
+   * current. Up to PFS_DIR_INDEX_DIRS directories are indexed at once.
+   *
+   * Paths relative to a working directory set with chdir(path) are
+   * looked up without the index. Changes made directly through
+   * getFatVol() or getExFatVol() are not seen by the index.
+   *
+   * \param[in] table Array of slots, about one and a half times the number
+   *            of names to index, or nullptr to stop using an index.
+   * \param[in] size Number of slots in table.
+   * \return true if the index will be used for this volume.
+   */
+  bool setDirIndex(PFsDirSlot_t* table, uint32_t size);
+
   // Only valid for Fat32
   uint32_t getFSInfoSectorFreeClusterCount();
   bool setUpdateFSInfoSectorFreeClusterCount(uint32_t free_count = (uint32_t)-1);
@@ -208,10 +343,7 @@ class PFsVolume {
    *
    * \return true for success or false for failure.
    */
-  bool mkdir(const char *path, bool pFlag = true) {
-    return m_fVol ? m_fVol->mkdir(path, pFlag) :
-           m_xVol ? m_xVol->mkdir(path, pFlag) : false;
-  }
+  bool mkdir(const char *path, bool pFlag = true);
   /** open a file
    *
    * \param[in] path location of file to be opened.
@@ -225,10 +357,7 @@ class PFsVolume {
   *
    * \return true for success or false for failure.
   */
-  bool remove(const char *path) {
-    return m_fVol ? m_fVol->remove(path) :
-           m_xVol ? m_xVol->remove(path) : false;
-  }
+  bool remove(const char *path);
   /** Rename a file or subdirectory.
    *
    * \param[in] oldPath Path name to the file or subdirectory to be renamed.
@@ -243,10 +372,7 @@ class PFsVolume {
    *
    * \return true for success or false for failure.
    */
-  bool rename(const char *oldPath, const char *newPath) {
-    return m_fVol ? m_fVol->rename(oldPath, newPath) :
-           m_xVol ? m_xVol->rename(oldPath, newPath) : false;
-  }
+  bool rename(const char *oldPath, const char *newPath);
   /** Remove a subdirectory from the volume's root directory.
    *
    * \param[in] path A path with a valid 8.3 DOS name for the subdirectory.
@@ -255,10 +381,7 @@ class PFsVolume {
    *
    * \return true for success or false for failure.
    */
-  bool rmdir(const char *path) {
-    return m_fVol ? m_fVol->rmdir(path) :
-           m_xVol ? m_xVol->rmdir(path) : false;
-  }
+  bool rmdir(const char *path);
   /** \return The volume's cluster size in sectors. */
   uint32_t sectorsPerCluster() const {
     return m_fVol ? m_fVol->sectorsPerCluster() :
@@ -426,12 +549,40 @@ class PFsVolume {
   static PFsVolume* cwv() {return m_cwv;}
   PFsVolume(const PFsVolume& from);
   PFsVolume& operator=(const PFsVolume& from);
+  bool exFatBitmapStart(uint32_t* sector);
+  void dirIndexDrop(PFsBaseFile* dir, const char* path = "");
+  bool exFatFind(PFsBaseFile* dir, const char* name, size_t len,
+                 uint32_t hash, uint32_t* index);
+  bool findName(PFsBaseFile* dir, const char* name, uint32_t* index);
+  int readDir(PFsBaseFile* dir, PFsDirEnt_t* ents, size_t count);
+  int indexDir(PFsBaseFile* dir, uint32_t key);
+  bool lookupName(PFsBaseFile* dir, const char* name, size_t len,
+                  oflag_t oflag, PFsBaseFile* file);
+  bool lookupOpen(PFsBaseFile* dir, const char* path, oflag_t oflag,
+                  PFsBaseFile* file);
+  bool lookupEnabled() const {
+    return PFS_DENTRY_CACHE > 0 || m_dirIndex.enabled();
+  }
+  // Relative paths are resolved here only when they start at the root.
+  bool useLookup(const char* path) const {
+    return lookupEnabled() && (*path == '/' || m_vwdRoot);
+  }
+  bool walk(PFsBaseFile* dir, const char** path, size_t* len,
+            PFsBaseFile* parent);
+  bool mount(bool setCwv, uint8_t part);
+  bool syncCaches();
+  bool reloadFat();
+  uint32_t scanFreeClusterCount(bool discard = false);
 
   static PFsVolume* m_cwv;
   FatVolume*   m_fVol = nullptr;
   ExFatVolume* m_xVol = nullptr;
   BlockDevice* m_blockDev;
   USBMSCDevice* m_usmsci = nullptr;
+  PFsAllocTracker m_tracker;
+  PFsDentryCache m_dentries;
+  PFsDirIndex m_dirIndex;
+  bool m_vwdRoot = true;
   uint8_t m_part;
 
 };
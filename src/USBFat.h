@@ -31,6 +31,8 @@
  */
 #include "USBHost_t36.h"
 #include "USBmsc.h"
+#include "USBmscCache.h"
+#include "USBmscScheduler.h"
 #include "PFsLib/PFsLib.h"
 
 //------------------------------------------------------------------------------
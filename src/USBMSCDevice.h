@@ -31,9 +31,172 @@
 #include "USBmscInterface.h"
 #include "USBHost_t36.h"
 
+/** Number of transfers that can be queued with readSectorsAsync() and
+ * writeSectorsAsync(). Must be a power of two.
+ */
+#ifndef MSC_ASYNC_QUEUE_SIZE
+#define MSC_ASYNC_QUEUE_SIZE 4
+#endif
+
+/** Number of USBMSCDevice instances serviced by pollAll(). */
+#ifndef MSC_MAX_DEVICES
+#define MSC_MAX_DEVICES 4
+#endif
+
+/** Set nonzero to count commands and keep latency histograms in each
+ * USBMSCDevice. When zero the counters take no memory and no time.
+ */
+#ifndef MSC_STATS
+#define MSC_STATS 0
+#endif
+
+/** Number of latency histogram buckets. Bucket i counts commands that
+ * took 2^i to 2^(i+1) - 1 microseconds. Bucket 0 also counts 0 and the
+ * last bucket also counts longer commands.
+ */
+#define MSC_STATS_BUCKETS 24
+
+/** Set nonzero for unmapSectors(). It needs a USBHost_t36 patched to make
+ * msController::msDoCommand() public, it is private in the stock library.
+ */
+#ifndef MSC_UNMAP
+#define MSC_UNMAP 0
+#endif
+
+/** Largest number of drive blocks in one UNMAP command. */
+#ifndef MSC_UNMAP_MAX_BLOCKS
+#define MSC_UNMAP_MAX_BLOCKS 0XFFFF
+#endif
+
+/** Largest number of drive blocks in one READ or WRITE command, at most
+ * 0XFFFF. Longer transfers are split. A drive's Block Limits VPD page can
+ * lower it.
+ */
+#ifndef MSC_MAX_TRANSFER_BLOCKS
+#define MSC_MAX_TRANSFER_BLOCKS 0XFFFF
+#endif
+
+/** Set nonzero to read the Block Limits VPD page when a drive connects.
+ * It needs msDoCommand() like MSC_UNMAP.
+ */
+#ifndef MSC_BLOCK_LIMITS
+#define MSC_BLOCK_LIMITS MSC_UNMAP
+#endif
+
+/** Set nonzero for SYNCHRONIZE CACHE in syncDevice(), write cache
+ * control and the write protect check when a drive connects. They need
+ * msDoCommand() like MSC_UNMAP.
+ */
+#ifndef MSC_CACHE_CONTROL
+#define MSC_CACHE_CONTROL MSC_UNMAP
+#endif
+
+/** Set nonzero for drives past 32-bit block addresses, 2 TB of 512 byte
+ * blocks. They are sized with READ CAPACITY(16) and blocks past the
+ * limit use READ(16) and WRITE(16). They need msDoCommand() like
+ * MSC_UNMAP.
+ */
+#ifndef MSC_LBA64
+#define MSC_LBA64 MSC_UNMAP
+#endif
+
+/** Transfer size, in 512 byte sectors, suggested by
+ * optimalTransferSectors() for drives that do not report one.
+ */
+#ifndef MSC_OPTIMAL_TRANSFER_SECTORS
+#define MSC_OPTIMAL_TRANSFER_SECTORS 128
+#endif
+
+/** Timed writes per profileDrive() measurement, the fastest counts. */
+#ifndef MSC_PROFILE_REPS
+#define MSC_PROFILE_REPS 4
+#endif
+
+/** Largest allocation unit profileDrive() looks for, in sectors. */
+#ifndef MSC_PROFILE_MAX_AU
+#define MSC_PROFILE_MAX_AU 0X8000
+#endif
+
+/** Number of drive commands kept in the trace ring of each USBMSCDevice,
+ * a power of two. Zero, the default, compiles the trace out.
+ */
+#ifndef MSC_TRACE
+#define MSC_TRACE 0
+#endif
+
+/** One drive command in the trace ring, 20 bytes. */
+typedef struct {
+  uint32_t start;     // micros() when the command was issued
+  uint32_t end;       // micros() when it completed
+  uint32_t lba;       // first drive block, low 32 bits
+  uint16_t blocks;    // number of drive blocks
+  uint8_t  opcode;    // SCSI opcode, 0X28 READ(10), 0X2A WRITE(10), 0X42 UNMAP
+  uint8_t  status;    // MS_CBW_PASS or the error code
+  uint8_t  senseKey;  // sense data if status is not MS_CBW_PASS
+  uint8_t  asc;
+  uint8_t  ascq;
+  uint8_t  reserved;
+} msTraceEntry_t;
+
+/** Block layer counters, see USBMSCDevice::stats(). */
+typedef struct {
+  uint32_t commands;
+  uint32_t sectorsRead;
+  uint32_t sectorsWritten;
+  uint32_t sectorsUnmapped;
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+  uint32_t errors;
+  uint32_t senseKeyErrors[16];
+  uint32_t retries;
+  uint32_t reconnects;
+  uint32_t readMicros[MSC_STATS_BUCKETS];
+  uint32_t writeMicros[MSC_STATS_BUCKETS];
+} msStats_t;
+
+/** Flash geometry measured by USBMSCDevice::profileDrive(). Sizes are in
+ * 512 byte sectors, zero where it could not be told.
+ */
+typedef struct {
+  uint32_t pageSectors;    // smallest write that runs at full speed
+  uint32_t auSectors;      // allocation unit, writes across one are slow
+  uint32_t alignedKBps;    // pageSectors writes on a page boundary
+  uint32_t unalignedKBps;  // the same writes half a page off
+} msDriveProfile_t;
+
+/** Completion callback for a queued transfer.
+ * \param[in] token Value passed when the transfer was queued, may hold
+ *            a pointer.
+ * \param[in] status MS_CBW_PASS for success else an error code.
+ */
+typedef void (*msAsyncCallback_t)(uintptr_t token, uint8_t status);
+
+/** Per sector callback for USBMSCDevice::readSectorsWithCallback().
+ * \param[in] token Value passed with the read, may hold a pointer.
+ * \param[in] data The sector, only valid during the call.
+ */
+typedef void (*msSectorCallback_t)(uintptr_t token, uint8_t* data);
+
+/** A queued sector transfer. */
+typedef struct {
+  uint32_t sector;
+  uint8_t* buf;
+  size_t   ns;
+  msAsyncCallback_t callback;
+  uintptr_t token;
+  uint32_t generation;
+  bool     write;
+} msAsyncRequest_t;
+
 /**
  * \class USBMSCDevice
  * \brief Raw USB Drive accesss.
+ *
+ * The device always has 512 byte sectors. Drives with larger blocks,
+ * such as 4Kn SSDs, are translated. Whole aligned blocks pass straight
+ * through, partial blocks are read-modify-written through a one block
+ * cache. Format such drives with clusters aligned to the block size so
+ * file data rarely takes the slow path.
  */
 class USBMSCDevice : public USBmscInterface {
  public:
@@ -42,7 +205,16 @@ class USBMSCDevice : public USBmscInterface {
    * \return true for success or false for failure.
    */
   bool begin(msController *pDrive);
+  /** \return number of 512 byte sectors on the drive, at most
+   * 0XFFFFFFFF. Use sectorCount64() for drives over 2 TB.
+   */
   uint32_t sectorCount();
+  /** \return number of 512 byte sectors on the drive. */
+  uint64_t sectorCount64();
+  /** \return number of 512 byte sectors in a drive block, 1 for
+   * 512 byte drives and 8 for 4Kn drives.
+   */
+  uint8_t sectorsPerBlock() const {return 1 << m_blockShift;}
   /**
    * \return code for the last error. See USBmscInfo.h for a list of error codes.
    */
@@ -98,10 +270,48 @@ class USBMSCDevice : public USBmscInterface {
    * \return true for success or false for failure.
    */
   bool readSectors(uint32_t sector, uint8_t* dst, size_t ns);
+  /**
+   * Read multiple 512 byte sectors with a 64-bit sector address.
+   *
+   * \param[in] sector Logical sector to be read.
+   * \param[out] dst Pointer to the location that will receive the data.
+   * \param[in] ns Number of sectors to be read.
+   * \return true for success or false for failure.
+   */
+  bool readSectors64(uint64_t sector, uint8_t* dst, size_t ns);
   /** \return USB MSC drive status. */
   uint32_t status();
-  /** \return success if sync successful. Not for user apps. */
+  /** Make every completed write durable. If there were writes since the
+   * last sync, SYNCHRONIZE CACHE is sent unless the drive reported its
+   * write cache off. Drives that reject it have nothing to flush.
+   * Queued transfers run first, and it fails if a queued write failed
+   * since the last wait() or syncDevice().
+   * \return true for success or false for failure.
+   */
   bool syncDevice();
+  /** \return true if the drive has a Caching mode page, so
+   * setWriteCache() can be used.
+   */
+  bool writeCacheControl() const {return m_cachePage;}
+  /** \return true if the drive's volatile write cache is on. Writes are
+   * then only safe from power loss after syncDevice().
+   */
+  bool writeCacheEnabled() const {return m_writeCache;}
+  /**
+   * Turn the drive's volatile write cache on or off with MODE SELECT.
+   * With it on, writes complete sooner but are only durable after
+   * syncDevice(), which volumes call from sync() and close().
+   *
+   * \param[in] enable Write cache enable bit.
+   * \param[in] save Also make it the drive's power on setting, not all
+   *            drives can.
+   * \return true for success or false for failure.
+   */
+  bool setWriteCache(bool enable, bool save = false);
+  /** \return true if the drive reported write protect when it connected,
+   * or a write failed with DATA PROTECT. Writes then fail at once.
+   */
+  bool writeProtected() const {return m_writeProtected;}
   /**
    * Writes a 512 byte sector to an USB MSC drive.
    *
@@ -119,6 +329,49 @@ class USBMSCDevice : public USBmscInterface {
    * \return true for success or false for failure.
    */
   bool writeSectors(uint32_t sector, const uint8_t* src, size_t ns);
+  /**
+   * Write multiple 512 byte sectors with a 64-bit sector address.
+   *
+   * \param[in] sector Logical sector to be written.
+   * \param[in] src Pointer to the location of the data to be written.
+   * \param[in] ns Number of sectors to be written.
+   * \return true for success or false for failure.
+   */
+  bool writeSectors64(uint64_t sector, const uint8_t* src, size_t ns);
+  /**
+   * Tell the drive a range of sectors no longer holds data, with SCSI
+   * UNMAP, so a flash drive can erase them ahead of the next write. Only
+   * whole drive blocks inside the range are unmapped. Their contents are
+   * undefined afterwards.
+   *
+   * \param[in] sector First sector of the range.
+   * \param[in] ns Number of sectors in the range.
+   * \return true for success or false for failure, including a drive
+   *         that does not support UNMAP.
+   */
+  bool unmapSectors(uint64_t sector, uint64_t ns);
+  /** \return false once the drive has rejected UNMAP. Checked again
+   * after the drive is reconnected.
+   */
+  bool unmapSupported() const {return MSC_UNMAP && m_unmapSupported;}
+  /** \return Largest number of sectors sent in one drive command, longer
+   * transfers are split. Read from the drive's Block Limits VPD page
+   * when it connects, if it has one, and at most MSC_MAX_TRANSFER_BLOCKS.
+   */
+  uint32_t maxTransferSectors() const {return m_maxBlocks << m_blockShift;}
+  /** \return Transfer size in sectors the drive handles best, a multiple
+   * of transferGranularity(). Size buffers for long transfers to it.
+   * MSC_OPTIMAL_TRANSFER_SECTORS if the drive does not report one.
+   */
+  uint32_t optimalTransferSectors() const {
+    return m_optimalBlocks << m_blockShift;
+  }
+  /** \return Transfers that are a multiple of this many sectors, and start
+   * on one, avoid a penalty on the drive. Never less than sectorsPerBlock().
+   */
+  uint32_t transferGranularity() const {
+    return m_granularity << m_blockShift;
+  }
 
   /**
    * Read multiple 512 byte sectors from an USB MSC drive, using 
@@ -130,10 +383,297 @@ class USBMSCDevice : public USBmscInterface {
    * \return true for success or false for failure.
    */
   bool readSectorsWithCB(uint32_t sector, size_t ns, void (*callback)(uint32_t, uint8_t *), uint32_t token);
+  /**
+   * Same as readSectorsWithCB() with a token that can hold a pointer on
+   * any host. The drive must have been started with begin().
+   *
+   * \param[in] sector Logical sector to be read.
+   * \param[in] ns Number of sectors to be read.
+   * \param[in] callback function to call for each sector read.
+   * \param[in] token Value passed to callback.
+   * \return true for success or false for failure.
+   */
+  bool readSectorsWithCallback(uint32_t sector, size_t ns,
+                               msSectorCallback_t callback, uintptr_t token);
 
+  /**
+   * Queue a read of multiple 512 byte sectors.
+   *
+   * This is a deferred queue, not a background transfer. msController
+   * transfers block, so poll() or wait() runs each queued transfer to
+   * completion in the caller before returning. The queue takes requests
+   * from one producer only. That may be an interrupt handler while
+   * loop() calls poll(), but two contexts must not queue to the same
+   * drive. A transfer fails with MS_NO_MEDIA_ERR, without being sent, if the
+   * generation() changes before it starts.
+   *
+   * \param[in] sector Logical sector to be read.
+   * \param[out] dst Pointer to the location that will receive the data.
+   * \param[in] ns Number of sectors to be read.
+   * \param[in] callback Optional function called when the read completes.
+   * \param[in] token Value passed to callback.
+   * \return true if queued or false if the queue is full.
+   */
+  bool readSectorsAsync(uint32_t sector, uint8_t* dst, size_t ns,
+                        msAsyncCallback_t callback = nullptr, uintptr_t token = 0);
+  /**
+   * Queue a write of multiple 512 byte sectors.
+   *
+   * The data in src must not change until the transfer completes.
+   *
+   * \param[in] sector Logical sector to be written.
+   * \param[in] src Pointer to the location of the data to be written.
+   * \param[in] ns Number of sectors to be written.
+   * \param[in] callback Optional function called when the write completes.
+   * \param[in] token Value passed to callback.
+   * \return true if queued or false if the queue is full.
+   */
+  bool writeSectorsAsync(uint32_t sector, const uint8_t* src, size_t ns,
+                         msAsyncCallback_t callback = nullptr, uintptr_t token = 0);
+  /** \return number of queued transfers that have not completed. */
+  uint8_t asyncPending() const {
+    return (uint8_t)(m_asyncHead - m_asyncTail);
+  }
+  /** \return true if another transfer can be queued. */
+  bool asyncReady() const {
+    return asyncPending() < MSC_ASYNC_QUEUE_SIZE;
+  }
+  /**
+   * Run the oldest queued transfer and call its completion callback.
+   * Blocks until the transfer is done.
+   *
+   * \return true if more transfers are queued.
+   */
+  bool poll();
+  /**
+   * Run all queued transfers.
+   *
+   * \return true if every transfer since the last wait() succeeded.
+   */
+  bool wait();
+  /**
+   * Call poll() for every drive started with begin().
+   *
+   * Drives busy in a command are skipped. msController waits for a
+   * transfer in yield(), and pollAll() may be called from there, but that
+   * does not overlap transfers: the other drive's transfer runs nested
+   * inside the wait, and the waiting caller resumes only after it has
+   * completed. Use pollAll() to keep several drives fed from loop().
+   *
+   * \return true if any drive has more transfers queued.
+   */
+  static bool pollAll();
+  /**
+   * Run all queued transfers on every drive.
+   *
+   * \return true if every transfer since the last wait() succeeded.
+   */
+  static bool waitAll();
+  /**
+   * The generation changes each time the drive is detached or reports a
+   * media change. Compare it with a saved value to find out if cached
+   * data and open files still belong to the media in the drive. Call
+   * connect() before saving it, so a loss not seen yet does not change
+   * it later.
+   *
+   * \return connection generation.
+   */
+  uint32_t generation() const {return m_generation;}
+  /**
+   * Settle the connection state. A replug or media change not seen yet
+   * is reported first, then the drive is initialized again.
+   *
+   * \return true if the drive is connected.
+   */
+  bool connect() {return checkConnection() || checkConnection();}
+  /** \return true if the drive was connected at the last transfer. */
+  bool connected() const {return m_connected;}
+  /**
+   * Copy the block layer counters. Sectors count 512 byte sectors asked
+   * for, bytes count data moved to or from the drive, which is larger
+   * for partial blocks on 4Kn drives.
+   *
+   * \param[out] snapshot Location for the counters.
+   * \param[in] reset Clear the counters after the copy.
+   * \return true for success or false if MSC_STATS is zero.
+   */
+  bool stats(msStats_t* snapshot, bool reset = false);
+  /** Clear the block layer counters. */
+  void resetStats();
+  /** Print the block layer counters and latency histograms.
+   * \param[in] pr Print device for the report.
+   */
+  void printStats(Print* pr);
+  /**
+   * Copy the trace ring, oldest command first.
+   *
+   * \param[out] dst Location for the entries.
+   * \param[in] max Number of entries dst holds.
+   * \return number of entries copied, zero if MSC_TRACE is zero.
+   */
+  uint32_t readTrace(msTraceEntry_t* dst, uint32_t max);
+  /** \return number of commands traced since traceClear(), including
+   * ones that have been overwritten.
+   */
+  uint32_t traceCount() const;
+  /** Empty the trace ring. */
+  void traceClear();
+  /**
+   * Print the trace ring, oldest command first, in the text format read
+   * by extras/MscTrace/MscTraceDecode and MscTraceTimeline.
+   *
+   * \param[in] pr Print device for the dump.
+   */
+  void traceDump(Print* pr);
+  /**
+   * Measure the flash geometry the drive hides behind its sectors.
+   *
+   * Aligned writes from one drive block up to the buffer size find the
+   * smallest write that reaches full speed, the page. Writes of two pages
+   * straddling a boundary of each power of two size are then timed
+   * against writes of two pages centered in the same span. Only the
+   * allocation unit size gives straddling writes a much higher cost.
+   *
+   * Each timed write puts back the data just read from the same sectors,
+   * so nothing changes but the drive's wear. A region of free space is
+   * still the safest choice. The region must hold at least 4 buffers, and
+   * three times the largest allocation unit to be found.
+   *
+   * \param[in] buf Scratch buffer, 64 KB or more gives good results.
+   * \param[in] size Size of buf in bytes.
+   * \param[in] sector First sector of the region used.
+   * \param[in] ns Number of sectors in the region.
+   * \return true for success or false for failure.
+   */
+  bool profileDrive(uint8_t* buf, size_t size, uint32_t sector, uint32_t ns);
+  /** \return The last profileDrive() result, all zero before the first
+   * and after the drive is reconnected.
+   */
+  const msDriveProfile_t& profile() const {return m_profile;}
+
+  ~USBMSCDevice() {
+    removeDevice(this);
+    free(m_block);
+  }
 
 private:
-  msController *thisDrive;
+  // Only an integer test while the drive stays attached. The host driver
+  // clears initialized on detach and it stays clear after a new attach
+  // until checkConnectedInitialized(), so a quick replug is seen too.
+  bool checkConnection() {
+    return (m_connected && thisDrive->msDriveInfo.initialized) ||
+           updateConnection();
+  }
+  bool updateConnection();
+  bool transferDone(uint8_t status);
+  bool retryCommand(uint8_t status, bool* retried);
+  bool setBlockSize(uint32_t blockSize);
+  void readCapacity16();
+  bool readBlocks(uint64_t block, uint8_t* dst, uint32_t count);
+  bool writeBlocks(uint64_t block, const uint8_t* src, uint32_t count);
+  uint8_t rw16(uint8_t opcode, uint64_t block, uint32_t count, void* buf);
+  bool readBlocksWithCB(uint32_t block, uint32_t count,
+                        void (*callback)(uint32_t, uint8_t *), uint32_t token);
+  bool unmapBlocks(uint64_t block, uint32_t count);
+  uint8_t scsiCommand(const uint8_t* cdb, uint8_t cdbLength, void* buf,
+                      uint32_t length, bool dataIn, uint64_t block = 0,
+                      uint32_t blocks = 0);
+  bool inquiryVpd(uint8_t page, uint8_t* buf, uint8_t len);
+  bool modeSense(uint8_t* buf, uint8_t len);
+  void readModePages();
+  bool checkWritable() {
+    if (m_writeProtected) {
+      m_errorCode = MS_CMD_ERR;
+      return false;
+    }
+    return true;
+  }
+  void readBlockLimits();
+  bool timeRewrite(uint32_t sector, uint32_t stride, uint32_t end,
+                   uint8_t* buf, uint32_t ns, uint32_t* fastest);
+  // Every drive command is bracketed by commandStart() and commandDone(),
+  // poll() reached from yield() inside one must not start another.
+  uint32_t commandStart() {
+    m_inCommand = true;
+#if MSC_STATS || MSC_TRACE
+    return micros();
+#else  // MSC_STATS || MSC_TRACE
+    return 0;
+#endif  // MSC_STATS || MSC_TRACE
+  }
+  void commandDone(uint8_t opcode, uint64_t block, uint32_t blocks,
+                   uint8_t status, uint32_t start);
+  bool loadBlock(uint64_t block);
+  bool checkRange(uint64_t sector, uint64_t ns);
+  bool readTranslated(uint64_t sector, uint8_t* dst, size_t ns);
+  bool writeTranslated(uint64_t sector, const uint8_t* src, size_t ns);
+  bool readTranslatedWithCB(uint32_t sector, size_t ns,
+                            void (*callback)(uint32_t, uint8_t *),
+                            uint32_t token);
+  void mediaGone(uint8_t code);
+  // Run queued transfers ahead of a direct one. Failures stay recorded
+  // for wait(), and for syncDevice() if a write failed.
+  void drain() {
+    if (!m_asyncActive) {
+      while (poll()) {}
+    }
+  }
+  bool queueAsync(uint32_t sector, uint8_t* buf, size_t ns, bool write,
+                  msAsyncCallback_t callback, uintptr_t token);
+  bool setSdErrorCode(uint8_t code, uint32_t line) {
+    m_errorCode = code;
+    m_errorLine = line;
+    return false;
+  }
+  static void addDevice(USBMSCDevice* dev);
+  static void removeDevice(USBMSCDevice* dev);
+
+  static USBMSCDevice* m_devices[MSC_MAX_DEVICES];
+  static void slotCB(uint32_t slot, uint8_t* data);
+  static void splitBlockCB(uint32_t slot, uint8_t* data);
+  int8_t slot() const;
+
+  msController *thisDrive = nullptr;
+  bool (*m_busyFcn)() = nullptr;
+  bool m_initDone = false;
+  bool m_connected = false;
+  bool m_unmapSupported = true;
+  bool m_writeProtected = false;
+  bool m_cachePage = false;
+  bool m_writeCache = false;
+  bool m_syncSupported = true;
+  bool m_unsynced = false;
+  volatile uint32_t m_generation = 0;
+  static const uint64_t NO_BLOCK = ~(uint64_t)0;
+  uint8_t m_blockShift = 0;
+  uint8_t* m_block = nullptr;
+  uint32_t m_blockSize = 0;
+  uint64_t m_blockNumber = NO_BLOCK;
+  uint64_t m_blockCount = 0;
+  uint32_t m_maxBlocks = MSC_MAX_TRANSFER_BLOCKS;
+  uint32_t m_optimalBlocks = 1;
+  uint32_t m_granularity = 1;
+  msDriveProfile_t m_profile = {};
+#if MSC_STATS
+  msStats_t m_stats = {};
+#endif  // MSC_STATS
+#if MSC_TRACE
+  msTraceEntry_t m_trace[MSC_TRACE];
+  uint32_t m_traceCount = 0;
+#endif  // MSC_TRACE
+  uint8_t m_errorCode = MS_NO_MEDIA_ERR;
+  uint32_t m_errorLine = 0;
+  msAsyncRequest_t m_asyncQueue[MSC_ASYNC_QUEUE_SIZE];
+  volatile uint8_t m_asyncHead = 0;
+  volatile uint8_t m_asyncTail = 0;
+  bool m_asyncActive = false;
+  volatile bool m_inCommand = false;
+  uint8_t m_asyncError = MS_CBW_PASS;
+  uint8_t m_asyncWriteError = MS_CBW_PASS;
+  msSectorCallback_t m_slotCallback = nullptr;
+  uintptr_t m_slotToken = 0;
+  void (*m_splitCallback)(uint32_t, uint8_t *) = nullptr;
+  uint32_t m_splitToken = 0;
 };
 //#endif // HAS_USB_MSC_CLASS
 #endif  // USBmscDevice_h
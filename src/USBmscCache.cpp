@@ -0,0 +1,328 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "USBmscCache.h"
+
+//------------------------------------------------------------------------------
+bool USBmscSectorCache::begin(BlockDeviceInterface* dev, uint8_t* cacheBuf,
+                              msCacheEntry_t* entries, uint16_t sets,
+                              uint8_t ways, USBMSCDevice* usb) {
+  if (!dev || !cacheBuf || !entries || !sets || !ways) {
+    return false;
+  }
+  m_dev = dev;
+  m_usb = usb;
+  if (usb) {
+    usb->connect();
+  }
+  m_generation = usb ? usb->generation() : 0;
+  m_buf = cacheBuf;
+  m_entries = entries;
+  m_sets = sets;
+  m_ways = ways;
+  m_useCount = 0;
+  m_hits = 0;
+  m_misses = 0;
+  m_writeBacks = 0;
+  invalidate();
+  return true;
+}
+
+//------------------------------------------------------------------------------
+void USBmscSectorCache::invalidate() {
+  for (uint32_t i = 0; i < (uint32_t)m_sets*m_ways; i++) {
+    m_entries[i].flags = 0;
+    m_entries[i].lastUse = 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+bool USBmscSectorCache::fenced() {
+  if (m_usb && m_usb->generation() != m_generation) {
+    // Cached sectors belong to media that is gone.
+    invalidate();
+    return true;
+  }
+  return false;
+}
+
+//------------------------------------------------------------------------------
+msCacheEntry_t* USBmscSectorCache::find(uint32_t sector, uint8_t* way) {
+  uint16_t set = sector % m_sets;
+  for (uint8_t w = 0; w < m_ways; w++) {
+    msCacheEntry_t* e = entry(set, w);
+    if ((e->flags & MSC_CACHE_VALID) && e->sector == sector) {
+      *way = w;
+      return e;
+    }
+  }
+  return nullptr;
+}
+
+//------------------------------------------------------------------------------
+// Pick a slot for sector, writing back the victim if it is dirty.
+msCacheEntry_t* USBmscSectorCache::allocate(uint32_t sector, uint8_t* way) {
+  uint16_t set = sector % m_sets;
+  uint8_t victim = 0;
+  uint32_t oldest = 0;
+  msCacheEntry_t* e;
+
+  // Keep runs of consecutive sectors in one way so they flush together.
+  if (set) {
+    for (uint8_t w = 0; w < m_ways; w++) {
+      e = entry(set - 1, w);
+      if ((e->flags & MSC_CACHE_VALID) && e->sector == (sector - 1)) {
+        if (!(entry(set, w)->flags & MSC_CACHE_DIRTY)) {
+          victim = w;
+          goto found;
+        }
+        break;
+      }
+    }
+  }
+  // Otherwise use a free slot or the least recently used one.
+  for (uint8_t w = 0; w < m_ways; w++) {
+    e = entry(set, w);
+    if (!(e->flags & MSC_CACHE_VALID)) {
+      victim = w;
+      goto found;
+    }
+    uint32_t age = m_useCount - e->lastUse;
+    if (age >= oldest) {
+      oldest = age;
+      victim = w;
+    }
+  }
+
+ found:
+  e = entry(set, victim);
+  if ((e->flags & MSC_CACHE_DIRTY) && !flushRun(set, victim)) {
+    return nullptr;
+  }
+  e->sector = sector;
+  e->flags = 0;
+  e->lastUse = ++m_useCount;
+  *way = victim;
+  return e;
+}
+
+//------------------------------------------------------------------------------
+// Exchange two slots of a set, entry and data.
+void USBmscSectorCache::swap(uint16_t set, uint8_t way1, uint8_t way2) {
+  uint8_t tmp[512];
+  msCacheEntry_t e = *entry(set, way1);
+  *entry(set, way1) = *entry(set, way2);
+  *entry(set, way2) = e;
+  memcpy(tmp, data(set, way1), 512);
+  memcpy(data(set, way1), data(set, way2), 512);
+  memcpy(data(set, way2), tmp, 512);
+}
+
+//------------------------------------------------------------------------------
+// Write the dirty sector at set/way plus any dirty neighbors that are
+// consecutive on the drive with one device write. Neighbors held in
+// another way are first swapped into this way so the run is contiguous
+// in RAM.
+bool USBmscSectorCache::flushRun(uint16_t set, uint8_t way) {
+  uint32_t sector = entry(set, way)->sector;
+  uint16_t first = set;
+  uint16_t last = set;
+  msCacheEntry_t* e;
+  uint8_t w;
+
+  while (first > 0) {
+    e = find(sector - (set - first) - 1, &w);
+    if (!e || !(e->flags & MSC_CACHE_DIRTY)) {
+      break;
+    }
+    first--;
+    if (w != way) {
+      swap(first, w, way);
+    }
+  }
+  while ((last + 1) < m_sets) {
+    e = find(sector + (last - set) + 1, &w);
+    if (!e || !(e->flags & MSC_CACHE_DIRTY)) {
+      break;
+    }
+    last++;
+    if (w != way) {
+      swap(last, w, way);
+    }
+  }
+  if (!m_dev->writeSectors(entry(first, way)->sector, data(first, way),
+                           last - first + 1)) {
+    return false;
+  }
+  m_writeBacks++;
+  for (uint16_t s = first; s <= last; s++) {
+    entry(s, way)->flags &= ~MSC_CACHE_DIRTY;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Write back in LBA order, lowest dirty sector first.
+bool USBmscSectorCache::flush() {
+  if (fenced()) {
+    return false;
+  }
+  for (;;) {
+    msCacheEntry_t* low = nullptr;
+    uint32_t lowIndex = 0;
+    for (uint32_t i = 0; i < (uint32_t)m_sets*m_ways; i++) {
+      msCacheEntry_t* e = &m_entries[i];
+      if ((e->flags & MSC_CACHE_DIRTY) && (!low || e->sector < low->sector)) {
+        low = e;
+        lowIndex = i;
+      }
+    }
+    if (!low) {
+      return true;
+    }
+    if (!flushRun(lowIndex % m_sets, lowIndex/m_sets)) {
+      return false;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+bool USBmscSectorCache::isBusy() {
+  return m_dev->isBusy();
+}
+
+//------------------------------------------------------------------------------
+uint32_t USBmscSectorCache::sectorCount() {
+  return m_dev->sectorCount();
+}
+
+//------------------------------------------------------------------------------
+bool USBmscSectorCache::syncDevice() {
+  return flush() && m_dev->syncDevice();
+}
+
+//------------------------------------------------------------------------------
+bool USBmscSectorCache::readSector(uint32_t sector, uint8_t* dst) {
+  uint8_t way;
+  msCacheEntry_t* e;
+
+  if (fenced()) {
+    return false;
+  }
+  e = find(sector, &way);
+  if (e) {
+    m_hits++;
+    e->lastUse = ++m_useCount;
+  } else {
+    m_misses++;
+    e = allocate(sector, &way);
+    if (!e || !m_dev->readSector(sector, data(sector % m_sets, way))) {
+      return false;
+    }
+    e->flags = MSC_CACHE_VALID;
+  }
+  memcpy(dst, data(sector % m_sets, way), 512);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool USBmscSectorCache::readSectors(uint32_t sector, uint8_t* dst, size_t ns) {
+  uint8_t way;
+  size_t i = 0;
+
+  if (ns == 1) {
+    return readSector(sector, dst);
+  }
+  if (fenced()) {
+    return false;
+  }
+  // Copy cached sectors, read runs of uncached sectors straight into dst.
+  while (i < ns) {
+    msCacheEntry_t* e = find(sector + i, &way);
+    if (e) {
+      memcpy(dst + 512*i, data((sector + i) % m_sets, way), 512);
+      e->lastUse = ++m_useCount;
+      m_hits++;
+      i++;
+      continue;
+    }
+    size_t n = 1;
+    while ((i + n) < ns && !find(sector + i + n, &way)) {
+      n++;
+    }
+    if (!m_dev->readSectors(sector + i, dst + 512*i, n)) {
+      return false;
+    }
+    m_misses += n;
+    i += n;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool USBmscSectorCache::writeSector(uint32_t sector, const uint8_t* src) {
+  uint8_t way;
+  msCacheEntry_t* e;
+
+  if (fenced()) {
+    return false;
+  }
+  e = find(sector, &way);
+  if (!e) {
+    e = allocate(sector, &way);
+    if (!e) {
+      return false;
+    }
+  }
+  memcpy(data(sector % m_sets, way), src, 512);
+  e->flags = MSC_CACHE_VALID | MSC_CACHE_DIRTY;
+  e->lastUse = ++m_useCount;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool USBmscSectorCache::writeSectors(uint32_t sector, const uint8_t* src,
+                                     size_t ns) {
+  uint8_t way;
+
+  if (ns == 1) {
+    return writeSector(sector, src);
+  }
+  if (fenced()) {
+    return false;
+  }
+  // Write through, then refresh any cached copies so they stay coherent.
+  if (!m_dev->writeSectors(sector, src, ns)) {
+    return false;
+  }
+  for (size_t i = 0; i < ns; i++) {
+    msCacheEntry_t* e = find(sector + i, &way);
+    if (e) {
+      memcpy(data((sector + i) % m_sets, way), src + 512*i, 512);
+      e->flags &= ~MSC_CACHE_DIRTY;
+    }
+  }
+  return true;
+}
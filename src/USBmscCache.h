@@ -0,0 +1,171 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef USBmscCache_h
+#define USBmscCache_h
+#include "SdFat.h"
+#include "USBMSCDevice.h"
+
+/** Default number of sets in a USBmscCache. */
+#ifndef USB_MSC_CACHE_SETS
+#define USB_MSC_CACHE_SETS 8
+#endif
+/** Default number of ways (sectors per set) in a USBmscCache. */
+#ifndef USB_MSC_CACHE_WAYS
+#define USB_MSC_CACHE_WAYS 4
+#endif
+
+/** Cache entry flags. */
+const uint8_t MSC_CACHE_VALID = 0X01;
+const uint8_t MSC_CACHE_DIRTY = 0X02;
+
+/** Per sector bookkeeping for USBmscSectorCache. */
+typedef struct {
+  uint32_t sector;
+  uint32_t lastUse;
+  uint8_t  flags;
+} msCacheEntry_t;
+
+/**
+ * \class USBmscSectorCache
+ * \brief N-way set associative write-back sector cache.
+ *
+ * Wraps any BlockDeviceInterface, normally a USBMSCDevice, so single
+ * sector FAT and directory accesses are served from RAM. Dirty sectors
+ * are written back when evicted or on syncDevice(). Sector n lives in
+ * set (n % sets) and the data buffer is laid out way by way, so
+ * consecutive sectors held in the same way are contiguous in RAM.
+ * Before a write back, consecutive dirty sectors found in other ways are
+ * swapped into the way being written, so each run goes to the device
+ * with a single writeSectors() call. flush() writes runs in LBA order.
+ *
+ * Multi-sector reads and writes bypass the cache so streaming file data
+ * does not evict metadata.
+ *
+ * Started with a USBMSCDevice, cached sectors are dropped instead of
+ * read or written once the drive's generation() changes, so they never
+ * reach other media.
+ */
+class USBmscSectorCache : public BlockDeviceInterface {
+ public:
+  USBmscSectorCache() {}
+  /** Attach the cache to a device.
+   *
+   * \param[in] dev Device to be cached.
+   * \param[in] cacheBuf Buffer of sets*ways*512 bytes.
+   * \param[in] entries Array of sets*ways entries.
+   * \param[in] sets Number of sets.
+   * \param[in] ways Number of sectors per set.
+   * \param[in] usb USB drive behind dev, or nullptr, for the media fence.
+   * \return true for success or false for failure.
+   */
+  bool begin(BlockDeviceInterface* dev, uint8_t* cacheBuf,
+             msCacheEntry_t* entries, uint16_t sets, uint8_t ways,
+             USBMSCDevice* usb = nullptr);
+  /** \return The cached device. */
+  BlockDeviceInterface* device() {return m_dev;}
+  /** Write all dirty sectors to the device.
+   * \return true for success or false for failure.
+   */
+  bool flush();
+  /** Drop all cached sectors. Dirty data is lost, call flush() first. */
+  void invalidate();
+  /** \return number of sector reads served from the cache. */
+  uint32_t hitCount() const {return m_hits;}
+  /** \return number of sector reads that went to the device. */
+  uint32_t missCount() const {return m_misses;}
+  /** \return number of device writes issued by flush and eviction. */
+  uint32_t writeBackCount() const {return m_writeBacks;}
+
+  // BlockDeviceInterface
+  bool isBusy();
+  bool readSector(uint32_t sector, uint8_t* dst);
+  bool readSectors(uint32_t sector, uint8_t* dst, size_t ns);
+  uint32_t sectorCount();
+  bool syncDevice();
+  bool writeSector(uint32_t sector, const uint8_t* src);
+  bool writeSectors(uint32_t sector, const uint8_t* src, size_t ns);
+
+ private:
+  uint8_t* data(uint16_t set, uint8_t way) {
+    return m_buf + ((uint32_t)way*m_sets + set)*512;
+  }
+  msCacheEntry_t* entry(uint16_t set, uint8_t way) {
+    return &m_entries[(uint32_t)way*m_sets + set];
+  }
+  bool fenced();
+  msCacheEntry_t* find(uint32_t sector, uint8_t* way);
+  msCacheEntry_t* allocate(uint32_t sector, uint8_t* way);
+  bool flushRun(uint16_t set, uint8_t way);
+  void swap(uint16_t set, uint8_t way1, uint8_t way2);
+
+  BlockDeviceInterface* m_dev = nullptr;
+  USBMSCDevice* m_usb = nullptr;
+  uint32_t m_generation = 0;
+  uint8_t* m_buf = nullptr;
+  msCacheEntry_t* m_entries = nullptr;
+  uint16_t m_sets = 0;
+  uint8_t m_ways = 0;
+  uint32_t m_useCount = 0;
+  uint32_t m_hits = 0;
+  uint32_t m_misses = 0;
+  uint32_t m_writeBacks = 0;
+};
+
+/**
+ * \class USBmscCache
+ * \brief USBmscSectorCache with its own storage.
+ *
+ * \code
+ * USBmscCache<8, 4> cache;  // 8 sets of 4 sectors, 16 KB.
+ * cache.begin(msc.usbDrive());
+ * vol.begin(&cache);
+ * \endcode
+ */
+template <uint16_t SETS = USB_MSC_CACHE_SETS, uint8_t WAYS = USB_MSC_CACHE_WAYS>
+class USBmscCache : public USBmscSectorCache {
+ public:
+  /** Attach the cache to a device.
+   * \param[in] dev Device to be cached.
+   * \return true for success or false for failure.
+   */
+  bool begin(BlockDeviceInterface* dev) {
+    return USBmscSectorCache::begin(dev, reinterpret_cast<uint8_t*>(m_buf),
+                                    m_entries, SETS, WAYS);
+  }
+  /** Attach the cache to a USB drive, cached sectors are dropped if the
+   * drive is unplugged or its media changes.
+   * \param[in] dev USB drive to be cached.
+   * \return true for success or false for failure.
+   */
+  bool begin(USBMSCDevice* dev) {
+    return USBmscSectorCache::begin(dev, reinterpret_cast<uint8_t*>(m_buf),
+                                    m_entries, SETS, WAYS, dev);
+  }
+ private:
+  uint32_t m_buf[SETS*WAYS*512/4];
+  msCacheEntry_t m_entries[SETS*WAYS];
+};
+#endif  // USBmscCache_h
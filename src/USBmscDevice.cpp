@@ -28,26 +28,34 @@
 
 //#ifdef HAS_USB_MSC_CLASS
 const uint32_t BUSY_TIMEOUT_MICROS = 1000000;
+// SCSI opcodes of the commands msController sends, for the trace.
+const uint8_t SCSI_READ_10 = 0X28;
+const uint8_t SCSI_WRITE_10 = 0X2A;
+const uint8_t SCSI_READ_16 = 0X88;
+const uint8_t SCSI_WRITE_16 = 0X8A;
+const uint8_t SCSI_SERVICE_ACTION_IN_16 = 0X9E;
+const uint8_t SA_READ_CAPACITY_16 = 0X10;
+const uint8_t SCSI_UNMAP = 0X42;
+const uint8_t SCSI_INQUIRY = 0X12;
+const uint8_t SCSI_MODE_SELECT_6 = 0X15;
+const uint8_t SCSI_MODE_SENSE_6 = 0X1A;
+const uint8_t SCSI_SYNCHRONIZE_CACHE_10 = 0X35;
+const uint8_t SENSE_ILLEGAL_REQUEST = 0X05;
+const uint8_t SENSE_UNIT_ATTENTION = 0X06;
+const uint8_t SENSE_DATA_PROTECT = 0X07;
+// Tag of commands sent with msDoCommand().
+const uint32_t CBW_TAG = 0X4D534346;
 
 //static bool yieldTimeout(bool (*fcn)()); //Not used yet, if at all
 //static bool waitTimeout(bool (*fcn)());  //Not used yet, if at all
 
-static bool m_initDone = false;
-static bool (*m_busyFcn)() = 0;
-static uint8_t m_errorCode = MS_NO_MEDIA_ERR;
-static uint32_t m_errorLine = 0;
 //static msController *thisDrive = nullptr;
-bool isBusyRead();
-bool isBusyWrite();
+
+USBMSCDevice* USBMSCDevice::m_devices[MSC_MAX_DEVICES];
 
 //==============================================================================
-// Error function and macro.
+// Error macro.
 #define sdError(code) setSdErrorCode(code, __LINE__)
-inline bool setSdErrorCode(uint8_t code, uint32_t line) {
-  m_errorCode = code;
-  m_errorLine = line;
-  return false;
-}
 
 /* Not used yet if at all
 //------------------------------------------------------------------------------
@@ -112,7 +120,32 @@ bool USBMSCDevice::readUSBDriveInfo(msDriveInfo_t * driveInfo) {
 
 //------------------------------------------------------------------------------
 bool USBMSCDevice::syncDevice() {
-  return true;
+	// Keep queued transfers in order with this one.
+	drain();
+	if (m_asyncWriteError != MS_CBW_PASS) {
+		// A queued write this sync covers never reached the drive.
+		m_errorCode = m_asyncWriteError;
+		m_asyncWriteError = MS_CBW_PASS;
+		return false;
+	}
+	if (!m_unsynced) return true;
+#if MSC_CACHE_CONTROL
+	// Nothing to flush if the drive reported its write cache off, or has
+	// rejected SYNCHRONIZE CACHE before.
+	if (m_syncSupported && (m_writeCache || !m_cachePage)) {
+		if (!checkConnection()) return false;
+		uint8_t cdb[10] = {SCSI_SYNCHRONIZE_CACHE_10};
+		uint8_t status = scsiCommand(cdb, sizeof(cdb), nullptr, 0, true);
+		if (status != MS_CBW_PASS &&
+		    thisDrive->msSense.SenseKey == SENSE_ILLEGAL_REQUEST) {
+			m_syncSupported = false;
+		} else if (!transferDone(status)) {
+			return false;
+		}
+	}
+#endif  // MSC_CACHE_CONTROL
+	m_unsynced = false;
+	return true;
 }
 
 //------------------------------------------------------------------------------
@@ -127,7 +160,14 @@ uint32_t USBMSCDevice::status() {
 
 //------------------------------------------------------------------------------
 uint32_t USBMSCDevice::sectorCount() {
-  return thisDrive->msDriveInfo.capacity.Blocks;
+  // Volumes on drives over 2 TB see the first 2 TB, use sectorCount64().
+  uint64_t count = sectorCount64();
+  return count > 0XFFFFFFFF ? 0XFFFFFFFF : (uint32_t)count;
+}
+
+//------------------------------------------------------------------------------
+uint64_t USBMSCDevice::sectorCount64() {
+  return m_blockCount << m_blockShift;
 }
 
 //==============================================================================
@@ -136,47 +176,139 @@ uint32_t USBMSCDevice::sectorCount() {
 bool USBMSCDevice::begin(msController *pDrive) {
 	m_errorCode = MS_CBW_PASS;
 	thisDrive = pDrive;
+	addDevice(this);
 	pDrive->mscInit(); // Do initial init of each instance of a MSC object.
-	if((m_errorCode = pDrive->checkConnectedInitialized())) {// Check for Connected USB drive.
-		m_initDone = false;
-	} else {
-		m_initDone = true;
-	}
+	m_connected = false;
+	m_initDone = updateConnection();
 	return m_initDone;
 }
 
+//------------------------------------------------------------------------------
+// Slow path of checkConnection(), runs only when the state may have changed.
+bool USBMSCDevice::updateConnection() {
+	if (m_connected) {
+		// The host driver dropped the drive since the last transfer. Fail
+		// this transfer, like a unit attention, so it cannot reach media
+		// that was plugged in since.
+		mediaGone(MS_NO_MEDIA_ERR);
+		return false;
+	}
+	m_inCommand = true;
+	m_errorCode = thisDrive->checkConnectedInitialized();
+	m_inCommand = false;
+	if (m_errorCode != MS_CBW_PASS) {
+		return false;
+	}
+	if (!setBlockSize(thisDrive->msDriveInfo.capacity.BlockSize)) {
+		return false;
+	}
+	// READ CAPACITY(10) gives the last block, the count is one more.
+	m_blockCount = (uint64_t)thisDrive->msDriveInfo.capacity.Blocks + 1;
+	readCapacity16();
+	readBlockLimits();
+	readModePages();
+	memset(&m_profile, 0, sizeof(m_profile));
+	m_syncSupported = true;
+	m_unsynced = false;
+#if MSC_STATS
+	// Only a loss changes the generation, so it is nonzero on a reconnect.
+	if (m_generation) m_stats.reconnects++;
+#endif  // MSC_STATS
+	m_connected = true;
+	m_unmapSupported = true;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// Detach and unit attention both end here. Bumping the generation is all
+// that is needed, volumes and queued transfers check it before touching
+// the drive again.
+void USBMSCDevice::mediaGone(uint8_t code) {
+	m_connected = false;
+	m_blockNumber = NO_BLOCK;
+	m_generation = m_generation + 1;
+	m_errorCode = code;
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::transferDone(uint8_t status) {
+	m_errorCode = status;
+	if (status == MS_MEDIA_CHANGED_ERR) {
+		mediaGone(status);
+	}
+	return status == MS_CBW_PASS;
+}
+
 //------------------------------------------------------------------------------
 bool USBMSCDevice::readSector(uint32_t sector, uint8_t* dst) {
   return readSectors(sector, dst, 1);
 }
 //------------------------------------------------------------------------------
 bool USBMSCDevice::readSectors(uint32_t sector, uint8_t* dst, size_t n) {
+	return readSectors64(sector, dst, n);
+}
+//------------------------------------------------------------------------------
+bool USBMSCDevice::readSectors64(uint64_t sector, uint8_t* dst, size_t n) {
+	// Keep queued transfers in order with this one.
+	drain();
 	// Check if device is plugged in and initialized
-	if((m_errorCode = ((msController *)thisDrive)->checkConnectedInitialized()) != MS_CBW_PASS) {
-		return false;
-	}
-	m_errorCode = thisDrive->msReadBlocks(sector, n,
-	              (uint16_t)thisDrive->msDriveInfo.capacity.BlockSize, dst);
-	if(m_errorCode) {
+	if (!checkConnection() || !checkRange(sector, n)) {
 		return false;
 	}
-	return true;
+	bool ok = m_blockShift ? readTranslated(sector, dst, n) :
+	                         readBlocks(sector, dst, n);
+#if MSC_STATS
+	if (ok) m_stats.sectorsRead += n;
+#endif  // MSC_STATS
+	return ok;
 }
 
 //------------------------------------------------------------------------------
 bool USBMSCDevice::readSectorsWithCB(uint32_t sector, size_t ns, void (*callback)(uint32_t, uint8_t *), uint32_t token) {
+  // Keep queued transfers in order with this one.
+  drain();
   // Check if device is plugged in and initialized
-  if((m_errorCode = ((msController *)thisDrive)->checkConnectedInitialized()) != MS_CBW_PASS) {
-    return false;
-  }
-  m_errorCode = thisDrive->msReadSectorsWithCB(sector, ns, callback, token);
-  if(m_errorCode) {
+  if (!checkConnection()) {
     return false;
   }
-  return true;
+  bool ok = m_blockShift ? readTranslatedWithCB(sector, ns, callback, token) :
+                           readBlocksWithCB(sector, ns, callback, token);
+#if MSC_STATS
+  if (ok) m_stats.sectorsRead += ns;
+#endif  // MSC_STATS
+  return ok;
+
+}
+
+//------------------------------------------------------------------------------
+// msController passes a uint32_t token, too small for a pointer on a 64-bit
+// host. The drive's slot in m_devices goes through instead and the caller's
+// callback and token are kept in the drive for the duration of the read.
+void USBMSCDevice::slotCB(uint32_t slot, uint8_t* data) {
+	USBMSCDevice* dev = m_devices[slot];
+	dev->m_slotCallback(dev->m_slotToken, data);
+}
 
+bool USBMSCDevice::readSectorsWithCallback(uint32_t sector, size_t ns,
+                                           msSectorCallback_t callback,
+                                           uintptr_t token) {
+	int8_t self = slot();
+	if (self < 0) {
+		m_errorCode = MS_CMD_ERR;
+		return false;
+	}
+	m_slotCallback = callback;
+	m_slotToken = token;
+	return readSectorsWithCB(sector, ns, slotCB, (uint32_t)self);
 }
 
+//------------------------------------------------------------------------------
+int8_t USBMSCDevice::slot() const {
+	for (uint8_t i = 0; i < MSC_MAX_DEVICES; i++) {
+		if (m_devices[i] == this) return i;
+	}
+	return -1;
+}
 
 //------------------------------------------------------------------------------
 bool USBMSCDevice::writeSector(uint32_t sector, const uint8_t* src) {
@@ -184,15 +316,919 @@ bool USBMSCDevice::writeSector(uint32_t sector, const uint8_t* src) {
 }
 //------------------------------------------------------------------------------
 bool USBMSCDevice::writeSectors(uint32_t sector, const uint8_t* src, size_t n) {
+	return writeSectors64(sector, src, n);
+}
+//------------------------------------------------------------------------------
+bool USBMSCDevice::writeSectors64(uint64_t sector, const uint8_t* src, size_t n) {
+	// Keep queued transfers in order with this one.
+	drain();
 	// Check if device is plugged in and initialized
-	if((m_errorCode = ((msController *)thisDrive)->checkConnectedInitialized()) != MS_CBW_PASS) {
+	if (!checkConnection() || !checkWritable() || !checkRange(sector, n)) {
 		return false;
 	}
-	m_errorCode = thisDrive->msWriteBlocks(sector, n,
-	              (uint16_t)thisDrive->msDriveInfo.capacity.BlockSize, src);
-	if(m_errorCode) {
+	bool ok = m_blockShift ? writeTranslated(sector, src, n) :
+	                         writeBlocks(sector, src, n);
+#if MSC_STATS
+	if (ok) m_stats.sectorsWritten += n;
+#endif  // MSC_STATS
+	return ok;
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::unmapSectors(uint64_t sector, uint64_t ns) {
+#if MSC_UNMAP
+	// Keep queued transfers in order with this one.
+	drain();
+	if (!checkConnection() || !checkWritable() || !checkRange(sector, ns)) {
 		return false;
 	}
-  return true;
+	if (!m_unmapSupported) {
+		m_errorCode = MS_CMD_ERR;
+		return false;
+	}
+	// Round in to whole blocks, a partial block still holds live sectors.
+	uint32_t mask = (1UL << m_blockShift) - 1;
+	uint64_t block = (sector + mask) >> m_blockShift;
+	uint64_t end = (sector + ns) >> m_blockShift;
+	while (block < end) {
+		uint32_t n = end - block > MSC_UNMAP_MAX_BLOCKS ?
+		             MSC_UNMAP_MAX_BLOCKS : (uint32_t)(end - block);
+		if (!unmapBlocks(block, n)) return false;
+		if ((m_blockNumber - block) < n) m_blockNumber = NO_BLOCK;
+#if MSC_STATS
+		m_stats.sectorsUnmapped += n << m_blockShift;
+#endif  // MSC_STATS
+		block += n;
+	}
+	return true;
+#else  // MSC_UNMAP
+	(void)sector;
+	(void)ns;
+	m_errorCode = MS_CMD_ERR;
+	return false;
+#endif  // MSC_UNMAP
+}
+
+//------------------------------------------------------------------------------
+// msController only has the 10-byte READ and WRITE commands, so without
+// MSC_LBA64 every block of a transfer must have a 32-bit address. That
+// covers 2 TB of 512 byte blocks and 16 TB of 4Kn blocks. With it the
+// drive checks the range.
+bool USBMSCDevice::checkRange(uint64_t sector, uint64_t ns) {
+	if (!MSC_LBA64 && (sector + ns) > ((uint64_t)1 << (32 + m_blockShift))) {
+		m_errorCode = MS_BAD_LBA_ERR;
+		return false;
+	}
+	return true;
+}
+
+//==============================================================================
+// Sector translation for drives with blocks larger than 512 bytes. m_block
+// holds the last block touched by a partial transfer. Writes go through
+// it to the drive at once, so it never holds data the drive does not.
+//------------------------------------------------------------------------------
+bool USBMSCDevice::setBlockSize(uint32_t blockSize) {
+	uint8_t shift = 0;
+	while ((512UL << shift) < blockSize) shift++;
+	// msController takes a 16-bit block size.
+	if ((512UL << shift) != blockSize || blockSize > 32768) {
+		m_errorCode = MS_CMD_ERR;
+		return false;
+	}
+	m_blockShift = shift;
+	m_blockNumber = NO_BLOCK;
+	if (shift && m_blockSize < blockSize) {
+		free(m_block);
+		m_block = (uint8_t*)malloc(blockSize);
+		m_blockSize = m_block ? blockSize : 0;
+		if (!m_block) {
+			m_errorCode = MS_CMD_ERR;
+			return false;
+		}
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+static uint32_t getBe32(const uint8_t* p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3];
+}
+
+//------------------------------------------------------------------------------
+// READ CAPACITY(10) reports 0XFFFFFFFF as the last block of a drive too
+// large for it, SBC-3 5.16. Ask again with READ CAPACITY(16) for the real
+// size.
+void USBMSCDevice::readCapacity16() {
+#if MSC_LBA64
+	if (m_blockCount != 0X100000000ULL) return;
+	uint8_t buf[32];
+	uint8_t cdb[16] = {SCSI_SERVICE_ACTION_IN_16, SA_READ_CAPACITY_16};
+	cdb[13] = sizeof(buf);
+	if (scsiCommand(cdb, sizeof(cdb), buf, sizeof(buf), true) != MS_CBW_PASS ||
+	    getBe32(buf + 8) != thisDrive->msDriveInfo.capacity.BlockSize) {
+		return;
+	}
+	m_blockCount = ((uint64_t)getBe32(buf) << 32 | getBe32(buf + 4)) + 1;
+#endif  // MSC_LBA64
+}
+
+//------------------------------------------------------------------------------
+// A unit attention other than a media change, such as a reset, is reported
+// once and the command was not run, so it is sent again. A media change is
+// left to transferDone().
+bool USBMSCDevice::retryCommand(uint8_t status, bool* retried) {
+	if (status == MS_CBW_PASS || status == MS_MEDIA_CHANGED_ERR || *retried ||
+	    thisDrive->msSense.SenseKey != SENSE_UNIT_ATTENTION) {
+		return false;
+	}
+	*retried = true;
+#if MSC_STATS
+	m_stats.retries++;
+#endif  // MSC_STATS
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// Every drive command is issued by one of these. Reads and writes are split
+// into commands of at most m_maxBlocks. Commands reaching past a 32-bit
+// block address use the 16-byte form.
+bool USBMSCDevice::readBlocks(uint64_t block, uint8_t* dst, uint32_t count) {
+	uint32_t blockSize = thisDrive->msDriveInfo.capacity.BlockSize;
+	while (count) {
+		uint32_t n = count < m_maxBlocks ? count : m_maxBlocks;
+		uint8_t status;
+		bool retried = false;
+		do {
+			if ((block + n - 1) >> 32) {
+				status = rw16(SCSI_READ_16, block, n, dst);
+			} else {
+				uint32_t start = commandStart();
+				status = thisDrive->msReadBlocks((uint32_t)block, n, (uint16_t)blockSize, dst);
+				commandDone(SCSI_READ_10, block, n, status, start);
+			}
+		} while (retryCommand(status, &retried));
+		if (!transferDone(status)) return false;
+		block += n;
+		dst += n*blockSize;
+		count -= n;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::writeBlocks(uint64_t block, const uint8_t* src, uint32_t count) {
+	uint32_t blockSize = thisDrive->msDriveInfo.capacity.BlockSize;
+	while (count) {
+		uint32_t n = count < m_maxBlocks ? count : m_maxBlocks;
+		uint8_t status;
+		bool retried = false;
+		do {
+			if ((block + n - 1) >> 32) {
+				status = rw16(SCSI_WRITE_16, block, n, (uint8_t*)src);
+			} else {
+				uint32_t start = commandStart();
+				status = thisDrive->msWriteBlocks((uint32_t)block, n, (uint16_t)blockSize, src);
+				commandDone(SCSI_WRITE_10, block, n, status, start);
+			}
+		} while (retryCommand(status, &retried));
+		m_unsynced = true;
+		if (status != MS_CBW_PASS &&
+		    thisDrive->msSense.SenseKey == SENSE_DATA_PROTECT) {
+			m_writeProtected = true;
+		}
+		if (!transferDone(status)) return false;
+		block += n;
+		src += n*blockSize;
+		count -= n;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::readBlocksWithCB(uint32_t block, uint32_t count,
+                                    void (*callback)(uint32_t, uint8_t *),
+                                    uint32_t token) {
+	while (count) {
+		uint32_t n = count < m_maxBlocks ? count : m_maxBlocks;
+		uint8_t status;
+		bool retried = false;
+		do {
+			uint32_t start = commandStart();
+			status = thisDrive->msReadSectorsWithCB(block, n, callback, token);
+			commandDone(SCSI_READ_10, block, n, status, start);
+		} while (retryCommand(status, &retried));
+		if (!transferDone(status)) return false;
+		block += n;
+		count -= n;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// READ(16) or WRITE(16), SBC-3 5.8 and 5.38, for blocks msController's
+// 10-byte commands cannot address. checkRange() keeps them out without
+// MSC_LBA64.
+uint8_t USBMSCDevice::rw16(uint8_t opcode, uint64_t block, uint32_t count,
+                           void* buf) {
+	uint8_t cdb[16] = {opcode};
+	for (uint8_t i = 0; i < 8; i++) {
+		cdb[2 + i] = block >> (56 - 8*i);
+	}
+	cdb[10] = count >> 24;
+	cdb[11] = count >> 16;
+	cdb[12] = count >> 8;
+	cdb[13] = count;
+	return scsiCommand(cdb, sizeof(cdb), buf,
+	                   count*thisDrive->msDriveInfo.capacity.BlockSize,
+	                   opcode == SCSI_READ_16, block, count);
+}
+
+//------------------------------------------------------------------------------
+// Commands msController has no function for go through msDoCommand(). A
+// command without data is sent as data in, as msController does.
+uint8_t USBMSCDevice::scsiCommand(const uint8_t* cdb, uint8_t cdbLength,
+                                  void* buf, uint32_t length, bool dataIn,
+                                  uint64_t block, uint32_t blocks) {
+#if MSC_UNMAP || MSC_BLOCK_LIMITS || MSC_CACHE_CONTROL || MSC_LBA64
+	msCommandBlockWrapper_t CBW = {
+		CBWSIGNATURE, CBW_TAG, length,
+		(uint8_t)(dataIn ? CMD_DIR_DATA_IN : CMD_DIR_DATA_OUT), 0, cdbLength, {0}
+	};
+	memcpy(CBW.CommandData, cdb, cdbLength);
+	uint32_t start = commandStart();
+	uint8_t status = thisDrive->msDoCommand(&CBW, buf);
+	commandDone(cdb[0], block, blocks, status, start);
+	return status;
+#else  // MSC_UNMAP || MSC_BLOCK_LIMITS || MSC_CACHE_CONTROL || MSC_LBA64
+	(void)cdb;
+	(void)cdbLength;
+	(void)buf;
+	(void)length;
+	(void)dataIn;
+	(void)block;
+	(void)blocks;
+	return MS_CMD_ERR;
+#endif  // MSC_UNMAP || MSC_BLOCK_LIMITS || MSC_CACHE_CONTROL || MSC_LBA64
+}
+
+//------------------------------------------------------------------------------
+// UNMAP with a parameter list holding one block descriptor, SBC-3 5.28.
+// A drive without UNMAP fails it as an illegal request, it is not sent
+// again until the drive is reconnected.
+bool USBMSCDevice::unmapBlocks(uint64_t block, uint32_t count) {
+#if MSC_UNMAP
+	uint8_t param[24] = {0, 22, 0, 16};
+	for (uint8_t i = 0; i < 8; i++) {
+		param[8 + i] = block >> (56 - 8*i);
+	}
+	param[16] = count >> 24;
+	param[17] = count >> 16;
+	param[18] = count >> 8;
+	param[19] = count;
+	uint8_t cdb[10] = {SCSI_UNMAP, 0, 0, 0, 0, 0, 0, 0, sizeof(param), 0};
+	uint8_t status = scsiCommand(cdb, sizeof(cdb), param, sizeof(param), false,
+	                             block, count);
+	if (status != MS_CBW_PASS &&
+	    thisDrive->msSense.SenseKey == SENSE_ILLEGAL_REQUEST) {
+		m_unmapSupported = false;
+	}
+	return transferDone(status);
+#else  // MSC_UNMAP
+	(void)block;
+	(void)count;
+	return false;
+#endif  // MSC_UNMAP
+}
+
+//------------------------------------------------------------------------------
+// INQUIRY for a VPD page. A failure is not an error of the drive, the
+// caller falls back to defaults, so m_errorCode is left alone.
+bool USBMSCDevice::inquiryVpd(uint8_t page, uint8_t* buf, uint8_t len) {
+#if MSC_BLOCK_LIMITS
+	uint8_t cdb[6] = {SCSI_INQUIRY, 1, page, 0, len, 0};
+	memset(buf, 0, len);
+	return scsiCommand(cdb, sizeof(cdb), buf, len, true) == MS_CBW_PASS &&
+	       buf[1] == page;
+#else  // MSC_BLOCK_LIMITS
+	(void)page;
+	(void)buf;
+	(void)len;
+	return false;
+#endif  // MSC_BLOCK_LIMITS
+}
+
+//------------------------------------------------------------------------------
+// Transfer limits from the Block Limits VPD page, SBC-3 6.5.3. Only drives
+// that claim SPC-3 or later and list the page are asked, many USB sticks
+// hang on a VPD page they do not have.
+void USBMSCDevice::readBlockLimits() {
+	uint8_t vpd[64];
+	uint32_t maxBlocks = 0;
+	uint32_t optimal = 0;
+	uint32_t granularity = 0;
+
+	if (thisDrive->msDriveInfo.inquiry.Version >= 5 &&
+	    inquiryVpd(0X00, vpd, sizeof(vpd))) {
+		uint32_t n = vpd[2] << 8 | vpd[3];
+		bool listed = false;
+		for (uint32_t i = 4; i < (n + 4) && i < sizeof(vpd); i++) {
+			if (vpd[i] == 0XB0) listed = true;
+		}
+		if (listed && inquiryVpd(0XB0, vpd, sizeof(vpd)) && vpd[3] >= 12) {
+			granularity = vpd[6] << 8 | vpd[7];
+			maxBlocks = getBe32(vpd + 8);
+			optimal = getBe32(vpd + 12);
+		}
+	}
+	// Zero in any field means not reported.
+	if (maxBlocks == 0 || maxBlocks > MSC_MAX_TRANSFER_BLOCKS) {
+		maxBlocks = MSC_MAX_TRANSFER_BLOCKS;
+	}
+	if (granularity == 0 || granularity > maxBlocks) granularity = 1;
+	maxBlocks -= maxBlocks % granularity;
+	if (optimal == 0) optimal = MSC_OPTIMAL_TRANSFER_SECTORS >> m_blockShift;
+	if (optimal > maxBlocks) optimal = maxBlocks;
+	optimal -= optimal % granularity;
+	m_maxBlocks = maxBlocks;
+	m_optimalBlocks = optimal ? optimal : granularity;
+	m_granularity = granularity;
+}
+
+//------------------------------------------------------------------------------
+// Current values of all mode pages with MODE SENSE(6). Many USB drives
+// fail a request for a single page, or for other than 192 bytes.
+bool USBMSCDevice::modeSense(uint8_t* buf, uint8_t len) {
+	uint8_t cdb[6] = {SCSI_MODE_SENSE_6, 0, 0X3F, 0, len, 0};
+	memset(buf, 0, len);
+	return scsiCommand(cdb, sizeof(cdb), buf, len, true) == MS_CBW_PASS;
+}
+
+//------------------------------------------------------------------------------
+// Find the Caching mode page, SBC-3 6.4.5, in MODE SENSE(6) data.
+#if MSC_CACHE_CONTROL
+static uint8_t* cachingPage(uint8_t* mode, uint32_t len) {
+	uint32_t end = mode[0] + 1U;
+	if (end > len) end = len;
+	uint32_t i = 4 + mode[3];
+	while ((i + 4) <= end) {
+		if (mode[i] & 0X40) {
+			// Sub-page format, two byte page length.
+			i += 4 + (mode[i + 2] << 8 | mode[i + 3]);
+			continue;
+		}
+		uint32_t n = 2 + mode[i + 1];
+		if ((mode[i] & 0X3F) == 0X08 && (i + n) <= end) return mode + i;
+		i += n;
+	}
+	return nullptr;
+}
+#endif  // MSC_CACHE_CONTROL
+
+//------------------------------------------------------------------------------
+// Write protect from the mode parameter header and the write cache enable
+// bit from the Caching page. A drive without the page may still cache
+// writes, syncDevice() then sends SYNCHRONIZE CACHE in case.
+void USBMSCDevice::readModePages() {
+	uint8_t mode[192];
+	m_writeProtected = false;
+	m_cachePage = false;
+	m_writeCache = false;
+#if MSC_CACHE_CONTROL
+	if (modeSense(mode, sizeof(mode))) {
+		uint8_t* page = cachingPage(mode, sizeof(mode));
+		m_writeProtected = mode[2] & 0X80;
+		m_cachePage = page != nullptr;
+		m_writeCache = page && (page[2] & 0X04);
+	}
+#else  // MSC_CACHE_CONTROL
+	(void)mode;
+#endif  // MSC_CACHE_CONTROL
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::setWriteCache(bool enable, bool save) {
+#if MSC_CACHE_CONTROL
+	uint8_t mode[192];
+	uint8_t* page;
+	// What the cache holds must reach the media before it is turned off.
+	if (!enable && !syncDevice()) return false;
+	// Keep queued transfers in order with this one.
+	drain();
+	if (!checkConnection()) return false;
+	if (!m_cachePage || !modeSense(mode, sizeof(mode)) ||
+	    !(page = cachingPage(mode, sizeof(mode)))) {
+		m_errorCode = MS_CMD_ERR;
+		return false;
+	}
+	// A mode parameter header of zeros, no block descriptors, then the
+	// page with its PS bit clear.
+	uint8_t n = page[1] + 2;
+	memmove(mode + 4, page, n);
+	memset(mode, 0, 4);
+	mode[4] &= 0X3F;
+	mode[6] = enable ? (mode[6] | 0X04) : (mode[6] & ~0X04);
+	uint8_t cdb[6] = {SCSI_MODE_SELECT_6, (uint8_t)(save ? 0X11 : 0X10), 0, 0,
+	                  (uint8_t)(4 + n), 0};
+	if (!transferDone(scsiCommand(cdb, sizeof(cdb), mode, 4 + n, false))) {
+		return false;
+	}
+	// Read it back, a drive may accept the page and ignore the bit.
+	readModePages();
+	if (m_writeCache != enable) {
+		m_errorCode = MS_CMD_ERR;
+		return false;
+	}
+	return true;
+#else  // MSC_CACHE_CONTROL
+	(void)enable;
+	(void)save;
+	m_errorCode = MS_CMD_ERR;
+	return false;
+#endif  // MSC_CACHE_CONTROL
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::loadBlock(uint64_t block) {
+	if (block == m_blockNumber) return true;
+	m_blockNumber = NO_BLOCK;
+	if (!readBlocks(block, m_block, 1)) return false;
+	m_blockNumber = block;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::readTranslated(uint64_t sector, uint8_t* dst, size_t ns) {
+	uint32_t mask = (1UL << m_blockShift) - 1;
+	while (ns) {
+		uint64_t block = sector >> m_blockShift;
+		uint32_t offset = sector & mask;
+		uint32_t n;
+		if (offset == 0 && ns > mask) {
+			// Whole blocks go straight to dst.
+			n = ns & ~mask;
+			if (!readBlocks(block, dst, n >> m_blockShift)) return false;
+		} else {
+			n = mask + 1 - offset;
+			if (n > ns) n = ns;
+			if (!loadBlock(block)) return false;
+			memcpy(dst, m_block + (offset << 9), n << 9);
+		}
+		sector += n;
+		dst += n << 9;
+		ns -= n;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::writeTranslated(uint64_t sector, const uint8_t* src, size_t ns) {
+	uint32_t mask = (1UL << m_blockShift) - 1;
+	while (ns) {
+		uint64_t block = sector >> m_blockShift;
+		uint32_t offset = sector & mask;
+		uint32_t n;
+		if (offset == 0 && ns > mask) {
+			n = ns & ~mask;
+			if ((m_blockNumber - block) < (n >> m_blockShift)) {
+				m_blockNumber = NO_BLOCK;
+			}
+			if (!writeBlocks(block, src, n >> m_blockShift)) return false;
+		} else {
+			// Read-modify-write of a partial block.
+			n = mask + 1 - offset;
+			if (n > ns) n = ns;
+			if (!loadBlock(block)) return false;
+			memcpy(m_block + (offset << 9), src, n << 9);
+			if (!writeBlocks(block, m_block, 1)) {
+				m_blockNumber = NO_BLOCK;
+				return false;
+			}
+		}
+		sector += n;
+		src += n << 9;
+		ns -= n;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// Split each block from msReadSectorsWithCB() into 512 byte callbacks.
+void USBMSCDevice::splitBlockCB(uint32_t slot, uint8_t* data) {
+	USBMSCDevice* dev = m_devices[slot];
+	for (uint32_t i = 0; i < (1UL << dev->m_blockShift); i++) {
+		dev->m_splitCallback(dev->m_splitToken, data + (i << 9));
+	}
+}
+
+bool USBMSCDevice::readTranslatedWithCB(uint32_t sector, size_t ns,
+                                        void (*callback)(uint32_t, uint8_t *),
+                                        uint32_t token) {
+	uint32_t mask = (1UL << m_blockShift) - 1;
+	int8_t self = slot();
+	if (self < 0) {
+		m_errorCode = MS_CMD_ERR;
+		return false;
+	}
+	m_splitCallback = callback;
+	m_splitToken = token;
+	while (ns) {
+		uint32_t block = sector >> m_blockShift;
+		uint32_t offset = sector & mask;
+		uint32_t n;
+		if (offset == 0 && ns > mask) {
+			n = ns & ~mask;
+			if (!readBlocksWithCB(block, n >> m_blockShift, splitBlockCB, self)) {
+				return false;
+			}
+		} else {
+			n = mask + 1 - offset;
+			if (n > ns) n = ns;
+			if (!loadBlock(block)) return false;
+			for (uint32_t i = 0; i < n; i++) {
+				callback(token, m_block + ((offset + i) << 9));
+			}
+		}
+		sector += n;
+		ns -= n;
+	}
+	return true;
+}
+
+//==============================================================================
+// Block layer counters and trace. Commands, bytes and latency are recorded
+// per drive command here, sectors where the request came in.
+void USBMSCDevice::commandDone(uint8_t opcode, uint64_t block, uint32_t blocks,
+                               uint8_t status, uint32_t start) {
+	m_inCommand = false;
+#if MSC_STATS || MSC_TRACE
+	uint32_t end = micros();
+#endif  // MSC_STATS || MSC_TRACE
+#if MSC_STATS
+	uint32_t us = end - start;
+	uint8_t bucket = 0;
+	while (bucket < (MSC_STATS_BUCKETS - 1) && (us >> (bucket + 1))) bucket++;
+	m_stats.commands++;
+	if (status != MS_CBW_PASS) {
+		m_stats.errors++;
+		m_stats.senseKeyErrors[thisDrive->msSense.SenseKey & 0XF]++;
+	}
+	uint64_t bytes = status == MS_CBW_PASS ?
+	                 (uint64_t)blocks*thisDrive->msDriveInfo.capacity.BlockSize : 0;
+	if (opcode == SCSI_WRITE_10 || opcode == SCSI_WRITE_16) {
+		m_stats.writeMicros[bucket]++;
+		m_stats.bytesWritten += bytes;
+	} else if (opcode == SCSI_READ_10 || opcode == SCSI_READ_16) {
+		m_stats.readMicros[bucket]++;
+		m_stats.bytesRead += bytes;
+	}
+#endif  // MSC_STATS
+#if MSC_TRACE
+	msTraceEntry_t* e = &m_trace[m_traceCount & (MSC_TRACE - 1)];
+	e->start = start;
+	e->end = end;
+	e->lba = (uint32_t)block;
+	e->blocks = blocks > 0XFFFF ? 0XFFFF : blocks;
+	e->opcode = opcode;
+	e->status = status;
+	e->senseKey = status != MS_CBW_PASS ? thisDrive->msSense.SenseKey : 0;
+	e->asc = status != MS_CBW_PASS ? thisDrive->msSense.AdditionalSenseCode : 0;
+	e->ascq = status != MS_CBW_PASS ?
+	          thisDrive->msSense.AdditionalSenseQualifier : 0;
+	e->reserved = 0;
+	m_traceCount++;
+#endif  // MSC_TRACE
+#if !MSC_STATS && !MSC_TRACE
+	(void)opcode;
+	(void)block;
+	(void)blocks;
+	(void)status;
+	(void)start;
+#endif  // !MSC_STATS && !MSC_TRACE
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::stats(msStats_t* snapshot, bool reset) {
+#if MSC_STATS
+	*snapshot = m_stats;
+	if (reset) resetStats();
+	return true;
+#else  // MSC_STATS
+	memset(snapshot, 0, sizeof(msStats_t));
+	(void)reset;
+	return false;
+#endif  // MSC_STATS
+}
+
+//------------------------------------------------------------------------------
+void USBMSCDevice::resetStats() {
+#if MSC_STATS
+	memset(&m_stats, 0, sizeof(m_stats));
+#endif  // MSC_STATS
+}
+
+//------------------------------------------------------------------------------
+void USBMSCDevice::printStats(Print* pr) {
+#if MSC_STATS
+	const msStats_t& st = m_stats;
+	pr->printf("commands: %lu errors: %lu retries: %lu reconnects: %lu\n",
+	           (unsigned long)st.commands, (unsigned long)st.errors,
+	           (unsigned long)st.retries, (unsigned long)st.reconnects);
+	pr->printf("read: %lu sectors %llu bytes\n", (unsigned long)st.sectorsRead,
+	           (unsigned long long)st.bytesRead);
+	pr->printf("write: %lu sectors %llu bytes\n", (unsigned long)st.sectorsWritten,
+	           (unsigned long long)st.bytesWritten);
+	if (st.sectorsUnmapped) {
+		pr->printf("unmap: %lu sectors\n", (unsigned long)st.sectorsUnmapped);
+	}
+	for (uint8_t i = 0; i < 16; i++) {
+		if (st.senseKeyErrors[i]) {
+			pr->printf("sense key %s: %lu\n", decodeSenseKey(i),
+			           (unsigned long)st.senseKeyErrors[i]);
+		}
+	}
+	pr->printf("latency us    reads   writes\n");
+	for (uint8_t i = 0; i < MSC_STATS_BUCKETS; i++) {
+		if (st.readMicros[i] || st.writeMicros[i]) {
+			pr->printf("%8lu+ %8lu %8lu\n", i ? 1UL << i : 0UL,
+			           (unsigned long)st.readMicros[i],
+			           (unsigned long)st.writeMicros[i]);
+		}
+	}
+#else  // MSC_STATS
+	pr->printf("MSC_STATS is not enabled\n");
+#endif  // MSC_STATS
+}
+
+//------------------------------------------------------------------------------
+#if MSC_TRACE
+static_assert((MSC_TRACE & (MSC_TRACE - 1)) == 0,
+              "MSC_TRACE must be a power of two");
+#endif  // MSC_TRACE
+uint32_t USBMSCDevice::readTrace(msTraceEntry_t* dst, uint32_t max) {
+#if MSC_TRACE
+	uint32_t n = m_traceCount < MSC_TRACE ? m_traceCount : MSC_TRACE;
+	if (n > max) n = max;
+	// The newest n entries, oldest first.
+	for (uint32_t i = 0; i < n; i++) {
+		dst[i] = m_trace[(m_traceCount - n + i) & (MSC_TRACE - 1)];
+	}
+	return n;
+#else  // MSC_TRACE
+	(void)dst;
+	(void)max;
+	return 0;
+#endif  // MSC_TRACE
+}
+
+//------------------------------------------------------------------------------
+uint32_t USBMSCDevice::traceCount() const {
+#if MSC_TRACE
+	return m_traceCount;
+#else  // MSC_TRACE
+	return 0;
+#endif  // MSC_TRACE
+}
+
+//------------------------------------------------------------------------------
+void USBMSCDevice::traceClear() {
+#if MSC_TRACE
+	m_traceCount = 0;
+#endif  // MSC_TRACE
+}
+
+//------------------------------------------------------------------------------
+// One line per command in hex: start end opcode lba blocks status sense
+// asc ascq. The header gives the format version, block size and how many
+// commands were lost off the front of the ring.
+void USBMSCDevice::traceDump(Print* pr) {
+#if MSC_TRACE
+	uint32_t n = m_traceCount < MSC_TRACE ? m_traceCount : MSC_TRACE;
+	pr->printf("MSCTRACE 1 %lu %lu %lu\n",
+	           thisDrive ? (unsigned long)thisDrive->msDriveInfo.capacity.BlockSize : 0UL,
+	           (unsigned long)n, (unsigned long)(m_traceCount - n));
+	for (uint32_t i = 0; i < n; i++) {
+		const msTraceEntry_t* e = &m_trace[(m_traceCount - n + i) & (MSC_TRACE - 1)];
+		pr->printf("T %08lX %08lX %02X %08lX %04X %02X %X %02X %02X\n",
+		           (unsigned long)e->start, (unsigned long)e->end, e->opcode,
+		           (unsigned long)e->lba, e->blocks, e->status, e->senseKey,
+		           e->asc, e->ascq);
+	}
+	pr->printf("MSCTRACE END\n");
+#else  // MSC_TRACE
+	pr->printf("MSC_TRACE is not enabled\n");
+#endif  // MSC_TRACE
+}
+
+//==============================================================================
+// Drive profile. Every timed write puts back the data just read from the
+// same sectors, so profiling leaves the drive's contents as they were.
+//------------------------------------------------------------------------------
+// Fastest of up to MSC_PROFILE_REPS writes of ns sectors, stride apart from
+// sector, that end by end.
+bool USBMSCDevice::timeRewrite(uint32_t sector, uint32_t stride, uint32_t end,
+                               uint8_t* buf, uint32_t ns, uint32_t* fastest) {
+	*fastest = 0XFFFFFFFF;
+	for (uint32_t k = 0; k < MSC_PROFILE_REPS && (sector + ns) <= end; k++) {
+		if (!readSectors(sector, buf, ns)) return false;
+		uint32_t start = micros();
+		if (!writeSectors(sector, buf, ns)) return false;
+		uint32_t us = micros() - start;
+		if (us < *fastest) *fastest = us;
+		sector += stride;
+	}
+	return *fastest != 0XFFFFFFFF;
+}
+
+//------------------------------------------------------------------------------
+static uint32_t profileKBps(uint32_t ns, uint32_t us) {
+	return (uint32_t)((uint64_t)ns*500000/(us ? us : 1));
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::profileDrive(uint8_t* buf, size_t size, uint32_t sector,
+                                uint32_t ns) {
+	uint32_t block = sectorsPerBlock();
+	uint32_t end = sector + ns;
+	uint32_t maxWrite = block;
+	uint32_t speed[32];
+	uint32_t best = 0;
+	uint32_t us;
+	uint32_t us2;
+
+	memset(&m_profile, 0, sizeof(m_profile));
+	while ((2*maxWrite << 9) <= size) maxWrite *= 2;
+	if (maxWrite < 2*block || ns < 4*maxWrite || end < sector ||
+	    (sector & (block - 1))) {
+		m_errorCode = MS_CMD_ERR;
+		return false;
+	}
+	// Page: the smallest aligned write within 3/4 of the best speed.
+	uint32_t n = 0;
+	for (uint32_t s = block; s <= maxWrite; s *= 2, n++) {
+		uint32_t p = (sector + s - 1) & ~(s - 1);
+		if (!timeRewrite(p, s, end, buf, s, &us)) return false;
+		speed[n] = profileKBps(s, us);
+		if (speed[n] > best) best = speed[n];
+	}
+	uint32_t page = block;
+	for (uint32_t i = 0; speed[i] < best - best/4; i++) page *= 2;
+	m_profile.pageSectors = page;
+	m_profile.alignedKBps = speed[n - 1];
+	for (uint32_t s = block, i = 0; i < n; s *= 2, i++) {
+		if (s == page) m_profile.alignedKBps = speed[i];
+	}
+	m_profile.unalignedKBps = m_profile.alignedKBps;
+	if (page >= 2*block) {
+		uint32_t p = ((sector + page - 1) & ~(page - 1)) + page/2;
+		if (!timeRewrite(p, page, end, buf, page, &us)) return false;
+		m_profile.unalignedKBps = profileKBps(page, us);
+	}
+	// Allocation unit: a write of two pages across an odd multiple of c,
+	// against the same write across the middle of that span, which is only
+	// a boundary of c/2. Crossing costs most when c is the allocation unit,
+	// for a smaller c neither write crosses one and for a larger c both do.
+	uint32_t half = page < maxWrite ? page : maxWrite/2;
+	uint32_t bestRatio = 0;
+	for (uint32_t c = 4*half; c <= MSC_PROFILE_MAX_AU; c *= 2) {
+		uint32_t b = (sector + half + c - 1) & ~(c - 1);
+		if (!(b & c)) b += c;
+		if ((b + c/2 + half) > end) break;
+		if (!timeRewrite(b - half, 2*c, end, buf, 2*half, &us) ||
+		    !timeRewrite(b + c/2 - half, 2*c, end, buf, 2*half, &us2)) {
+			return false;
+		}
+		// Ratio in sixteenths, at least 1.5 counts.
+		uint32_t ratio = (uint32_t)((uint64_t)us*16/(us2 ? us2 : 1));
+		if (ratio >= 24 && ratio > bestRatio) {
+			bestRatio = ratio;
+			m_profile.auSectors = c;
+		}
+	}
+	return true;
+}
+
+//==============================================================================
+// Queued transfers. msController transfers block until complete, so the
+// queue is drained from poll()/wait() in the foreground and nothing runs in
+// the background. The ring has a single producer, which only advances
+// m_asyncHead, and a single consumer, which only advances m_asyncTail.
+// queueAsync() is not reentrant, two producers would claim the same slot.
+static_assert((MSC_ASYNC_QUEUE_SIZE & (MSC_ASYNC_QUEUE_SIZE - 1)) == 0 &&
+              MSC_ASYNC_QUEUE_SIZE <= 128,
+              "MSC_ASYNC_QUEUE_SIZE must be a power of two <= 128");
+//------------------------------------------------------------------------------
+bool USBMSCDevice::queueAsync(uint32_t sector, uint8_t* buf, size_t ns,
+                              bool write, msAsyncCallback_t callback,
+                              uintptr_t token) {
+	uint8_t head = m_asyncHead;
+	if ((uint8_t)(head - m_asyncTail) >= MSC_ASYNC_QUEUE_SIZE) {
+		return false;
+	}
+	msAsyncRequest_t *req = &m_asyncQueue[head & (MSC_ASYNC_QUEUE_SIZE - 1)];
+	req->sector = sector;
+	req->buf = buf;
+	req->ns = ns;
+	req->write = write;
+	req->callback = callback;
+	req->token = token;
+	req->generation = m_generation;
+	m_asyncHead = head + 1;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::readSectorsAsync(uint32_t sector, uint8_t* dst, size_t ns,
+                                    msAsyncCallback_t callback, uintptr_t token) {
+	return queueAsync(sector, dst, ns, false, callback, token);
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::writeSectorsAsync(uint32_t sector, const uint8_t* src, size_t ns,
+                                     msAsyncCallback_t callback, uintptr_t token) {
+	return queueAsync(sector, (uint8_t*)src, ns, true, callback, token);
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::poll() {
+	// poll() may be reached again from yield() inside a transfer, queued
+	// or not.
+	if (m_asyncActive || m_inCommand || !asyncPending()) {
+		return asyncPending() != 0;
+	}
+	m_asyncActive = true;
+	msAsyncRequest_t *req = &m_asyncQueue[m_asyncTail & (MSC_ASYNC_QUEUE_SIZE - 1)];
+	uint8_t status = MS_CBW_PASS;
+	// Check the connection first so a transfer queued for media that has
+	// since gone is dropped instead of reaching its replacement.
+	if (!checkConnection()) {
+		status = m_errorCode;
+	} else if (req->generation != m_generation) {
+		status = MS_NO_MEDIA_ERR;
+	} else if (!(req->write ? writeSectors(req->sector, req->buf, req->ns) :
+	                          readSectors(req->sector, req->buf, req->ns))) {
+		status = m_errorCode;
+	}
+	if (status != MS_CBW_PASS) {
+		m_asyncError = status;
+		if (req->write) m_asyncWriteError = status;
+	}
+	msAsyncCallback_t callback = req->callback;
+	uintptr_t token = req->token;
+	m_asyncTail = m_asyncTail + 1;
+	m_asyncActive = false;
+	if (callback) callback(token, status);
+	return asyncPending() != 0;
+}
+
+//------------------------------------------------------------------------------
+void USBMSCDevice::addDevice(USBMSCDevice* dev) {
+	USBMSCDevice** slot = nullptr;
+	for (uint8_t i = 0; i < MSC_MAX_DEVICES; i++) {
+		if (m_devices[i] == dev) return;
+		if (!m_devices[i] && !slot) slot = &m_devices[i];
+	}
+	if (slot) *slot = dev;
+}
+
+//------------------------------------------------------------------------------
+void USBMSCDevice::removeDevice(USBMSCDevice* dev) {
+	for (uint8_t i = 0; i < MSC_MAX_DEVICES; i++) {
+		if (m_devices[i] == dev) m_devices[i] = nullptr;
+	}
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::pollAll() {
+	bool pending = false;
+	// A drive busy in a command is skipped by its own poll(), so each
+	// drive has at most one transfer outstanding.
+	for (uint8_t i = 0; i < MSC_MAX_DEVICES; i++) {
+		USBMSCDevice* dev = m_devices[i];
+		if (dev && dev->poll()) pending = true;
+	}
+	return pending;
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::waitAll() {
+	bool ok = true;
+	while (pollAll()) {}
+	for (uint8_t i = 0; i < MSC_MAX_DEVICES; i++) {
+		USBMSCDevice* dev = m_devices[i];
+		if (dev && !dev->m_asyncActive && !dev->m_inCommand && !dev->wait()) {
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+//------------------------------------------------------------------------------
+bool USBMSCDevice::wait() {
+	if (m_asyncActive || m_inCommand) return false;
+	while (poll()) {}
+	bool ok = m_asyncError == MS_CBW_PASS;
+	m_asyncError = MS_CBW_PASS;
+	m_asyncWriteError = MS_CBW_PASS;
+	return ok;
 }
 //#endif // HAS_USB_MSC_CLASS
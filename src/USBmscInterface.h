@@ -41,9 +41,9 @@ class USBmscInterface : public BlockDeviceInterface {
   /** \return true if USB is busy. */
   virtual bool isBusy() = 0;
   /** \return true if USB read is busy. */
-  virtual bool isBusyRead();
+  virtual bool isBusyRead() {return isBusy();}
   /** \return true if USB write is busy. */
-  virtual bool isBusyWrite();
+  virtual bool isBusyWrite() {return isBusy();}
     /** Read a MSC USB drive's info.
    * \return true for success or false for failure.
    */
@@ -59,6 +59,26 @@ class USBmscInterface : public BlockDeviceInterface {
    *         or zero if an error occurs.
    */
   virtual uint32_t sectorCount() = 0;
+  /**
+   * Determine the size of a USB Mass Storage Device over 2 TB.
+   *
+   * \return The number of 512 byte data sectors in the USB device.
+   */
+  virtual uint64_t sectorCount64() {return sectorCount();}
+  /** Read sectors with a 64-bit sector address.
+   * \return true for success or false for failure.
+   */
+  virtual bool readSectors64(uint64_t sector, uint8_t* dst, size_t ns) {
+    return (sector + ns) <= 0X100000000ULL &&
+           readSectors((uint32_t)sector, dst, ns);
+  }
+  /** Write sectors with a 64-bit sector address.
+   * \return true for success or false for failure.
+   */
+  virtual bool writeSectors64(uint64_t sector, const uint8_t* src, size_t ns) {
+    return (sector + ns) <= 0X100000000ULL &&
+           writeSectors((uint32_t)sector, src, ns);
+  }
   /** \return USB drive status. */
   virtual uint32_t status() {return 0XFFFFFFFF;}
 
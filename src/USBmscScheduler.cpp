@@ -0,0 +1,214 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "USBmscScheduler.h"
+
+//------------------------------------------------------------------------------
+bool USBmscIoScheduler::begin(BlockDeviceInterface* dev, uint8_t* buf,
+                              uint32_t* sectors, uint16_t* order,
+                              uint16_t count, USBMSCDevice* usb) {
+  if (!dev || !buf || !sectors || !order || count < 2) {
+    return false;
+  }
+  m_dev = dev;
+  m_usb = usb;
+  if (usb) {
+    usb->connect();
+  }
+  m_generation = usb ? usb->generation() : 0;
+  m_buf = buf;
+  m_sectors = sectors;
+  m_order = order;
+  m_count = count;
+  m_used = 0;
+  m_requests = 0;
+  m_writeBacks = 0;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool USBmscIoScheduler::fenced() {
+  if (m_usb && m_usb->generation() != m_generation) {
+    // Staged data belongs to media that is gone.
+    m_used = 0;
+    return true;
+  }
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Position in m_order of the first staged sector not below sector.
+uint16_t USBmscIoScheduler::lowerBound(uint32_t sector) const {
+  uint16_t lo = 0;
+  uint16_t hi = m_used;
+  while (lo < hi) {
+    uint16_t mid = (lo + hi)/2;
+    if (m_sectors[m_order[mid]] < sector) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+//------------------------------------------------------------------------------
+// Drop the staged sector at pos, the last slot moves into its place.
+void USBmscIoScheduler::remove(uint16_t pos) {
+  uint16_t slot = m_order[pos];
+  uint16_t last = m_used - 1;
+
+  memmove(&m_order[pos], &m_order[pos + 1], (last - pos)*sizeof(uint16_t));
+  m_used = last;
+  if (slot != last) {
+    memcpy(data(slot), data(last), 512);
+    m_sectors[slot] = m_sectors[last];
+    m_order[lowerBound(m_sectors[slot])] = slot;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Move the staged data into LBA order, slot i then holds m_order[i].
+// Each cycle of the permutation is rotated through one sector of stack.
+void USBmscIoScheduler::sortSlots() {
+  uint8_t tmp[512];
+
+  for (uint16_t i = 0; i < m_used; i++) {
+    if (m_order[i] == i) {
+      continue;
+    }
+    uint32_t tmpSector = m_sectors[i];
+    uint16_t j = i;
+    memcpy(tmp, data(i), 512);
+    while (m_order[j] != i) {
+      uint16_t k = m_order[j];
+      memcpy(data(j), data(k), 512);
+      m_sectors[j] = m_sectors[k];
+      m_order[j] = j;
+      j = k;
+    }
+    memcpy(data(j), tmp, 512);
+    m_sectors[j] = tmpSector;
+    m_order[j] = j;
+  }
+}
+
+//------------------------------------------------------------------------------
+bool USBmscIoScheduler::flush() {
+  uint16_t i = 0;
+
+  if (fenced()) {
+    return false;
+  }
+  sortSlots();
+  while (i < m_used) {
+    uint16_t n = 1;
+    while ((i + n) < m_used && m_sectors[i + n] == (m_sectors[i] + n)) {
+      n++;
+    }
+    // On failure everything stays staged, runs already written are
+    // written again by the next flush.
+    if (!m_dev->writeSectors(m_sectors[i], data(i), n)) {
+      return false;
+    }
+    m_writeBacks++;
+    i += n;
+  }
+  m_used = 0;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool USBmscIoScheduler::readSectors(uint32_t sector, uint8_t* dst, size_t ns) {
+  uint16_t pos;
+  size_t i = 0;
+
+  if (fenced()) {
+    return false;
+  }
+  pos = lowerBound(sector);
+  // Copy staged sectors, read the gaps between them straight into dst.
+  while (i < ns) {
+    uint32_t next = pos < m_used ? m_sectors[m_order[pos]] : 0XFFFFFFFF;
+    if (next == (sector + i)) {
+      memcpy(dst + 512*i, data(m_order[pos]), 512);
+      pos++;
+      i++;
+      continue;
+    }
+    size_t n = ns - i;
+    if ((next - (sector + i)) < n) {
+      n = next - (sector + i);
+    }
+    if (!m_dev->readSectors(sector + i, dst + 512*i, n)) {
+      return false;
+    }
+    i += n;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool USBmscIoScheduler::writeSectors(uint32_t sector, const uint8_t* src,
+                                     size_t ns) {
+  if (fenced()) {
+    return false;
+  }
+  m_requests++;
+  if (ns > m_count/2U) {
+    // Too big to stage. It replaces any staged copies of its sectors.
+    uint16_t pos = lowerBound(sector);
+    while (pos < m_used && (m_sectors[m_order[pos]] - sector) < ns) {
+      remove(pos);
+    }
+    return m_dev->writeSectors(sector, src, ns);
+  }
+  for (size_t i = 0; i < ns; i++, src += 512) {
+    uint16_t pos = lowerBound(sector + i);
+    if (pos < m_used && m_sectors[m_order[pos]] == (sector + i)) {
+      memcpy(data(m_order[pos]), src, 512);
+      continue;
+    }
+    if (m_used == m_count) {
+      if (!flush()) {
+        return false;
+      }
+      pos = 0;
+    }
+    if (m_used == 0) {
+      m_oldest = m_requests;
+    }
+    memmove(&m_order[pos + 1], &m_order[pos], (m_used - pos)*sizeof(uint16_t));
+    m_order[pos] = m_used;
+    m_sectors[m_used] = sector + i;
+    memcpy(data(m_used), src, 512);
+    m_used++;
+  }
+  // Bound the wait of the oldest staged sector.
+  if (m_maxAge && m_used && (m_requests - m_oldest) >= m_maxAge) {
+    return flush();
+  }
+  return true;
+}
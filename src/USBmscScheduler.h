@@ -0,0 +1,165 @@
+/**
+ * Copyright (c) 2017-2020 Warren Watson
+ * This file is part of the SdFat library for use with MSC.
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef USBmscScheduler_h
+#define USBmscScheduler_h
+#include "SdFat.h"
+#include "USBMSCDevice.h"
+
+/** Default number of sectors staged by a USBmscScheduler. */
+#ifndef USB_MSC_SCHED_SECTORS
+#define USB_MSC_SCHED_SECTORS 32
+#endif
+/** Default number of later write requests a staged sector may wait. */
+#ifndef USB_MSC_SCHED_MAX_AGE
+#define USB_MSC_SCHED_MAX_AGE 64
+#endif
+
+/**
+ * \class USBmscIoScheduler
+ * \brief Write scheduler that sorts and merges queued sector writes.
+ *
+ * Wraps any BlockDeviceInterface, normally a USBMSCDevice, below a
+ * volume. Small writes, such as FAT, directory and partial data sectors
+ * from several open files, are copied into a staging buffer instead of
+ * each becoming a drive command. A write to a sector already staged
+ * replaces it. When the buffer is full, on syncDevice(), or once the
+ * oldest staged sector has waited for maxAge later write requests, the
+ * staged sectors are written in LBA order with one command per run of
+ * consecutive sectors.
+ *
+ * Reads cannot wait, SdFat needs the data at once. They are served from
+ * the staged sectors they overlap and the rest is read from the device
+ * with one command per run. Writes larger than half the buffer go
+ * straight to the device and replace any staged copies.
+ *
+ * Started with a USBMSCDevice, staged data is dropped instead of written
+ * once the drive's generation() changes, so it never reaches other media.
+ */
+class USBmscIoScheduler : public BlockDeviceInterface {
+ public:
+  USBmscIoScheduler() {}
+  /** Attach the scheduler to a device.
+   *
+   * \param[in] dev Device to be scheduled.
+   * \param[in] buf Buffer of count*512 bytes for staged sectors.
+   * \param[in] sectors Array of count sector numbers.
+   * \param[in] order Array of count slot numbers.
+   * \param[in] count Number of sectors that can be staged.
+   * \param[in] usb USB drive behind dev, or nullptr, for the media fence.
+   * \return true for success or false for failure.
+   */
+  bool begin(BlockDeviceInterface* dev, uint8_t* buf, uint32_t* sectors,
+             uint16_t* order, uint16_t count, USBMSCDevice* usb = nullptr);
+  /** \return The scheduled device. */
+  BlockDeviceInterface* device() {return m_dev;}
+  /** Write all staged sectors to the device.
+   * \return true for success or false for failure.
+   */
+  bool flush();
+  /** Drop all staged sectors. Their data is lost, call flush() first. */
+  void invalidate() {m_used = 0;}
+  /** Set how many later write requests a staged sector may wait before
+   * it is written, zero to wait for a full buffer or syncDevice().
+   * \param[in] maxAge Number of write requests.
+   */
+  void setMaxAge(uint32_t maxAge) {m_maxAge = maxAge;}
+  /** \return number of sectors waiting to be written. */
+  uint16_t staged() const {return m_used;}
+  /** \return number of write requests accepted. */
+  uint32_t requestCount() const {return m_requests;}
+  /** \return number of device writes issued for staged sectors. */
+  uint32_t writeBackCount() const {return m_writeBacks;}
+
+  // BlockDeviceInterface
+  bool isBusy() {return m_dev->isBusy();}
+  bool readSector(uint32_t sector, uint8_t* dst) {
+    return readSectors(sector, dst, 1);
+  }
+  bool readSectors(uint32_t sector, uint8_t* dst, size_t ns);
+  uint32_t sectorCount() {return m_dev->sectorCount();}
+  bool syncDevice() {return flush() && m_dev->syncDevice();}
+  bool writeSector(uint32_t sector, const uint8_t* src) {
+    return writeSectors(sector, src, 1);
+  }
+  bool writeSectors(uint32_t sector, const uint8_t* src, size_t ns);
+
+ private:
+  uint8_t* data(uint16_t slot) {return m_buf + 512UL*slot;}
+  bool fenced();
+  uint16_t lowerBound(uint32_t sector) const;
+  void remove(uint16_t pos);
+  void sortSlots();
+
+  BlockDeviceInterface* m_dev = nullptr;
+  USBMSCDevice* m_usb = nullptr;
+  uint32_t m_generation = 0;
+  uint8_t* m_buf = nullptr;
+  uint32_t* m_sectors = nullptr;
+  uint16_t* m_order = nullptr;
+  uint16_t m_count = 0;
+  uint16_t m_used = 0;
+  uint32_t m_maxAge = USB_MSC_SCHED_MAX_AGE;
+  uint32_t m_oldest = 0;
+  uint32_t m_requests = 0;
+  uint32_t m_writeBacks = 0;
+};
+
+/**
+ * \class USBmscScheduler
+ * \brief USBmscIoScheduler with its own storage.
+ *
+ * \code
+ * USBmscScheduler<32> sched;  // 32 staged sectors, 16 KB.
+ * sched.begin(msc.usbDrive());
+ * vol.begin(&sched);
+ * \endcode
+ */
+template <uint16_t SECTORS = USB_MSC_SCHED_SECTORS>
+class USBmscScheduler : public USBmscIoScheduler {
+ public:
+  /** Attach the scheduler to a device.
+   * \param[in] dev Device to be scheduled.
+   * \return true for success or false for failure.
+   */
+  bool begin(BlockDeviceInterface* dev) {
+    return USBmscIoScheduler::begin(dev, reinterpret_cast<uint8_t*>(m_buf),
+                                    m_sectors, m_order, SECTORS);
+  }
+  /** Attach the scheduler to a USB drive, staged data is dropped if the
+   * drive is unplugged or its media changes.
+   * \param[in] dev USB drive to be scheduled.
+   * \return true for success or false for failure.
+   */
+  bool begin(USBMSCDevice* dev) {
+    return USBmscIoScheduler::begin(dev, reinterpret_cast<uint8_t*>(m_buf),
+                                    m_sectors, m_order, SECTORS, dev);
+  }
+ private:
+  uint32_t m_buf[SECTORS*512/4];
+  uint32_t m_sectors[SECTORS];
+  uint16_t m_order[SECTORS];
+};
+#endif  // USBmscScheduler_h
@@ -34,8 +34,8 @@
 #endif
 #include <FS.h>
 
-#if defined(__arm__)
-  // Support everything on 32 bit boards with enough memory
+#if defined(__arm__) || defined(MSC_HOST_SIM)
+  // Support everything on 32 bit boards with enough memory and host builds
   #define MSCFAT_FILE PFsFile
   #define MSCFAT_BASE UsbFs
   #define MSC_MAX_FILENAME_LEN 256
@@ -160,8 +160,8 @@ public:
 	}
 	File open(const char *filepath, uint8_t mode = FILE_READ) {
 		oflag_t flags = O_READ;
-		if (mode == FILE_WRITE) {flags = O_RDWR | O_CREAT | O_AT_END; _cached_usedSize_valid = false; }
-		else if (mode == FILE_WRITE_BEGIN) {flags = O_RDWR | O_CREAT;  _cached_usedSize_valid = false; }
+		if (mode == FILE_WRITE) {flags = O_RDWR | O_CREAT | O_AT_END; }
+		else if (mode == FILE_WRITE_BEGIN) {flags = O_RDWR | O_CREAT; }
 		MSCFAT_FILE file = mscfs.open(filepath, flags);
 		if (file) return File(new MSCFile(file));
 			return File();
@@ -170,43 +170,27 @@ public:
 		return mscfs.exists(filepath);
 	}
 	bool mkdir(const char *filepath) {
-		_cached_usedSize_valid = false;
 		return mscfs.mkdir(filepath);
 	}
 	bool rename(const char *oldfilepath, const char *newfilepath) {
-		_cached_usedSize_valid = false;
 		return mscfs.rename(oldfilepath, newfilepath);
 	}
 	bool remove(const char *filepath) {
-		_cached_usedSize_valid = false;
 		return mscfs.remove(filepath);
 	}
 	bool rmdir(const char *filepath) {
-		_cached_usedSize_valid = false;
 		return mscfs.rmdir(filepath);
 	}
-	uint64_t usedSize() {	
-		#if 1
+	uint64_t usedSize() {
+		// Scans the FAT or bitmap on the first call after a mount only.
 		return  (uint64_t)(mscfs.clusterCount() - mscfs.freeClusterCount())
 		  		* (uint64_t)mscfs.bytesPerCluster();
-		#else
-		Serial.printf("$$$mscFS::usedSize %u %llu\n", _cached_usedSize_valid, _cached_usedSize);
-		if (!_cached_usedSize_valid) {
-			_cached_usedSize_valid = true;
-			_cached_usedSize =  (uint64_t)(mscfs.clusterCount() - mscfs.freeClusterCount())
-		  		* (uint64_t)mscfs.bytesPerCluster();
-	  	}
-		return _cached_usedSize;
-		#endif
 	}
 	uint64_t totalSize() {
 		return (uint64_t)mscfs.clusterCount() * (uint64_t)mscfs.bytesPerCluster();
 	}
 public: // allow access, so users can mix MSC & SdFat APIs
 	MSCFAT_BASE mscfs;
-protected:
-	uint64_t _cached_usedSize;
-	bool 	_cached_usedSize_valid = false;
 };
 
 extern MSCClass MSC;